@@ -0,0 +1,244 @@
+//  oooo  oooo
+//  `888  `888
+//   888   888  ooo. .oo.  .oo.    .ooooo oo
+//   888   888  `888P"Y88bP"Y88b  d88' `888
+//   888   888   888   888   888  888   888
+//  o888o o888o o888o o888o o888o `V8bod888
+//  ┌─────────────────────────────────┐ 888
+//  │ a query CLI and context manager │ 888.
+//  │ for LLM-powered shell pipelines │ 8P'
+//  └─────────────────────────────────┘ "
+//  Copyright (C) 2023 Justin Collier <m@jpcx.dev>
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// compares the per-request overhead of the coroutine executor with thread-per-request.
+// both make N concurrent requests to a loopback server that replies immediately.
+//
+// usage: executor [N]
+
+#include "executor.h"
+
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace llmq;
+using clock_type = std::chrono::steady_clock;
+
+namespace {
+
+constexpr std::string_view response = "HTTP/1.1 200 OK\r\n"
+                                      "Content-Type: text/event-stream\r\n"
+                                      "Content-Length: 64\r\n"
+                                      "Connection: close\r\n"
+                                      "\r\n"
+                                      "data: {\"choices\":[{\"delta\":{\"content\":\"hello\"}}]}\n\n"
+                                      "data: [DONE]\n";
+
+[[noreturn]] void
+fail(char const* what) {
+	std::perror(what);
+	std::exit(1);
+}
+
+// answers every request on 127.0.0.1 from one epoll thread
+struct server {
+	server() {
+		_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (_fd < 0)
+			fail("socket");
+		int one = 1;
+		::setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		sockaddr_in addr{};
+		addr.sin_family      = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t len        = sizeof(addr);
+		if (::bind(_fd, (sockaddr*)&addr, len) < 0 || ::listen(_fd, 4096) < 0 ||
+		    ::getsockname(_fd, (sockaddr*)&addr, &len) < 0)
+			fail("bind");
+		url = "http://127.0.0.1:" + std::to_string(ntohs(addr.sin_port)) + "/";
+		_thread = std::thread{[this] {
+			serve();
+		}};
+	}
+
+	~server() {
+		_stop = true;
+		_thread.join();
+		::close(_fd);
+	}
+
+	std::string url;
+
+   private:
+	int               _fd;
+	std::atomic<bool> _stop{false};
+	std::thread       _thread;
+
+	void
+	serve() {
+		int ep = ::epoll_create1(EPOLL_CLOEXEC);
+		::epoll_event ev{};
+		ev.events  = EPOLLIN;
+		ev.data.fd = _fd;
+		::epoll_ctl(ep, EPOLL_CTL_ADD, _fd, &ev);
+		std::array<::epoll_event, 64> ready;
+		char                          buf[4096];
+		while (!_stop) {
+			int n = ::epoll_wait(ep, ready.data(), ready.size(), 50);
+			for (int i = 0; i < n; ++i) {
+				int fd = ready[i].data.fd;
+				if (fd == _fd) {
+					int c;
+					while ((c = ::accept4(_fd, nullptr, nullptr,
+					                      SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+						ev.data.fd = c;
+						::epoll_ctl(ep, EPOLL_CTL_ADD, c, &ev);
+					}
+					continue;
+				}
+				// requests are small enough to arrive in one read
+				if (::read(fd, buf, sizeof(buf)) > 0)
+					(void)!::write(fd, response.data(), response.size());
+				::close(fd);
+			}
+		}
+		::close(ep);
+	}
+};
+
+[[nodiscard]] CURL*
+make_handle(std::string const& url) {
+	CURL* curl = ::curl_easy_init();
+	::curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	::curl_easy_setopt(curl, CURLOPT_POSTFIELDS, "{\"messages\":[]}");
+	return curl;
+}
+
+[[nodiscard]] long
+max_rss_kb() {
+	::rusage u{};
+	::getrusage(RUSAGE_SELF, &u);
+	return u.ru_maxrss;
+}
+
+void
+report(char const* name, std::size_t n, clock_type::duration d, std::size_t bytes) {
+	auto us = std::chrono::duration<double, std::micro>(d).count();
+	std::printf("%-20s %6zu requests %10.1f ms %8.1f us/request %8zu bytes  maxrss %ld KiB\n",
+	            name, n, us / 1000, us / n, bytes, max_rss_kb());
+}
+
+task<>
+fetch(executor& ex, std::string const& url, std::size_t& bytes) {
+	CURL*            curl = make_handle(url);
+	executor::stream s{ex, curl};
+	while (auto batch = co_await s.next())
+		bytes += batch->size();
+	::curl_easy_cleanup(curl);
+}
+
+void
+bench_executor(std::string const& url, std::size_t n) {
+	std::size_t bytes = 0;
+	auto        start = clock_type::now();
+	executor    ex;
+	for (std::size_t i = 0; i < n; ++i)
+		ex.spawn(fetch(ex, url, bytes));
+	ex.run();
+	report("executor (1 thread)", n, clock_type::now() - start, bytes);
+}
+
+size_t
+count(char*, size_t size, size_t nmemb, void* bytes) {
+	static_cast<std::atomic<std::size_t>*>(bytes)->fetch_add(size * nmemb);
+	return size * nmemb;
+}
+
+void
+bench_threads(std::string const& url, std::size_t n) {
+	std::atomic<std::size_t> bytes{0};
+	auto                     start = clock_type::now();
+	std::vector<std::thread> threads;
+	threads.reserve(n);
+	for (std::size_t i = 0; i < n; ++i)
+		threads.emplace_back([&] {
+			CURL* curl = make_handle(url);
+			::curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, count);
+			::curl_easy_setopt(curl, CURLOPT_WRITEDATA, &bytes);
+			::curl_easy_perform(curl);
+			::curl_easy_cleanup(curl);
+		});
+	for (auto&& t : threads)
+		t.join();
+	report("thread-per-request", n, clock_type::now() - start, bytes);
+}
+
+task<std::size_t>
+leaf(std::size_t i) {
+	co_return i;
+}
+
+task<>
+chain(std::size_t& sum) {
+	sum += co_await leaf(1);
+}
+
+// the cost of a task without I/O: spawn, start, await a nested task, and return
+void
+bench_tasks(std::size_t n) {
+	std::size_t sum   = 0;
+	auto        start = clock_type::now();
+	executor    ex;
+	for (std::size_t i = 0; i < n; ++i)
+		ex.spawn(chain(sum));
+	ex.run();
+	auto ns = std::chrono::duration<double, std::nano>(clock_type::now() - start).count();
+	std::printf("%-20s %6zu tasks    %10.1f ms %8.1f ns/task\n", "tasks (no I/O)", sum,
+	            ns / 1e6, ns / n);
+}
+
+} // namespace
+
+int
+main(int argc, char** argv) {
+	std::size_t n = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 512;
+	if (!n)
+		n = 512;
+
+	// each request holds a client and a server socket
+	::rlimit l{};
+	::getrlimit(RLIMIT_NOFILE, &l);
+	l.rlim_cur = l.rlim_max;
+	::setrlimit(RLIMIT_NOFILE, &l);
+
+	::curl_global_init(CURL_GLOBAL_DEFAULT);
+	{
+		server srv;
+		bench_tasks(n * 100);
+		bench_executor(srv.url, n);
+		bench_threads(srv.url, n);
+	}
+	::curl_global_cleanup();
+}
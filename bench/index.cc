@@ -0,0 +1,168 @@
+//  oooo  oooo
+//  `888  `888
+//   888   888  ooo. .oo.  .oo.    .ooooo oo
+//   888   888  `888P"Y88bP"Y88b  d88' `888
+//   888   888   888   888   888  888   888
+//  o888o o888o o888o o888o o888o `V8bod888
+//  ┌─────────────────────────────────┐ 888
+//  │ a query CLI and context manager │ 888.
+//  │ for LLM-powered shell pipelines │ 8P'
+//  └─────────────────────────────────┘ "
+//  Copyright (C) 2023 Justin Collier <m@jpcx.dev>
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+// measures nearest-neighbor search over a local vector index: the inner product kernels
+// (in cache), a full scan, and a clustered (IVF) scan with its recall of the exact top 10. N unit
+// vectors of D dimensions are drawn around 1000 random centers, and each query is a
+// perturbed vector of the index.
+//
+// usage: index [N] [D]
+
+#include "index.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace llmq;
+using clock_type = std::chrono::steady_clock;
+
+namespace {
+
+constexpr std::size_t queries = 50;
+constexpr std::size_t k       = 10;
+
+[[nodiscard]] double
+ms_since(clock_type::time_point start) {
+	return std::chrono::duration<double, std::milli>(clock_type::now() - start).count();
+}
+
+[[nodiscard]] std::vector<float>
+make_vectors(std::size_t n, std::size_t dims, std::mt19937& rng) {
+	std::normal_distribution<float> normal;
+	std::vector<float>              centers(1000 * dims);
+	for (auto& x : centers)
+		x = normal(rng);
+	std::vector<float>                         v(n * dims);
+	std::uniform_int_distribution<std::size_t> center(0, 999);
+	for (std::size_t i = 0; i < n; ++i) {
+		std::size_t c = center(rng);
+		for (std::size_t j = 0; j < dims; ++j)
+			v[i * dims + j] = centers[c * dims + j] + 1.5f * normal(rng);
+	}
+	return v;
+}
+
+// scans a block of vectors small enough to stay in cache, so the kernel is the bottleneck
+void
+bench_kernel(char const* name, simd::dots_fn dots, std::vector<float> const& v,
+             std::size_t dims) {
+	std::size_t        n = std::min<std::size_t>(v.size() / dims, (256 << 10) / (dims * 4));
+	std::size_t        reps = 20000000 / (n * dims) + 1;
+	std::vector<float> out(n);
+	auto               start = clock_type::now();
+	for (std::size_t r = 0; r < reps; ++r)
+		dots(&v[r % 8 * dims], reinterpret_cast<char const*>(v.data()), dims * sizeof(float), n,
+		     dims, out.data());
+	double ms = ms_since(start);
+	std::printf("%-8s %10.2f GFLOP/s\n", name, 2.0 * reps * n * dims / ms / 1e6);
+}
+
+// searches every query; returns the hits of each
+std::vector<std::vector<vector_index::hit>>
+bench_search(char const* name, vector_index const& index, std::vector<float> const& q,
+             std::size_t nprobe, pool* workers,
+             std::vector<std::vector<vector_index::hit>> const* exact) {
+	std::size_t                                 dims = index.dims();
+	std::vector<std::vector<vector_index::hit>> res;
+	auto                                        start = clock_type::now();
+	for (std::size_t i = 0; i < queries; ++i)
+		res.push_back(index.search({&q[i * dims], dims}, k, nprobe, workers));
+	double ms = ms_since(start) / queries;
+
+	double recall = 1;
+	if (exact) {
+		std::size_t found = 0;
+		for (std::size_t i = 0; i < queries; ++i)
+			for (auto h : res[i])
+				for (auto e : (*exact)[i])
+					found += h.id == e.id;
+		recall = (double)found / (queries * k);
+	}
+	std::printf("%-8s %2zu threads nprobe %4zu %8.3f ms/query  recall@%zu %.3f\n", name,
+	            workers ? workers->size() : 1, nprobe, ms, k, recall);
+	return res;
+}
+
+} // namespace
+
+int
+main(int argc, char** argv) {
+	std::size_t n    = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 200000;
+	std::size_t dims = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 256;
+	if (!n || !dims || n > std::numeric_limits<std::uint32_t>::max())
+		return (std::fputs("usage: index [N] [D]\n", stderr), 1);
+
+	std::mt19937 rng{42};
+	auto         v = make_vectors(n, dims, rng);
+	std::vector<float> q(queries * dims);
+	std::uniform_int_distribution<std::size_t> pick(0, n - 1);
+	std::normal_distribution<float>            normal;
+	for (std::size_t i = 0; i < queries; ++i) {
+		std::size_t p = pick(rng);
+		for (std::size_t j = 0; j < dims; ++j)
+			q[i * dims + j] = v[p * dims + j] + 0.25f * normal(rng);
+	}
+
+	bench_kernel("scalar", simd::dots_scalar, v, dims);
+	bench_kernel("simd", simd::dots, v, dims);
+
+	char tmpl[] = "/tmp/llmq-bench-index-XXXXXX";
+	if (!::mkdtemp(tmpl))
+		return (std::perror("mkdtemp"), 1);
+	std::filesystem::path base = std::filesystem::path{tmpl} / "index";
+
+	auto                          start = clock_type::now();
+	std::vector<std::string>      texts(n);
+	std::vector<std::string_view> views(n);
+	for (std::size_t i = 0; i < n; ++i)
+		views[i] = texts[i] = "item " + std::to_string(i);
+	vector_index::append(base, views, v, dims);
+	std::printf("append   %10.1f ms\n", ms_since(start));
+
+	unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+	pool     workers{hw};
+
+	vector_index index{base};
+	auto         exact = bench_search("flat", index, q, 0, nullptr, nullptr);
+	bench_search("flat", index, q, 0, &workers, &exact);
+
+	start = clock_type::now();
+	bool clustered = index.cluster(workers);
+	std::printf("cluster  %10.1f ms (%zu clusters, %u threads)\n", ms_since(start),
+	            index.clusters(), hw);
+	if (clustered)
+		for (std::size_t nprobe : {8, 32, 128}) {
+			bench_search("ivf", index, q, nprobe, nullptr, &exact);
+			bench_search("ivf", index, q, nprobe, &workers, &exact);
+		}
+
+	std::filesystem::remove_all(tmpl);
+}
@@ -0,0 +1,136 @@
+//  oooo  oooo
+//  `888  `888
+//   888   888  ooo. .oo.  .oo.    .ooooo oo
+//   888   888  `888P"Y88bP"Y88b  d88' `888
+//   888   888   888   888   888  888   888
+//  o888o o888o o888o o888o o888o `V8bod888
+//  ┌─────────────────────────────────┐ 888
+//  │ a query CLI and context manager │ 888.
+//  │ for LLM-powered shell pipelines │ 8P'
+//  └─────────────────────────────────┘ "
+//  Copyright (C) 2023 Justin Collier <m@jpcx.dev>
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// measures the throughput of CPU-side stream processing on the work-stealing pool.
+// S streams each receive K chunks of a streamed chat completion; every chunk is parsed
+// and appended to its reply, in order, on the strand of its stream. the chunks are
+// posted from one thread, as the network thread would post them.
+//
+// usage: pool [S] [K]
+
+#include "3rdparty/ryml.hpp"
+#include "pool.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <latch>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace llmq;
+using clock_type = std::chrono::steady_clock;
+
+namespace {
+
+struct stream {
+	std::string content{};
+	std::size_t chunks{0};
+	bool        ordered{true};
+};
+
+[[nodiscard]] std::string
+make_chunk(std::size_t i) {
+	return "{\"id\":\"chatcmpl\",\"object\":\"chat.completion.chunk\",\"model\":\"m\","
+	       "\"choices\":[{\"index\":0,\"delta\":{\"content\":\"token " +
+	       std::to_string(i) + " \"},\"finish_reason\":null}]}";
+}
+
+// the work of a session for one chunk: parse it and integrate the delta
+void
+process(stream& s, std::string chunk, std::size_t i) {
+	ryml::Tree  t = ryml::parse_in_place(ryml::substr{chunk.data(), chunk.size()});
+	std::string delta;
+	t["choices"][0]["delta"]["content"] >> delta;
+	s.ordered &= delta == "token " + std::to_string(i) + " ";
+	s.content += delta;
+	++s.chunks;
+}
+
+void
+report(char const* name, unsigned threads, std::size_t chunks, clock_type::duration d,
+       std::vector<stream> const& streams) {
+	bool ok = true;
+	for (auto&& s : streams)
+		ok &= s.ordered && s.chunks * streams.size() == chunks;
+	auto ms = std::chrono::duration<double, std::milli>(d).count();
+	std::printf("%-8s %2u threads %10.1f ms %12.0f chunks/s%s\n", name, threads, ms,
+	            chunks / (ms / 1000), ok ? "" : "  (OUT OF ORDER)");
+	if (!ok)
+		std::exit(1);
+}
+
+void
+bench_inline(std::size_t nstreams, std::size_t nchunks) {
+	std::vector<stream> streams(nstreams);
+	auto                start = clock_type::now();
+	for (std::size_t i = 0; i < nchunks; ++i)
+		for (auto&& s : streams)
+			process(s, make_chunk(i), i);
+	report("inline", 1, nstreams * nchunks, clock_type::now() - start, streams);
+}
+
+void
+bench_pool(std::size_t nstreams, std::size_t nchunks, unsigned threads) {
+	std::vector<stream> streams(nstreams);
+	auto                start = clock_type::now();
+	// the pool finishes its jobs before the strands are destroyed
+	std::vector<std::unique_ptr<pool::strand>> strands;
+	{
+		pool p{threads};
+		for (std::size_t i = 0; i < nstreams; ++i)
+			strands.push_back(std::make_unique<pool::strand>(p));
+
+		std::latch done{(std::ptrdiff_t)nstreams};
+		for (std::size_t i = 0; i < nchunks; ++i)
+			for (std::size_t k = 0; k < nstreams; ++k)
+				strands[k]->post([&s = streams[k], c = make_chunk(i), i]() mutable {
+					process(s, std::move(c), i);
+				});
+		for (auto&& s : strands)
+			s->post([&done] {
+				done.count_down();
+			});
+		done.wait();
+	}
+	report("pool", threads, nstreams * nchunks, clock_type::now() - start, streams);
+}
+
+} // namespace
+
+int
+main(int argc, char** argv) {
+	std::size_t nstreams = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 256;
+	std::size_t nchunks  = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 200;
+	if (!nstreams || !nchunks)
+		return (std::fputs("usage: pool [S] [K]\n", stderr), 1);
+
+	bench_inline(nstreams, nchunks);
+	unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+	for (unsigned t = 1; t < hw; t *= 2)
+		bench_pool(nstreams, nchunks, t);
+	bench_pool(nstreams, nchunks, hw);
+}
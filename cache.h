@@ -0,0 +1,129 @@
+#ifndef LLMQ_CACHE_H_INCLUDED
+#define LLMQ_CACHE_H_INCLUDED
+//  oooo  oooo
+//  `888  `888
+//   888   888  ooo. .oo.  .oo.    .ooooo oo
+//   888   888  `888P"Y88bP"Y88b  d88' `888
+//   888   888   888   888   888  888   888
+//  o888o o888o o888o o888o o888o `V8bod888
+//  ┌─────────────────────────────────┐ 888
+//  │ a query CLI and context manager │ 888.
+//  │ for LLM-powered shell pipelines │ 8P'
+//  └─────────────────────────────────┘ "
+//  Copyright (C) 2023 Justin Collier <m@jpcx.dev>
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace llmq {
+
+// the 64-bit FNV-1a hash of a text, for naming and indexing cached content
+[[nodiscard]] inline std::uint64_t
+content_hash(std::string_view s) noexcept {
+	std::uint64_t h = 14695981039346656037ull;
+	for (char c : s) {
+		h ^= (unsigned char)c;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+// a filename for a hash (16 hex digits)
+[[nodiscard]] inline std::string
+hash_name(std::uint64_t hash) {
+	char buf[17];
+	std::snprintf(buf, sizeof buf, "%016llx", (unsigned long long)hash);
+	return buf;
+}
+
+// a filename for a text (its content_hash)
+[[nodiscard]] inline std::string
+hash_name(std::string_view s) {
+	return hash_name(content_hash(s));
+}
+
+// the SHA-256 digest of a text in hex, for keys that must not collide or be recoverable
+[[nodiscard]] inline std::string
+digest(std::string_view s) {
+	static constexpr std::uint32_t k[64] = {
+	    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+	    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+	    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+	    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+	    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+	    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+	    0xc67178f2,
+	};
+	std::uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	                      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+	auto rotr = [](std::uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+
+	// the message, a 1 bit, zeros, and its length in bits fill whole 64-byte blocks
+	std::string msg{s};
+	msg += '\x80';
+	msg.append((120 - msg.size() % 64) % 64, '\0');
+	for (int i = 7; i >= 0; --i)
+		msg += (char)((std::uint64_t)s.size() * 8 >> (i * 8));
+
+	for (std::size_t at = 0; at < msg.size(); at += 64) {
+		std::uint32_t w[64];
+		for (int i = 0; i < 16; ++i)
+			w[i] = (std::uint32_t)(unsigned char)msg[at + i * 4] << 24 |
+			       (std::uint32_t)(unsigned char)msg[at + i * 4 + 1] << 16 |
+			       (std::uint32_t)(unsigned char)msg[at + i * 4 + 2] << 8 |
+			       (std::uint32_t)(unsigned char)msg[at + i * 4 + 3];
+		for (int i = 16; i < 64; ++i)
+			w[i] = w[i - 16] + (rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			       w[i - 7] + (rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10));
+		std::uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6],
+		              x = h[7];
+		for (int i = 0; i < 64; ++i) {
+			std::uint32_t t1 = x + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) +
+			                   ((e & f) ^ (~e & g)) + k[i] + w[i];
+			std::uint32_t t2 =
+			    (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			x = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;
+		}
+		h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e, h[5] += f, h[6] += g, h[7] += x;
+	}
+
+	char buf[65];
+	for (int i = 0; i < 8; ++i)
+		std::snprintf(buf + i * 8, 9, "%08x", h[i]);
+	return buf;
+}
+
+// the directory of a cache: $XDG_CACHE_HOME/llmq/NAME or ~/.cache/llmq/NAME
+[[nodiscard]] inline std::filesystem::path
+cache_dir(std::filesystem::path const& name) {
+	if (char const* dir = std::getenv("XDG_CACHE_HOME"))
+		return std::filesystem::path{dir} / "llmq" / name;
+	if (char const* home = std::getenv("HOME"))
+		return std::filesystem::path{home} / ".cache/llmq" / name;
+	throw std::runtime_error{"could not find $XDG_CACHE_HOME or $HOME for the cache " +
+	                         name.string()};
+}
+
+} // namespace llmq
+
+#endif
@@ -0,0 +1,670 @@
+#ifndef LLMQ_EXECUTOR_H_INCLUDED
+#define LLMQ_EXECUTOR_H_INCLUDED
+//  oooo  oooo
+//  `888  `888
+//   888   888  ooo. .oo.  .oo.    .ooooo oo
+//   888   888  `888P"Y88bP"Y88b  d88' `888
+//   888   888   888   888   888  888   888
+//  o888o o888o o888o o888o o888o `V8bod888
+//  ┌─────────────────────────────────┐ 888
+//  │ a query CLI and context manager │ 888.
+//  │ for LLM-powered shell pipelines │ 8P'
+//  └─────────────────────────────────┘ "
+//  Copyright (C) 2023 Justin Collier <m@jpcx.dev>
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <curl/curl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <csignal>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace llmq {
+
+template <class T = void>
+struct task;
+
+namespace impl {
+template <class T>
+struct task_promise_base {
+	std::coroutine_handle<> continuation{std::noop_coroutine()};
+	std::exception_ptr      error{};
+
+	// resumes the awaiter by symmetric transfer, so long chains do not grow the stack
+	struct final_awaiter {
+		[[nodiscard]] bool
+		await_ready() const noexcept {
+			return false;
+		}
+
+		template <class P>
+		[[nodiscard]] std::coroutine_handle<>
+		await_suspend(std::coroutine_handle<P> h) noexcept {
+			return h.promise().continuation;
+		}
+
+		void
+		await_resume() const noexcept {}
+	};
+
+	[[nodiscard]] std::suspend_always
+	initial_suspend() const noexcept {
+		return {};
+	}
+
+	[[nodiscard]] final_awaiter
+	final_suspend() const noexcept {
+		return {};
+	}
+
+	void
+	unhandled_exception() noexcept {
+		error = std::current_exception();
+	}
+};
+
+template <class T>
+struct task_promise : task_promise_base<T> {
+	std::optional<T> value{};
+
+	[[nodiscard]] task<T> get_return_object() noexcept;
+
+	void
+	return_value(T v) {
+		value.emplace(std::move(v));
+	}
+
+	[[nodiscard]] T
+	result() {
+		if (this->error)
+			std::rethrow_exception(this->error);
+		return std::move(*value);
+	}
+};
+
+template <>
+struct task_promise<void> : task_promise_base<void> {
+	[[nodiscard]] task<void> get_return_object() noexcept;
+
+	void
+	return_void() const noexcept {}
+
+	void
+	result() const {
+		if (error)
+			std::rethrow_exception(error);
+	}
+};
+} // namespace impl
+
+// a lazily-started coroutine. awaiting a task starts it; the awaiter resumes when it returns.
+template <class T>
+struct [[nodiscard]] task {
+	using promise_type = impl::task_promise<T>;
+
+	explicit task(std::coroutine_handle<promise_type> h) noexcept : _h{h} {}
+	task(task&& other) noexcept : _h{std::exchange(other._h, {})} {}
+	task(task const&)            = delete;
+	task& operator=(task const&) = delete;
+	task& operator=(task&&)      = delete;
+	~task() {
+		if (_h)
+			_h.destroy();
+	}
+
+	[[nodiscard]] bool
+	await_ready() const noexcept {
+		return false;
+	}
+
+	[[nodiscard]] std::coroutine_handle<>
+	await_suspend(std::coroutine_handle<> awaiter) noexcept {
+		_h.promise().continuation = awaiter;
+		return _h;
+	}
+
+	T
+	await_resume() {
+		return _h.promise().result();
+	}
+
+   private:
+	std::coroutine_handle<promise_type> _h;
+};
+
+namespace impl {
+template <class T>
+task<T>
+task_promise<T>::get_return_object() noexcept {
+	return task<T>{std::coroutine_handle<task_promise<T>>::from_promise(*this)};
+}
+
+inline task<void>
+task_promise<void>::get_return_object() noexcept {
+	return task<void>{std::coroutine_handle<task_promise<void>>::from_promise(*this)};
+}
+} // namespace impl
+
+// runs tasks on one thread. their transfers are driven from epoll using the curl_multi
+// socket API; tasks suspend on streams and timers and are resumed once those are ready.
+// curl_global_init must be called first. throws std::system_error if epoll fails.
+struct executor {
+	using clock = std::chrono::steady_clock;
+
+	// a transfer whose response is handed to the awaiting task in batches. the handle is
+	// added to the executor on construction; the stream must outlive the transfer.
+	struct stream {
+		stream(executor& ex, CURL* curl) : _ex{ex}, _curl{curl} {
+			::curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, onwrite);
+			::curl_easy_setopt(curl, CURLOPT_WRITEDATA, this);
+			::curl_easy_setopt(curl, CURLOPT_PRIVATE, this);
+			auto mc = ::curl_multi_add_handle(ex._multi, curl);
+			if (mc != CURLM_OK)
+				throw std::runtime_error{::curl_multi_strerror(mc)};
+			ex._streams.push_back(this);
+		}
+		stream(stream const&)            = delete;
+		stream& operator=(stream const&) = delete;
+		~stream() {
+			end(CURLE_OK);
+		}
+
+		// awaits the bytes received since the last call, or nullopt once the transfer ends
+		[[nodiscard]] auto
+		next() noexcept {
+			struct awaiter {
+				stream& s;
+
+				[[nodiscard]] bool
+				await_ready() const noexcept {
+					return s.ready();
+				}
+
+				void
+				await_suspend(std::coroutine_handle<> h) noexcept {
+					s._waiter = h;
+				}
+
+				[[nodiscard]] std::optional<std::string>
+				await_resume() noexcept {
+					if (s._buf.empty())
+						return std::nullopt;
+					std::string batch = std::exchange(s._buf, {});
+					if (s._paused && !s._ended) {
+						s._paused = false;
+						::curl_easy_pause(s._curl, CURLPAUSE_CONT);
+					}
+					return batch;
+				}
+			};
+			return awaiter{*this};
+		}
+
+		// whether next would complete without suspending
+		[[nodiscard]] bool
+		ready() const noexcept {
+			return !_buf.empty() || _ended;
+		}
+
+		// aborts the transfer; its result becomes CURLE_WRITE_ERROR
+		void
+		cancel() noexcept {
+			_buf.clear();
+			end(CURLE_WRITE_ERROR);
+		}
+
+		// the result of the transfer once it has ended
+		[[nodiscard]] CURLcode
+		result() const noexcept {
+			return _res;
+		}
+
+	   private:
+		friend struct executor;
+
+		// responses are paused while this much is waiting for the task
+		static constexpr std::size_t max_buffer = 1 << 20;
+
+		executor&               _ex;
+		CURL*                   _curl;
+		std::string             _buf{};
+		bool                    _paused{false};
+		bool                    _ended{false};
+		CURLcode                _res{CURLE_OK};
+		std::coroutine_handle<> _waiter{};
+
+		void
+		wake() noexcept {
+			if (_waiter)
+				_ex._ready.push_back(std::exchange(_waiter, {}));
+		}
+
+		// removes the handle, unless it has already ended
+		void
+		end(CURLcode res) noexcept {
+			if (_ended)
+				return;
+			_ended = true;
+			_res   = res;
+			::curl_multi_remove_handle(_ex._multi, _curl);
+			std::erase(_ex._streams, this);
+			wake();
+		}
+
+		static size_t
+		onwrite(char* ptr, size_t size, size_t nmemb, void* stream_void) noexcept {
+			auto&  s   = *static_cast<stream*>(stream_void);
+			size_t len = size * nmemb;
+			if (s._buf.size() >= max_buffer) {
+				s._paused = true;
+				return CURL_WRITEFUNC_PAUSE;
+			}
+			s._buf.append(ptr, len);
+			s.wake();
+			return len;
+		}
+	};
+
+	executor() {
+		_multi = ::curl_multi_init();
+		if (!_multi)
+			throw std::runtime_error{"could not initialize cURL"};
+		_epfd = ::epoll_create1(EPOLL_CLOEXEC);
+		if (_epfd < 0) {
+			::curl_multi_cleanup(_multi);
+			throw std::system_error{errno, std::system_category(), "epoll_create1"};
+		}
+		_evfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		::epoll_event ev{};
+		ev.events  = EPOLLIN;
+		ev.data.fd = _evfd;
+		if (_evfd < 0 || ::epoll_ctl(_epfd, EPOLL_CTL_ADD, _evfd, &ev) < 0) {
+			int err = errno;
+			::curl_multi_cleanup(_multi);
+			::close(_epfd);
+			if (_evfd >= 0)
+				::close(_evfd);
+			throw std::system_error{err, std::system_category(), "eventfd"};
+		}
+		::curl_multi_setopt(_multi, CURLMOPT_SOCKETFUNCTION, onsocket);
+		::curl_multi_setopt(_multi, CURLMOPT_SOCKETDATA, this);
+		::curl_multi_setopt(_multi, CURLMOPT_TIMERFUNCTION, ontimer);
+		::curl_multi_setopt(_multi, CURLMOPT_TIMERDATA, this);
+		// transfers to the same host share HTTP/2 connections where possible
+		::curl_multi_setopt(_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	}
+	executor(executor const&)            = delete;
+	executor& operator=(executor const&) = delete;
+	~executor() {
+		for (auto s : std::vector<stream*>{_streams})
+			s->end(CURLE_ABORTED_BY_CALLBACK);
+		::curl_multi_cleanup(_multi);
+		::close(_epfd);
+		::close(_evfd);
+	}
+
+	// starts a task on the next turn of the loop. the executor owns it until it returns.
+	void
+	spawn(task<> t) {
+		++_live;
+		_ready.push_back(launch(std::move(t)).h);
+	}
+
+	// runs until every spawned task has returned. rethrows the first error of a spawned task.
+	void
+	run() {
+		std::array<::epoll_event, 64> events;
+		while (_live) {
+			while (!_ready.empty()) {
+				auto h = _ready.front();
+				_ready.pop_front();
+				h.resume();
+			}
+			if (!_live)
+				break;
+
+			if (_cancel && *_cancel) {
+				for (auto s : std::vector<stream*>{_streams})
+					s->end(CURLE_ABORTED_BY_CALLBACK);
+				for (auto [fd, h] : std::exchange(_watched, {})) {
+					::epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, nullptr);
+					_ready.push_back(h);
+				}
+				if (!_ready.empty())
+					continue;
+			}
+
+			if (_streams.empty() && _timers.empty() && _watched.empty() && !_away)
+				throw std::logic_error{"every task is waiting, but nothing can wake them"};
+
+			auto now  = clock::now();
+			auto wake = _timers.empty() ? _curl_deadline
+			                            : std::min(_curl_deadline, _timers.top().at);
+			int  wait = -1;
+			if (wake != clock::time_point::max())
+				wait = (int)std::chrono::ceil<std::chrono::milliseconds>(
+				           std::max(wake - now, clock::duration::zero()))
+				           .count();
+
+			int n = ::epoll_wait(_epfd, events.data(), events.size(), wait);
+			if (n < 0 && errno != EINTR)
+				throw std::system_error{errno, std::system_category(), "epoll_wait"};
+			for (int i = 0; i < n; ++i) {
+				if (events[i].data.fd == _evfd) {
+					receive();
+					continue;
+				}
+				if (wake_watcher(events[i].data.fd))
+					continue;
+				int ev = 0;
+				if (events[i].events & EPOLLIN)
+					ev |= CURL_CSELECT_IN;
+				if (events[i].events & EPOLLOUT)
+					ev |= CURL_CSELECT_OUT;
+				if (events[i].events & (EPOLLERR | EPOLLHUP))
+					ev |= CURL_CSELECT_ERR;
+				action(events[i].data.fd, ev);
+			}
+
+			now = clock::now();
+			if (now >= _curl_deadline) {
+				_curl_deadline = clock::time_point::max();
+				action(CURL_SOCKET_TIMEOUT, 0);
+			}
+			while (!_timers.empty() && _timers.top().at <= now) {
+				_ready.push_back(_timers.top().h);
+				_timers.pop();
+			}
+		}
+		if (_error)
+			std::rethrow_exception(std::exchange(_error, nullptr));
+	}
+
+	// suspends the awaiting task for at least d
+	[[nodiscard]] auto
+	sleep(clock::duration d) noexcept {
+		struct awaiter {
+			executor&         ex;
+			clock::time_point at;
+
+			[[nodiscard]] bool
+			await_ready() const noexcept {
+				return at <= clock::now();
+			}
+
+			void
+			await_suspend(std::coroutine_handle<> h) {
+				ex._timers.push({at, ex._seq++, h});
+			}
+
+			void
+			await_resume() const noexcept {}
+		};
+		return awaiter{*this, clock::now() + d};
+	}
+
+	// suspends the awaiting task and calls submit with a callback that resumes it on the
+	// executor thread. the callback may be called from any thread, exactly once.
+	template <class F>
+	[[nodiscard]] auto
+	handoff(F&& submit) noexcept {
+		struct awaiter {
+			executor& ex;
+			F         submit;
+
+			[[nodiscard]] bool
+			await_ready() const noexcept {
+				return false;
+			}
+
+			void
+			await_suspend(std::coroutine_handle<> h) {
+				++ex._away;
+				submit(std::function<void()>{[ex = &ex, h] {
+					ex->post(h);
+				}});
+			}
+
+			void
+			await_resume() const noexcept {}
+		};
+		return awaiter{*this, std::forward<F>(submit)};
+	}
+
+	// suspends the awaiting task until fd is readable. the fd must not be a transfer's.
+	// also resumes once cancelled (see cancel_on), so the task should check the flag.
+	[[nodiscard]] auto
+	readable(int fd) noexcept {
+		return fd_awaiter{*this, fd, EPOLLIN};
+	}
+
+	// suspends the awaiting task until fd is writable (see readable)
+	[[nodiscard]] auto
+	writable(int fd) noexcept {
+		return fd_awaiter{*this, fd, EPOLLOUT};
+	}
+
+	// ends every transfer with CURLE_ABORTED_BY_CALLBACK once *flag is set (e.g. by a
+	// signal handler), and resumes the tasks waiting on fds. whoever sets the flag calls
+	// interrupt() afterwards so the loop sees it.
+	void
+	cancel_on(volatile std::sig_atomic_t const* flag) noexcept {
+		_cancel = flag;
+	}
+
+	// wakes the loop to check the cancel flag. async-signal-safe; the eventfd stays
+	// readable until the loop drains it, so a wakeup sent just before the loop blocks is
+	// not lost, and it works whichever thread the signal is delivered to.
+	void
+	interrupt() const noexcept {
+		std::uint64_t one = 1;
+		(void)!::write(_evfd, &one, sizeof(one));
+	}
+
+   private:
+	struct fd_awaiter {
+		executor&     ex;
+		int           fd;
+		std::uint32_t events;
+
+		[[nodiscard]] bool
+		await_ready() const noexcept {
+			return ex._cancel && *ex._cancel;
+		}
+
+		void
+		await_suspend(std::coroutine_handle<> h) {
+			::epoll_event ev{};
+			ev.events  = events | EPOLLONESHOT;
+			ev.data.fd = fd;
+			if (::epoll_ctl(ex._epfd, EPOLL_CTL_MOD, fd, &ev) < 0 &&
+			    (errno != ENOENT || ::epoll_ctl(ex._epfd, EPOLL_CTL_ADD, fd, &ev) < 0))
+				throw std::system_error{errno, std::system_category(), "epoll_ctl"};
+			ex._watched.push_back({fd, h});
+		}
+
+		void
+		await_resume() const noexcept {}
+	};
+
+	// owns a spawned task, counting it down when it returns
+	struct root {
+		struct promise_type {
+			[[nodiscard]] root
+			get_return_object() noexcept {
+				return {std::coroutine_handle<promise_type>::from_promise(*this)};
+			}
+
+			[[nodiscard]] std::suspend_always
+			initial_suspend() const noexcept {
+				return {};
+			}
+
+			[[nodiscard]] std::suspend_never
+			final_suspend() const noexcept {
+				return {};
+			}
+
+			void
+			return_void() const noexcept {}
+
+			void
+			unhandled_exception() const noexcept {
+				std::terminate();
+			}
+		};
+
+		std::coroutine_handle<promise_type> h;
+	};
+
+	struct timer {
+		clock::time_point       at;
+		std::uint64_t           seq; // orders timers with the same deadline
+		std::coroutine_handle<> h;
+
+		[[nodiscard]] bool
+		operator>(timer const& other) const noexcept {
+			return std::tie(at, seq) > std::tie(other.at, other.seq);
+		}
+	};
+
+	CURLM*                                                          _multi;
+	int                                                             _epfd;
+	clock::time_point                                               _curl_deadline{clock::time_point::max()};
+	std::deque<std::coroutine_handle<>>                             _ready{};
+	std::priority_queue<timer, std::vector<timer>, std::greater<>> _timers{};
+	std::uint64_t                                                   _seq{0};
+	std::vector<stream*>                                            _streams{};
+	std::size_t                                                     _live{0};
+	std::exception_ptr                                              _error{};
+	volatile std::sig_atomic_t const*                               _cancel{nullptr};
+	int                                                             _evfd;
+	std::size_t                                                     _away{0}; // handed off
+	std::mutex                                                      _posted_mutex{};
+	std::vector<std::coroutine_handle<>>                            _posted{};
+	std::vector<std::pair<int, std::coroutine_handle<>>>            _watched{}; // see fd_awaiter
+
+	// queues h from another thread and wakes the loop
+	void
+	post(std::coroutine_handle<> h) {
+		{
+			std::lock_guard lock{_posted_mutex};
+			_posted.push_back(h);
+		}
+		std::uint64_t one = 1;
+		(void)!::write(_evfd, &one, sizeof(one));
+	}
+
+	// moves the tasks posted by other threads to the ready queue
+	void
+	receive() {
+		std::uint64_t n;
+		(void)!::read(_evfd, &n, sizeof(n));
+		std::lock_guard lock{_posted_mutex};
+		for (auto h : _posted)
+			_ready.push_back(h);
+		_away -= _posted.size();
+		_posted.clear();
+	}
+
+	// readies the task waiting on fd, if any. its registration is oneshot, so the fd
+	// reports nothing more until it is awaited again.
+	[[nodiscard]] bool
+	wake_watcher(int fd) {
+		auto it = std::ranges::find(_watched, fd, &std::pair<int, std::coroutine_handle<>>::first);
+		if (it == _watched.end())
+			return false;
+		_ready.push_back(it->second);
+		_watched.erase(it);
+		return true;
+	}
+
+	root
+	launch(task<> t) {
+		try {
+			co_await std::move(t);
+		} catch (...) {
+			if (!_error)
+				_error = std::current_exception();
+		}
+		--_live;
+	}
+
+	void
+	action(curl_socket_t fd, int ev) {
+		int  running;
+		auto mc = ::curl_multi_socket_action(_multi, fd, ev, &running);
+		if (mc != CURLM_OK)
+			throw std::runtime_error{::curl_multi_strerror(mc)};
+		int queued;
+		while (CURLMsg* m = ::curl_multi_info_read(_multi, &queued)) {
+			if (m->msg != CURLMSG_DONE)
+				continue;
+			stream* s;
+			::curl_easy_getinfo(m->easy_handle, CURLINFO_PRIVATE, &s);
+			s->end(m->data.result);
+		}
+	}
+
+	static int
+	onsocket(CURL*, curl_socket_t fd, int what, void* ex_void, void*) noexcept {
+		auto& ex = *static_cast<executor*>(ex_void);
+		if (what == CURL_POLL_REMOVE) {
+			::epoll_ctl(ex._epfd, EPOLL_CTL_DEL, fd, nullptr);
+			return 0;
+		}
+		::epoll_event ev{};
+		ev.data.fd = fd;
+		if (what & CURL_POLL_IN)
+			ev.events |= EPOLLIN;
+		if (what & CURL_POLL_OUT)
+			ev.events |= EPOLLOUT;
+		if (::epoll_ctl(ex._epfd, EPOLL_CTL_MOD, fd, &ev) < 0 &&
+		    (errno != ENOENT || ::epoll_ctl(ex._epfd, EPOLL_CTL_ADD, fd, &ev) < 0))
+			return -1;
+		return 0;
+	}
+
+	static int
+	ontimer(CURLM*, long timeout_ms, void* ex_void) noexcept {
+		auto& ex         = *static_cast<executor*>(ex_void);
+		ex._curl_deadline = timeout_ms < 0 ? clock::time_point::max()
+		                                   : clock::now() + std::chrono::milliseconds{timeout_ms};
+		return 0;
+	}
+};
+
+} // namespace llmq
+
+#endif
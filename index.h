@@ -0,0 +1,720 @@
+#ifndef LLMQ_INDEX_H_INCLUDED
+#define LLMQ_INDEX_H_INCLUDED
+//  oooo  oooo
+//  `888  `888
+//   888   888  ooo. .oo.  .oo.    .ooooo oo
+//   888   888  `888P"Y88bP"Y88b  d88' `888
+//   888   888   888   888   888  888   888
+//  o888o o888o o888o o888o o888o `V8bod888
+//  ┌─────────────────────────────────┐ 888
+//  │ a query CLI and context manager │ 888.
+//  │ for LLM-powered shell pipelines │ 8P'
+//  └─────────────────────────────────┘ "
+//  Copyright (C) 2023 Justin Collier <m@jpcx.dev>
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "cache.h"
+#include "pool.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <latch>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace llmq {
+
+// kernels for the inner products of a query with many vectors, chosen once for the CPU
+namespace simd {
+
+// computes the inner products of q with n vectors of dims floats, stride bytes apart
+using dots_fn = void (*)(float const* q, char const* base, std::size_t stride, std::size_t n,
+                         std::size_t dims, float* out) noexcept;
+
+inline void
+dots_scalar(float const* q, char const* base, std::size_t stride, std::size_t n,
+            std::size_t dims, float* out) noexcept {
+	for (std::size_t i = 0; i < n; ++i) {
+		auto*                v = reinterpret_cast<float const*>(base + i * stride);
+		std::array<float, 4> acc{};
+		std::size_t          j = 0;
+		for (; j + 4 <= dims; j += 4)
+			for (std::size_t l = 0; l < 4; ++l)
+				acc[l] += q[j + l] * v[j + l];
+		float r = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+		for (; j < dims; ++j)
+			r += q[j] * v[j];
+		out[i] = r;
+	}
+}
+
+#if defined(__x86_64__)
+// four independent accumulators of eight lanes, to hide the latency of the FMAs
+__attribute__((target("avx2,fma"))) inline void
+dots_avx2(float const* q, char const* base, std::size_t stride, std::size_t n,
+          std::size_t dims, float* out) noexcept {
+	for (std::size_t i = 0; i < n; ++i) {
+		auto*       v  = reinterpret_cast<float const*>(base + i * stride);
+		__m256      a0 = _mm256_setzero_ps(), a1 = a0, a2 = a0, a3 = a0;
+		std::size_t j  = 0;
+		for (; j + 32 <= dims; j += 32) {
+			a0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + j), _mm256_loadu_ps(v + j), a0);
+			a1 = _mm256_fmadd_ps(_mm256_loadu_ps(q + j + 8), _mm256_loadu_ps(v + j + 8), a1);
+			a2 = _mm256_fmadd_ps(_mm256_loadu_ps(q + j + 16), _mm256_loadu_ps(v + j + 16), a2);
+			a3 = _mm256_fmadd_ps(_mm256_loadu_ps(q + j + 24), _mm256_loadu_ps(v + j + 24), a3);
+		}
+		for (; j + 8 <= dims; j += 8)
+			a0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + j), _mm256_loadu_ps(v + j), a0);
+		__m256 s = _mm256_add_ps(_mm256_add_ps(a0, a1), _mm256_add_ps(a2, a3));
+		__m128 h = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+		h        = _mm_add_ps(h, _mm_movehl_ps(h, h));
+		h        = _mm_add_ss(h, _mm_movehdup_ps(h));
+		float r  = _mm_cvtss_f32(h);
+		for (; j < dims; ++j)
+			r += q[j] * v[j];
+		out[i] = r;
+	}
+}
+#elif defined(__aarch64__)
+inline void
+dots_neon(float const* q, char const* base, std::size_t stride, std::size_t n,
+          std::size_t dims, float* out) noexcept {
+	for (std::size_t i = 0; i < n; ++i) {
+		auto*       v  = reinterpret_cast<float const*>(base + i * stride);
+		float32x4_t a0 = vdupq_n_f32(0), a1 = a0, a2 = a0, a3 = a0;
+		std::size_t j  = 0;
+		for (; j + 16 <= dims; j += 16) {
+			a0 = vfmaq_f32(a0, vld1q_f32(q + j), vld1q_f32(v + j));
+			a1 = vfmaq_f32(a1, vld1q_f32(q + j + 4), vld1q_f32(v + j + 4));
+			a2 = vfmaq_f32(a2, vld1q_f32(q + j + 8), vld1q_f32(v + j + 8));
+			a3 = vfmaq_f32(a3, vld1q_f32(q + j + 12), vld1q_f32(v + j + 12));
+		}
+		for (; j + 4 <= dims; j += 4)
+			a0 = vfmaq_f32(a0, vld1q_f32(q + j), vld1q_f32(v + j));
+		float r = vaddvq_f32(vaddq_f32(vaddq_f32(a0, a1), vaddq_f32(a2, a3)));
+		for (; j < dims; ++j)
+			r += q[j] * v[j];
+		out[i] = r;
+	}
+}
+#endif
+
+// the fastest kernel the CPU supports
+inline dots_fn const dots = [] {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return &dots_avx2;
+#elif defined(__aarch64__)
+	return &dots_neon;
+#endif
+	return &dots_scalar;
+}();
+
+} // namespace simd
+
+// the k highest scoring hits pushed, in a min-heap
+struct topk {
+	struct hit {
+		float         score;
+		std::uint32_t id;
+	};
+
+	explicit topk(std::size_t k) : _k{k} {
+		_heap.reserve(k);
+	}
+
+	void
+	push(float score, std::uint32_t id) {
+		if (_heap.size() < _k) {
+			_heap.push_back({score, id});
+			std::push_heap(_heap.begin(), _heap.end(), worse);
+		} else if (_k && score > _heap.front().score) {
+			std::pop_heap(_heap.begin(), _heap.end(), worse);
+			_heap.back() = {score, id};
+			std::push_heap(_heap.begin(), _heap.end(), worse);
+		}
+	}
+
+	void
+	merge(topk const& other) {
+		for (auto h : other._heap)
+			push(h.score, h.id);
+	}
+
+	// the hits, best first
+	[[nodiscard]] std::vector<hit>
+	sorted() && {
+		std::sort_heap(_heap.begin(), _heap.end(), worse);
+		return std::move(_heap);
+	}
+
+   private:
+	std::size_t      _k;
+	std::vector<hit> _heap{};
+
+	[[nodiscard]] static bool
+	worse(hit a, hit b) noexcept {
+		return a.score > b.score;
+	}
+};
+
+// a read-only mapping of a whole file. empty if the file is missing or empty.
+struct mapped_file {
+	mapped_file() noexcept = default;
+
+	explicit mapped_file(std::filesystem::path const& path) {
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			if (errno == ENOENT)
+				return;
+			throw std::runtime_error{"could not open " + path.string() + ": " +
+			                         std::strerror(errno)};
+		}
+		struct stat st;
+		if (::fstat(fd, &st) == 0)
+			*this = mapped_file{fd, (std::size_t)st.st_size};
+		::close(fd);
+	}
+
+	// maps the first size bytes of an open file
+	mapped_file(int fd, std::size_t size) noexcept {
+		void* p = size ? ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+		if (p != MAP_FAILED) {
+			_data = static_cast<char const*>(p);
+			_size = size;
+		}
+	}
+
+	mapped_file(mapped_file&& other) noexcept
+	    : _data{std::exchange(other._data, nullptr)}, _size{std::exchange(other._size, 0)} {}
+
+	mapped_file&
+	operator=(mapped_file&& other) noexcept {
+		std::swap(_data, other._data);
+		std::swap(_size, other._size);
+		return *this;
+	}
+
+	~mapped_file() {
+		if (_data)
+			::munmap(const_cast<char*>(_data), _size);
+	}
+
+	[[nodiscard]] char const*
+	data() const noexcept {
+		return _data;
+	}
+
+	[[nodiscard]] std::size_t
+	size() const noexcept {
+		return _size;
+	}
+
+   private:
+	char const* _data{nullptr};
+	std::size_t _size{0};
+};
+
+// an on-disk index of unit vectors and their texts, searched by inner product (cosine
+// similarity). NAME.vec holds fixed-size records of a content hash, the offset of the
+// text in NAME.txt (one per line), and the vector. both are only appended, under a lock,
+// so any number of processes may add to them. large indexes are clustered into NAME.ivf
+// (an inverted file), so a search scans the clusters nearest to the query and any vectors
+// added since, instead of every vector.
+struct vector_index {
+	using hit = topk::hit;
+
+	// indexes with fewer vectors are always scanned in full
+	static constexpr std::size_t cluster_min = 1 << 16;
+
+	// maps the files of the index at base (NAME without a suffix), if any
+	explicit vector_index(std::filesystem::path base)
+	    : _base{std::move(base)},
+	      _vec{path(".vec")},
+	      _txt{path(".txt")},
+	      _ivf{path(".ivf")} {
+		if (_vec.size() >= sizeof(vec_header)) {
+			vec_header h;
+			std::memcpy(&h, _vec.data(), sizeof(h));
+			if (h.magic != vec_magic || !h.dims)
+				throw std::runtime_error{path(".vec").string() + " is not a vector index"};
+			_dims = h.dims;
+			// a torn record at the end (from a crash) is ignored
+			_size = (_vec.size() - sizeof(vec_header)) / vec_stride(_dims);
+		}
+		if (_ivf.size() >= sizeof(ivf_header)) {
+			std::memcpy(&_ivf_header, _ivf.data(), sizeof(_ivf_header));
+			// stale clusters (of an index since deleted and rebuilt) are ignored
+			if (_ivf_header.magic != ivf_magic || _ivf_header.dims != _dims ||
+			    _ivf_header.count > _size || _ivf.size() < ivf_layout(_ivf_header).end)
+				_ivf_header = {};
+		}
+	}
+
+	// the number of vectors
+	[[nodiscard]] std::size_t
+	size() const noexcept {
+		return _size;
+	}
+
+	// the dimensions of the vectors, or 0 if there are none
+	[[nodiscard]] std::size_t
+	dims() const noexcept {
+		return _dims;
+	}
+
+	// the number of clusters, or 0 if not clustered
+	[[nodiscard]] std::size_t
+	clusters() const noexcept {
+		return _ivf_header.nlist;
+	}
+
+	// the text of a vector
+	[[nodiscard]] std::string_view
+	text(std::uint32_t id) const {
+		std::uint64_t ofs;
+		std::memcpy(&ofs, record(id) + sizeof(std::uint64_t), sizeof(ofs));
+		if (ofs >= _txt.size())
+			throw std::runtime_error{path(".txt").string() + " is truncated"};
+		std::string_view s{_txt.data() + ofs, _txt.size() - ofs};
+		return s.substr(0, s.find('\n'));
+	}
+
+	// appends the vectors (dims floats each) of the texts not yet indexed, normalized,
+	// with one write to each file. texts must not contain newlines. returns the number
+	// appended.
+	static std::size_t
+	append(std::filesystem::path const& base, std::span<std::string_view const> texts,
+	       std::span<float const> vectors, std::size_t dims) {
+		auto vecpath = base;
+		vecpath += ".vec";
+		auto txtpath = base;
+		txtpath += ".txt";
+
+		descriptor vec{vecpath, O_RDWR | O_CREAT};
+		struct flock lock {};
+		lock.l_type   = F_WRLCK;
+		lock.l_whence = SEEK_SET;
+		if (::fcntl(vec.fd, F_SETLKW, &lock) < 0)
+			vec.fail("could not lock");
+		struct stat st;
+		if (::fstat(vec.fd, &st) < 0)
+			vec.fail("could not stat");
+
+		std::size_t                       size   = st.st_size;
+		std::size_t                       stride = vec_stride(dims);
+		std::string                       rec;
+		std::unordered_set<std::uint64_t> seen;
+		if (size < sizeof(vec_header)) {
+			vec_header h{vec_magic, (std::uint32_t)dims, 0};
+			rec.append(reinterpret_cast<char const*>(&h), sizeof(h));
+			size = 0;
+		} else {
+			// mapped with the locked descriptor, since closing any other releases the lock
+			mapped_file old{vec.fd, size};
+			vec_header  h;
+			std::memcpy(&h, old.data(), sizeof(h));
+			if (h.magic != vec_magic || h.dims != dims)
+				throw std::runtime_error{vecpath.string() + " is not a vector index of " +
+				                         std::to_string(dims) + "-dimensional vectors"};
+			size -= (size - sizeof(vec_header)) % stride; // drop a torn record
+			for (auto* p = old.data() + sizeof(vec_header); p < old.data() + size; p += stride) {
+				std::uint64_t key;
+				std::memcpy(&key, p, sizeof(key));
+				seen.insert(key);
+			}
+		}
+
+		descriptor txt{txtpath, O_WRONLY | O_CREAT | O_APPEND};
+		if (::fstat(txt.fd, &st) < 0)
+			txt.fail("could not stat");
+		std::uint64_t ofs = st.st_size;
+
+		std::string       lines;
+		std::size_t       added = 0;
+		std::vector<float> unit(dims);
+		for (std::size_t i = 0; i < texts.size(); ++i) {
+			std::uint64_t key = content_hash(texts[i]);
+			if (!seen.insert(key).second)
+				continue;
+			normalize(vectors.subspan(i * dims, dims), unit);
+			std::uint64_t at = ofs + lines.size();
+			rec.append(reinterpret_cast<char const*>(&key), sizeof(key));
+			rec.append(reinterpret_cast<char const*>(&at), sizeof(at));
+			rec.append(reinterpret_cast<char const*>(unit.data()), dims * sizeof(float));
+			(lines += texts[i]) += '\n';
+			++added;
+		}
+
+		// texts first, so every record refers to a complete line
+		txt.write(lines, ofs);
+		if (::ftruncate(vec.fd, size) < 0)
+			vec.fail("could not truncate");
+		vec.write(rec, size);
+		return added;
+	}
+
+	// clusters the vectors into about sqrt(n) lists by spherical k-means on workers, if
+	// there are at least cluster_min and the clusters (if any) miss more than a quarter
+	// of them. true if (re)clustered.
+	bool
+	cluster(pool& workers) {
+		std::size_t covered = _ivf_header.count;
+		if (_size < cluster_min || (covered && (_size - covered) * 4 <= covered))
+			return false;
+
+		std::size_t nlist = std::sqrt((double)_size);
+		std::size_t fdims = _dims * sizeof(float);
+
+		// train on an even sample
+		std::size_t        m = std::min(_size, nlist * 64);
+		std::vector<float> sample(m * _dims);
+		for (std::size_t i = 0; i < m; ++i)
+			std::memcpy(&sample[i * _dims], vector(i * _size / m), fdims);
+		std::vector<float> centroids(nlist * _dims);
+		for (std::size_t c = 0; c < nlist; ++c)
+			std::memcpy(&centroids[c * _dims], &sample[c * m / nlist * _dims], fdims);
+
+		std::vector<std::uint32_t> assign(m);
+		for (int iter = 0; iter < 10; ++iter) {
+			nearest(workers, centroids, reinterpret_cast<char const*>(sample.data()), fdims, m,
+			        assign.data());
+			std::vector<float>       sums(nlist * _dims);
+			std::vector<std::size_t> counts(nlist);
+			for (std::size_t i = 0; i < m; ++i) {
+				++counts[assign[i]];
+				for (std::size_t j = 0; j < _dims; ++j)
+					sums[assign[i] * _dims + j] += sample[i * _dims + j];
+			}
+			// empty clusters are reseeded with spread out samples
+			for (std::size_t c = 0; c < nlist; ++c) {
+				std::span<float const> s{&sums[c * _dims], _dims};
+				if (!counts[c])
+					s = {&sample[(c * 7919 + iter * 104729) % m * _dims], _dims};
+				normalize(s, {&centroids[c * _dims], _dims});
+			}
+		}
+
+		// assign every vector, and group them by cluster
+		std::vector<std::uint32_t> lists(_size);
+		nearest(workers, centroids, _vec.data() + sizeof(vec_header) + vec_prefix,
+		        vec_stride(_dims), _size, lists.data());
+		std::vector<std::uint64_t> offsets(nlist + 1);
+		for (auto c : lists)
+			++offsets[c + 1];
+		for (std::size_t c = 0; c < nlist; ++c)
+			offsets[c + 1] += offsets[c];
+		std::vector<std::uint32_t> ids(_size);
+		{
+			auto next = offsets;
+			for (std::size_t i = 0; i < _size; ++i)
+				ids[next[lists[i]]++] = i;
+		}
+
+		// written aside, then renamed over the old clusters. the lock of the vectors is
+		// not held, so each process writes a file of its own; the last rename wins.
+		ivf_header h{ivf_magic, (std::uint32_t)_dims, (std::uint32_t)nlist, _size};
+		auto       layout = ivf_layout(h);
+		auto       tmp    = path((".ivf." + std::to_string(::getpid()) + ".tmp").c_str());
+		{
+			descriptor out{tmp, O_WRONLY | O_CREAT | O_TRUNC};
+			std::string buf;
+			auto        put = [&buf](std::size_t at, void const* p, std::size_t n) {
+				buf.resize(at);
+				buf.append(static_cast<char const*>(p), n);
+			};
+			put(0, &h, sizeof(h));
+			put(layout.centroids, centroids.data(), centroids.size() * sizeof(float));
+			put(layout.offsets, offsets.data(), offsets.size() * sizeof(std::uint64_t));
+			put(layout.ids, ids.data(), ids.size() * sizeof(std::uint32_t));
+			buf.resize(layout.vectors);
+			std::size_t at = 0;
+			for (auto id : ids) {
+				buf.append(reinterpret_cast<char const*>(vector(id)), fdims);
+				if (buf.size() >= 1 << 20) {
+					out.write(buf, at);
+					at += buf.size();
+					buf.clear();
+				}
+			}
+			out.write(buf, at);
+		}
+		std::filesystem::rename(tmp, path(".ivf"));
+		_ivf        = mapped_file{path(".ivf")};
+		_ivf_header = h;
+		return true;
+	}
+
+	// the k vectors with the highest inner products with query (normalized), best first.
+	// scans the nprobe clusters nearest to the query (every cluster if 0) and the vectors
+	// they miss, split across workers, if any.
+	[[nodiscard]] std::vector<hit>
+	search(std::span<float const> query, std::size_t k, std::size_t nprobe,
+	       pool* workers = nullptr) const {
+		if (query.size() != _dims)
+			throw std::runtime_error{"the query has " + std::to_string(query.size()) +
+			                         " dimensions, but the index has " +
+			                         std::to_string(_dims)};
+		std::vector<float> q(_dims);
+		normalize(query, q);
+
+		// contiguous runs of vectors to scan
+		std::vector<run> runs;
+		std::size_t      covered = _ivf_header.count;
+		if (covered) {
+			auto layout  = ivf_layout(_ivf_header);
+			auto nlist   = _ivf_header.nlist;
+			auto fdims   = _dims * sizeof(float);
+			auto offsets = reinterpret_cast<std::uint64_t const*>(_ivf.data() + layout.offsets);
+			auto ids     = reinterpret_cast<std::uint32_t const*>(_ivf.data() + layout.ids);
+
+			std::vector<float> scores(nlist);
+			simd::dots(q.data(), _ivf.data() + layout.centroids, fdims, nlist, _dims,
+			           scores.data());
+			topk probes{nprobe ? std::min<std::size_t>(nprobe, nlist) : nlist};
+			for (std::uint32_t c = 0; c < nlist; ++c)
+				probes.push(scores[c], c);
+			for (auto p : std::move(probes).sorted())
+				split_run({_ivf.data() + layout.vectors + offsets[p.id] * fdims, fdims,
+				           offsets[p.id + 1] - offsets[p.id], ids + offsets[p.id], 0},
+				          runs);
+		}
+		if (_size > covered)
+			split_run({record(covered) + vec_prefix, vec_stride(_dims), _size - covered,
+			           nullptr, (std::uint32_t)covered},
+			          runs);
+
+		std::size_t       parts = workers ? std::min(workers->size(), runs.size()) : 1;
+		std::vector<topk> best(std::max<std::size_t>(parts, 1), topk{k});
+		parallel(workers, parts, [&](std::size_t part) {
+			std::vector<float> scores(run_max);
+			for (std::size_t r = part; r < runs.size(); r += parts) {
+				auto& run = runs[r];
+				simd::dots(q.data(), run.base, run.stride, run.n, _dims, scores.data());
+				for (std::size_t i = 0; i < run.n; ++i)
+					best[part].push(scores[i], run.ids ? run.ids[i] : run.first + i);
+			}
+		});
+		for (std::size_t part = 1; part < best.size(); ++part)
+			best[0].merge(best[part]);
+		return std::move(best[0]).sorted();
+	}
+
+   private:
+	struct vec_header {
+		std::array<char, 8> magic;
+		std::uint32_t       dims;
+		std::uint32_t       reserved;
+	};
+
+	struct ivf_header {
+		std::array<char, 8> magic{};
+		std::uint32_t       dims{0};
+		std::uint32_t       nlist{0};
+		std::uint64_t       count{0}; // the vectors clustered, which are the first
+	};
+
+	// the byte offsets of the sections of an ivf file, each aligned to a cache line
+	struct ivf_sections {
+		std::size_t centroids; // nlist unit vectors
+		std::size_t offsets;   // nlist + 1 offsets of each cluster in ids and vectors
+		std::size_t ids;       // the id of each vector, by cluster
+		std::size_t vectors;   // the vectors, by cluster
+		std::size_t end;
+	};
+
+	// a contiguous run of vectors, with their ids or the id of the first
+	struct run {
+		char const*          base;
+		std::size_t          stride;
+		std::size_t          n;
+		std::uint32_t const* ids;
+		std::uint32_t        first;
+	};
+
+	// a file descriptor, closed when destroyed
+	struct descriptor {
+		descriptor(std::filesystem::path p, int flags)
+		    : path{std::move(p)}, fd{::open(path.c_str(), flags | O_CLOEXEC, S_IRUSR | S_IWUSR)} {
+			if (fd < 0)
+				fail("could not open");
+		}
+		descriptor(descriptor const&)            = delete;
+		descriptor& operator=(descriptor const&) = delete;
+		~descriptor() {
+			if (fd >= 0)
+				::close(fd);
+		}
+
+		// writes all of data at ofs (ignored with O_APPEND)
+		void
+		write(std::string_view data, std::size_t ofs) const {
+			for (std::size_t n = 0; n < data.size();) {
+				::ssize_t w = ::pwrite(fd, data.data() + n, data.size() - n, ofs + n);
+				if (w < 0)
+					fail("could not write to");
+				n += w;
+			}
+		}
+
+		[[noreturn]] void
+		fail(std::string_view what) const {
+			throw std::runtime_error{std::string{what} + " " + path.string() + ": " +
+			                         std::strerror(errno)};
+		}
+
+		std::filesystem::path path;
+		int                   fd;
+	};
+
+	static constexpr std::array<char, 8> vec_magic = {'l', 'l', 'm', 'q', 'i', 'd', 'x', '1'};
+	static constexpr std::array<char, 8> ivf_magic = {'l', 'l', 'm', 'q', 'i', 'v', 'f', '1'};
+
+	// the bytes before the vector of a record: the content hash and the text offset
+	static constexpr std::size_t vec_prefix = 2 * sizeof(std::uint64_t);
+
+	// the most vectors scanned per run, which bounds the work of each part of a search
+	static constexpr std::size_t run_max = 4096;
+
+	std::filesystem::path _base;
+	mapped_file           _vec;
+	mapped_file           _txt;
+	mapped_file           _ivf;
+	ivf_header            _ivf_header{};
+	std::size_t           _dims{0};
+	std::size_t           _size{0};
+
+	[[nodiscard]] std::filesystem::path
+	path(char const* suffix) const {
+		auto p = _base;
+		return p += suffix;
+	}
+
+	[[nodiscard]] static constexpr std::size_t
+	vec_stride(std::size_t dims) noexcept {
+		return vec_prefix + dims * sizeof(float);
+	}
+
+	[[nodiscard]] static constexpr ivf_sections
+	ivf_layout(ivf_header const& h) noexcept {
+		auto         align = [](std::size_t n) { return (n + 63) / 64 * 64; };
+		ivf_sections s{};
+		s.centroids = align(sizeof(ivf_header));
+		s.offsets   = align(s.centroids + std::size_t{h.nlist} * h.dims * sizeof(float));
+		s.ids       = align(s.offsets + (std::size_t{h.nlist} + 1) * sizeof(std::uint64_t));
+		s.vectors   = align(s.ids + h.count * sizeof(std::uint32_t));
+		s.end       = s.vectors + h.count * h.dims * sizeof(float);
+		return s;
+	}
+
+	[[nodiscard]] char const*
+	record(std::size_t id) const noexcept {
+		return _vec.data() + sizeof(vec_header) + id * vec_stride(_dims);
+	}
+
+	[[nodiscard]] float const*
+	vector(std::size_t id) const noexcept {
+		return reinterpret_cast<float const*>(record(id) + vec_prefix);
+	}
+
+	// writes v scaled to unit length (or as is, if zero) to out
+	static void
+	normalize(std::span<float const> v, std::span<float> out) noexcept {
+		double sum = 0;
+		for (float x : v)
+			sum += (double)x * x;
+		float scale = sum > 0 ? float(1 / std::sqrt(sum)) : 1;
+		for (std::size_t i = 0; i < v.size(); ++i)
+			out[i] = v[i] * scale;
+	}
+
+	// appends r to runs in pieces of at most run_max vectors
+	static void
+	split_run(run r, std::vector<run>& runs) {
+		while (r.n > run_max) {
+			runs.push_back({r.base, r.stride, run_max, r.ids, r.first});
+			r.base += run_max * r.stride;
+			r.n -= run_max;
+			if (r.ids)
+				r.ids += run_max;
+			else
+				r.first += run_max;
+		}
+		if (r.n)
+			runs.push_back(r);
+	}
+
+	// runs f(0) to f(parts - 1) on workers (or here, if none), and waits for them
+	template <class F>
+	static void
+	parallel(pool* workers, std::size_t parts, F const& f) {
+		if (!workers || parts < 2) {
+			for (std::size_t i = 0; i < parts; ++i)
+				f(i);
+			return;
+		}
+		std::latch done{(std::ptrdiff_t)parts};
+		for (std::size_t i = 0; i < parts; ++i)
+			workers->submit([&f, &done, i] {
+				f(i);
+				done.count_down();
+			});
+		done.wait();
+	}
+
+	// assigns each of n vectors (stride bytes apart) to its nearest centroid
+	void
+	nearest(pool& workers, std::vector<float> const& centroids, char const* base,
+	        std::size_t stride, std::size_t n, std::uint32_t* out) const {
+		std::size_t nlist = centroids.size() / _dims;
+		std::size_t parts = std::min(n, workers.size() * 8);
+		parallel(&workers, parts, [&](std::size_t part) {
+			std::vector<float> scores(nlist);
+			for (std::size_t i = part * n / parts; i < (part + 1) * n / parts; ++i) {
+				auto* v = reinterpret_cast<float const*>(base + i * stride);
+				simd::dots(v, reinterpret_cast<char const*>(centroids.data()),
+				           _dims * sizeof(float), nlist, _dims, scores.data());
+				out[i] = std::max_element(scores.begin(), scores.end()) - scores.begin();
+			}
+		});
+	}
+};
+
+} // namespace llmq
+
+#endif
@@ -24,21 +24,43 @@
 //  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "llmq.h"
+#include "cache.h"
+#include "executor.h"
+#include "index.h"
+#include "pool.h"
 
 extern "C" {
 #include <curl/curl.h>
+#include <dlfcn.h>
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <netdb.h>
 #include <pwd.h>
 #include <signal.h>
+#include <spawn.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 }
 
+#include <algorithm>
+#include <atomic>
+#include <charconv>
 #include <chrono>
+#include <cstring>
 #include <ctime>
+#include <deque>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <sstream>
+#include <thread>
 
 namespace fs = std::filesystem;
 
@@ -240,37 +262,167 @@ plugin::longopts() const noexcept {
 }
 
 std::optional<std::string_view>
-plugin::post() const {
+plugin::session::post() const {
 	return std::nullopt;
 }
 
+bool
+plugin::session::done() const {
+	return false;
+}
+
 void
-plugin::onfinish(bool print) {
-	if (print) {
-		// by default, output a newline
-		std::cout << '\n';
-	}
+plugin::session::onend() {}
+
+bool
+plugin::session::retry() {
+	return false;
+}
+
+std::optional<plugin::tokens>
+plugin::session::spent() const {
+	return std::nullopt;
+}
+
+std::optional<plugin::tokens>
+plugin::session::estimate() const {
+	return std::nullopt;
+}
+
+bool
+plugin::session::resume() {
+	return false;
+}
+
+bool
+plugin::session::awaiting() const {
+	return false;
+}
+
+bool
+plugin::session::split(std::vector<std::unique_ptr<session>>&) {
+	return false;
+}
+
+std::vector<std::unique_ptr<plugin::session>>
+plugin::session::prepare() {
+	return {};
+}
+
+std::optional<bool>
+plugin::session::cached(std::string&) {
+	return std::nullopt;
+}
+
+std::vector<ryml::Tree>
+plugin::session::choices() const {
+	return {context()};
 }
 
-inline static std::vector<plugin*>* registry{nullptr};
-inline static bool                  main_started{false};
+void
+plugin::session::interrupt() {}
+
+void
+plugin::session::onfinish(std::vector<event>& events) {
+	// by default, output a newline
+	events.push_back({event::kind::delta, 0, "\n"});
+}
+
+inline static bool main_started{false};
+inline static bool loading_plugin{false}; // set while dlopen runs
+
+// the registered plugins. constructed on first use, as static plugins register before main
+[[nodiscard]] inline static std::vector<plugin*>&
+registry() noexcept {
+	static std::vector<plugin*> reg{};
+	return reg;
+}
 
 plugin::plugin(std::source_location loc) noexcept {
-	// construct on first use
-	[[maybe_unused]] static std::nullptr_t _ = ([] {
-		static std::vector<plugin*> reg{};
-		registry     = &reg;
-		main_started = false;
-		return nullptr;
-	})();
-	if (main_started)
+	if (main_started && !loading_plugin)
 		die("invalid implementation for plugin at \"", loc.file_name(), ':', loc.line(),
 		    "\". all plugin instances must be static");
-	registry->push_back(this);
+	registry().push_back(this);
+}
+
+#ifndef LLMQ_LIBDIR
+#define LLMQ_LIBDIR "/usr/local/lib/llmq"
+#endif
+
+// the directories searched for loadable plugins: $LLMQ_PLUGIN_PATH (colon-separated),
+// or LLMQ_LIBDIR if not set
+[[nodiscard]] inline static std::vector<fs::path>
+plugin_path() noexcept {
+	char const*      env  = std::getenv("LLMQ_PLUGIN_PATH");
+	std::string_view path = env ? env : LLMQ_LIBDIR;
+
+	std::vector<fs::path> res;
+	while (!path.empty()) {
+		auto end = std::min(path.find(':'), path.size());
+		if (end)
+			res.emplace_back(path.substr(0, end));
+		path.remove_prefix(std::min(end + 1, path.size()));
+	}
+	return res;
+}
+
+// loads a plugin library, which registers its static instance. symbols are resolved
+// lazily and kept local, so unused plugin code is never bound. libraries are never
+// unloaded; plugins live until exit like built-in ones.
+[[nodiscard]] inline static plugin*
+open_plugin(fs::path const& lib, bool verbose) noexcept {
+	verbose_log(verbose, "[plugin] loading ", lib);
+
+	loading_plugin = true;
+	void* handle   = ::dlopen(lib.c_str(), RTLD_LAZY | RTLD_LOCAL);
+	loading_plugin = false;
+	if (!handle)
+		die("could not load plugin ", lib, ": ", ::dlerror());
+
+	auto abi = reinterpret_cast<unsigned (*)()>(::dlsym(handle, "llmq_plugin_abi"));
+	auto get = reinterpret_cast<plugin* (*)()>(::dlsym(handle, "llmq_plugin"));
+	if (!abi || !get)
+		die("could not load plugin ", lib, ": missing LLMQ_PLUGIN_EXPORT");
+	if (abi() != LLMQ_PLUGIN_ABI)
+		die("could not load plugin ", lib, ": built for plugin ABI ", abi(),
+		    " (expected ", LLMQ_PLUGIN_ABI, ")");
+	return get();
+}
+
+// finds and loads PLUGIN.so from the plugin path. nullptr if not found.
+[[nodiscard]] inline static plugin*
+load_plugin(std::string_view name, bool verbose) noexcept {
+	for (auto const& dir : plugin_path()) {
+		std::error_code ec;
+		fs::path        lib = dir / (std::string{name} + ".so");
+		if (!fs::is_regular_file(lib, ec))
+			continue;
+		plugin* res = open_plugin(lib, verbose);
+		if (res->name() != name)
+			die("could not load plugin ", lib, ": provides \"", res->name(), "\" instead");
+		return res;
+	}
+	return nullptr;
+}
+
+// loads every plugin on the plugin path that is not yet registered (for listing)
+inline static void
+load_all_plugins() noexcept {
+	for (auto const& dir : plugin_path()) {
+		std::error_code ec;
+		for (auto const& e : fs::directory_iterator{dir, ec}) {
+			if (e.path().extension() != ".so" || !e.is_regular_file(ec))
+				continue;
+			if (std::ranges::find(registry(), e.path().stem().string(), &plugin::name) ==
+			    registry().end())
+				(void)open_plugin(e.path(), false);
+		}
+	}
 }
 
 inline static constexpr std::string_view help =
-    "usage: llmq [-hqiv] [ACTION] [PLUGIN][://[~]CONTEXT] [OPTIONS]... [--] [MSGS]...\n"
+    "usage: llmq [-hqivd] [--trace FILE] [ACTION] [PLUGIN][://[~]CONTEXT] [OPTIONS]... [--] "
+    "[MSGS]...\n"
     "A query CLI and context manager for LLM-powered shell pipelines.\n"
     "\n"
     "llmq is essentially a wrapper for LLM API plugins that manages command-line\n"
@@ -293,6 +445,8 @@ inline static constexpr std::string_view help =
     "  -q --quiet     do not print reply to stdout (if chat).\n"
     "  -i --no-stdin  does not read from stdin, even if MSGS is missing (if q|c).\n"
     "  -v --verbose   print cURL and other llmq diagnostics to stderr.\n"
+    "  -d --dedup     share identical in-flight requests with other llmq processes.\n"
+    "  --trace FILE   write a Chrome trace of the invocation to FILE (see TRACE).\n"
     "\n"
     "ACTION:\n"
     "  q query  queries and streams response without modifying the context.\n"
@@ -305,16 +459,114 @@ inline static constexpr std::string_view help =
     "  k kill   terminates all llmq processes with CONTEXT open, if able.\n"
     "  l list   list all available plugins and their descriptions.\n"
     "  h help   display the llmq or plugin help and exit.\n"
+    "  u usage  sums the ledger by MSGS (day|month|model|context|tag), if any.\n"
+    "  r resume continues an unfinished reply in place and updates context.\n"
+    "  w watch  chats whenever an edit leaves CONTEXT awaiting a reply.\n"
+    "  s serve  serves the PLUGIN endpoint to other programs on MSGS (an address).\n"
+    "  f fork   forks CONTEXT into each MSG (or a unique temporary context).\n"
+    "  t tree   searches for the best replies to MSGS (one per level); updates context.\n"
+    "  n nearest searches the vector index of CONTEXT for MSGS, or adds stdin lines.\n"
     "\n"
     "notes:\n"
     " - ACTION always required, except when using `-h`\n"
-    " - CONTEXT required for c|e|d|k\n"
-    " - OPTIONS/MSGS/stdin ignored for e|a|p|d|k|l|h\n"
-    " - stdin ignored for i\n"
+    " - CONTEXT required for c|e|d|k|r|w|f|t|n\n"
+    " - OPTIONS/MSGS/stdin ignored for e|a|p|d|k|l|h|w\n"
+    " - OPTIONS/stdin ignored for s|f\n"
+    " - stdin ignored for i|r\n"
+    " - u only includes contexts beginning with CONTEXT, if provided\n"
+    "\n"
+    "LEDGER:\n"
+    "  Each request is recorded in DATADIR/.ledger with its timing and the tokens\n"
+    "  reported by the plugin, tagged with $LLMQ_TAG (if set). If the plugin confdir\n"
+    "  contains prices.yml (a map of MODEL to USD per 1M prompt, cached, and\n"
+    "  completion tokens), costs are recorded as well. Model names match by prefix.\n"
+    "  Responses a plugin serves from its own cache (e.g. gpt -C) are recorded as\n"
+    "  hits, which spend nothing; the requests it looked up first, as misses.\n"
+    "\n"
+    "BUDGETS:\n"
+    "  If the plugin confdir contains budgets.yml (a sequence of {period: day|month,\n"
+    "  tokens: INT, usd: NUM, context: PREFIX, tag: TAG}), requests whose CONTEXT\n"
+    "  begins with PREFIX (and whose $LLMQ_TAG is TAG, if given) are refused once the\n"
+    "  period's tokens or USD would be exceeded. Estimated spend is reserved in\n"
+    "  DATADIR/.budgets before each request, so concurrent invocations cannot\n"
+    "  overrun a budget together. Reservations are reconciled with the actual usage\n"
+    "  in the period they were made, or released if the request fails.\n"
+    "\n"
+    "SIGNALS:\n"
+    "  SIGTERM or SIGINT (e.g. from kill) stop a request gracefully: the transfer is\n"
+    "  aborted, the reply is marked as interrupted, and the context is finalized\n"
+    "  (so it can be resumed). A second signal terminates immediately.\n"
+    "\n"
+    "DEDUP:\n"
+    "  With -d, byte-identical requests in flight at the same time are made once.\n"
+    "  The first process tees the stream into a spool in TMPDIR/.inflight (named by\n"
+    "  a SHA-256 digest of the request), which duplicates tail as it grows. If the\n"
+    "  first stops early (e.g. gpt -R|E|B|N), it still receives the whole stream\n"
+    "  while any duplicates are attached. Replays are not recorded in the ledger.\n"
+    "\n"
+    "CONCURRENCY:\n"
+    "  Requests in flight per plugin are limited by an adaptive window shared\n"
+    "  through TMPDIR/.limiter. It grows while requests succeed and shrinks on\n"
+    "  429/5xx responses or latency spikes; rate limit headers cap it and may pause\n"
+    "  new requests. $LLMQ_CONCURRENCY sets the largest window (default 64); 0\n"
+    "  disables the limit. Waiting requests are admitted by $LLMQ_PRIORITY\n"
+    "  (interactive|default|bulk) with weighted fair queuing (16:4:1).\n"
+    "\n"
+    "GATEWAY:\n"
+    "  The serve action proxies POST /v1/chat/completions on unix:PATH or\n"
+    "  [HOST:]PORT (default 127.0.0.1:8080; HOST must be a loopback address) to the\n"
+    "  plugin's endpoint ($LLMQ_UPSTREAM, if set) with its authfile. The body sent is\n"
+    "  the plugin's postdata for the request (gpt asks for the usage of streamed\n"
+    "  replies). Responses stream through as they arrive; requests share the limiter,\n"
+    "  budgets (refused with 429), and ledger (as CONTEXT, if given), 429/5xx\n"
+    "  responses are retried, and completed responses are cached in TMPDIR/.cache\n"
+    "  for $LLMQ_CACHE_TTL seconds (default 3600; 0 disables the cache).\n"
+    "\n"
+    "FORKS:\n"
+    "  Forks do not copy CONTEXT. Its content is snapshot once in DATADIR/.forks\n"
+    "  (named by its hash, and cloned where the filesystem supports reflinks), and\n"
+    "  each fork begins with a \"#llmq fork SNAPSHOT\" line followed by only its own\n"
+    "  messages. Forks are read with the snapshot in place of the line, and are\n"
+    "  stored in full once a write changes the snapshot's part of the context.\n"
+    "\n"
+    "TREE:\n"
+    "  The tree action runs a beam search with one level per MSG. Each level replies\n"
+    "  to its MSG from every context of the frontier (concurrently, within the\n"
+    "  concurrency window), splits the replies into their choices (e.g. with gpt -n),\n"
+    "  scores each, and keeps the $LLMQ_BEAM best (default 3). Choices are scored by\n"
+    "  the first number printed by $LLMQ_SCORER, a shell command given the choice's\n"
+    "  context on stdin, or else replied to $LLMQ_SCORER_PROMPT (by default, a request\n"
+    "  to rate the reply from 0 to 10). Failed expansions are skipped, and failed\n"
+    "  scores rank last. The best path is saved to CONTEXT.\n"
+    "\n"
+    "NEAREST:\n"
+    "  The nearest action keeps a local vector index next to CONTEXT (CONTEXT.vec and\n"
+    "  CONTEXT.txt), embedded by PLUGIN (e.g. embed) with OPTIONS and CONTEXT, if it\n"
+    "  exists. Without MSGS, each new line of stdin is added. With MSGS, the\n"
+    "  $LLMQ_TOPK items (default 10) nearest to each MSG are printed as lines of cosine\n"
+    "  similarity and text, with a blank line between MSGS. Indexes of 65536 items or\n"
+    "  more are clustered (CONTEXT.ivf) as they grow, and searches then scan only the\n"
+    "  $LLMQ_NPROBE nearest clusters (default 32). $LLMQ_THREADS workers (default 1)\n"
+    "  cluster and scan in parallel. del also deletes the index.\n"
+    "\n"
+    "LIVE:\n"
+    "  If a FIFO or listening unix socket exists at CONTEXT.live, chat, resume, and\n"
+    "  watch publish the reply to it as JSON lines of deltas (message index, byte\n"
+    "  offset, text), finish reasons, and context writes. While a listener is\n"
+    "  connected, the context file is written at most once per second.\n"
+    "\n"
+    "TRACE:\n"
+    "  With --trace FILE, the phases of the invocation (argument parsing, context\n"
+    "  reading and parsing, plugin init, postdata, the concurrency window, cURL's\n"
+    "  dns|connect|tls|send|wait|receive, each batch of chunks consumed, context\n"
+    "  writes, and onfinish) are written to FILE at exit as Chrome trace events,\n"
+    "  for chrome://tracing or ui.perfetto.dev. Each request has a track of its own.\n"
     "\n"
     "PLUGIN:\n"
-    "  At present, gpt is the only plugin available.\n"
-    "  See `llmq help gpt` for more info.\n"
+    "  gpt (chat completions) and embed (embeddings) are built in.\n"
+    "  See `llmq help gpt` and `llmq help embed` for more info.\n"
+    "  Plugins that are not built in are loaded on demand from PLUGIN.so in\n"
+    "  $LLMQ_PLUGIN_PATH (colon-separated; default " LLMQ_LIBDIR ").\n"
     "\n"
     "CONTEXT:\n"
     "  A YAML-encoded query/chat context file (e.g. model parameters, messages).\n"
@@ -329,14 +581,36 @@ inline static constexpr std::string_view help =
 
 inline static constexpr std::string_view usage = help.substr(0, help.find('\n'));
 
-enum class action : uint8_t { unset, query, chat, init, edit, auth, path, del, kill, list, help };
+enum class action : uint8_t {
+	unset,
+	query,
+	chat,
+	init,
+	edit,
+	auth,
+	path,
+	del,
+	kill,
+	list,
+	help,
+	usage,
+	resume,
+	watch,
+	serve,
+	fork,
+	tree,
+	nearest,
+};
 
 [[nodiscard]] inline static constexpr action
 parse_action(std::string_view s) noexcept {
 	using namespace std::literals;
 	using enum llmq::action;
-	constexpr auto opts = std::array{"query"sv, "chat"sv, "init"sv, "edit"sv, "auth"sv,
-	                                 "path"sv,  "del"sv,  "kill"sv, "list"sv, "help"sv};
+	constexpr auto opts = std::array{"query"sv, "chat"sv, "init"sv, "edit"sv,
+	                                 "auth"sv,  "path"sv, "del"sv,  "kill"sv,
+	                                 "list"sv,  "help"sv, "usage"sv, "resume"sv,
+	                                 "watch"sv, "serve"sv, "fork"sv, "tree"sv,
+	                                 "nearest"sv};
 
 	constexpr std::size_t npos = std::numeric_limits<std::size_t>::max();
 	std::size_t           found{npos};
@@ -362,7 +636,14 @@ parse_action(std::string_view s) noexcept {
 		case 7: static_assert(opts[7] == "kill"); return kill;
 		case 8: static_assert(opts[8] == "list"); return list;
 		case 9: static_assert(opts[9] == "help"); return help;
-		default: static_assert(opts.size() == 10); return unset;
+		case 10: static_assert(opts[10] == "usage"); return usage;
+		case 11: static_assert(opts[11] == "resume"); return resume;
+		case 12: static_assert(opts[12] == "watch"); return watch;
+		case 13: static_assert(opts[13] == "serve"); return serve;
+		case 14: static_assert(opts[14] == "fork"); return fork;
+		case 15: static_assert(opts[15] == "tree"); return tree;
+		case 16: static_assert(opts[16] == "nearest"); return nearest;
+		default: static_assert(opts.size() == 17); return unset;
 	}
 }
 
@@ -380,6 +661,13 @@ serialize_action(action v) noexcept {
 		case kill: return "kill";
 		case list: return "list";
 		case help: return "help";
+		case usage: return "usage";
+		case resume: return "resume";
+		case watch: return "watch";
+		case serve: return "serve";
+		case fork: return "fork";
+		case tree: return "tree";
+		case nearest: return "nearest";
 		default: return "unset";
 	}
 }
@@ -406,13 +694,158 @@ static_assert(parse_plug_ctx_arg("plugin://").second == "");
 static_assert(parse_plug_ctx_arg("plugin").first == "plugin");
 static_assert(parse_plug_ctx_arg("plugin").second == "");
 
+// the first line of a forked context file, followed by the path of its fork point: an
+// immutable snapshot of the parent context, named by the hash of its content. the rest
+// of the file is appended to the content of the fork point.
+inline static constexpr std::string_view fork_magic = "#llmq fork ";
+
+// the length of the fork header line of a context file, or 0 if not forked
+[[nodiscard]] inline static std::size_t
+fork_header_size(std::string_view file) noexcept {
+	if (!file.starts_with(fork_magic))
+		return 0;
+	auto eol = file.find('\n');
+	return eol == file.npos ? 0 : eol + 1;
+}
+
+// the content of a context file, with the content of its fork point (if any) in place of
+// its header. fork points may themselves be forks.
+[[nodiscard]] inline static std::string
+expand_context(fs::path const& path, std::string file) noexcept {
+	std::size_t header = fork_header_size(file);
+	if (!header)
+		return file;
+
+	fs::path base{file.substr(fork_magic.size(), header - fork_magic.size() - 1)};
+	if (!fs::exists(base))
+		die("fork point ", base, " of ", path, " does not exist");
+	FILE*       f       = open_file(base, "r");
+	std::string content = expand_context(base, read_file(base, f));
+	std::fclose(f);
+
+	if (hash_name(content) != base.filename())
+		die("fork point ", base, " of ", path, " has been modified");
+	content.append(file, header);
+	return content;
+}
+
+// records the phases of the invocation as Chrome trace events (--trace FILE), which
+// chrome://tracing and Perfetto display. spans are kept in memory and written at exit,
+// on tracks (thread ids) of their own: the invocation is track 0, and each request and
+// context file gets a track, so that concurrent requests show their overlap and gaps.
+// names must not need escaping.
+struct tracer {
+	using clock = std::chrono::steady_clock;
+
+	// a span of its track from construction to destruction
+	struct span {
+		span(tracer& t, std::string_view name, std::uint32_t track) noexcept
+		    : t{t}, name{name}, track{track} {}
+		span(span const&)            = delete;
+		span& operator=(span const&) = delete;
+		~span() {
+			t.record(name, track, begin, clock::now());
+		}
+
+	   private:
+		tracer&           t;
+		std::string_view  name;
+		std::uint32_t     track;
+		clock::time_point begin{clock::now()};
+	};
+
+	tracer() noexcept = default;
+	tracer(tracer const&)            = delete;
+	tracer& operator=(tracer const&) = delete;
+
+	// writes the trace, if enabled
+	~tracer() {
+		if (path.empty())
+			return;
+		std::ofstream f{path};
+		f << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+		for (std::size_t i = 0; i < events.size(); ++i)
+			f << (i ? ",\n" : "") << events[i];
+		f << "\n]}\n";
+		if (!f.flush())
+			warn("could not write the trace ", path);
+	}
+
+	// enables tracing to path. spans that began earlier are recorded as well.
+	void
+	open(fs::path p) noexcept {
+		path = std::move(p);
+		name_track(0, "llmq");
+	}
+
+	[[nodiscard]] bool
+	enabled() const noexcept {
+		return !path.empty();
+	}
+
+	// a new track, or 0 if not enabled
+	[[nodiscard]] std::uint32_t
+	track(std::string_view name) noexcept {
+		if (!enabled())
+			return 0;
+		auto id = ++tracks;
+		name_track(id, std::string{name} + ' ' + std::to_string(id));
+		return id;
+	}
+
+	// a span of the track (the invocation, by default) until the result is destroyed
+	[[nodiscard]] span
+	scope(std::string_view name, std::uint32_t track = 0) noexcept {
+		return {*this, name, track};
+	}
+
+	// records a span of the track
+	void
+	record(std::string_view name, std::uint32_t track, clock::time_point begin,
+	       clock::time_point end) noexcept {
+		if (!enabled())
+			return;
+		auto us = [this](clock::time_point t) {
+			return std::chrono::duration_cast<std::chrono::microseconds>(t - epoch).count();
+		};
+		std::ostringstream e;
+		e << "{\"name\": \"" << name << "\", \"ph\": \"X\", \"ts\": " << us(begin)
+		  << ", \"dur\": " << us(end) - us(begin) << ", \"pid\": " << pid
+		  << ", \"tid\": " << track << '}';
+		std::lock_guard lock{mutex};
+		events.push_back(e.str());
+	}
+
+   private:
+	fs::path                   path{};
+	clock::time_point          epoch{clock::now()};
+	int                        pid{::getpid()};
+	std::atomic<std::uint32_t> tracks{0};
+	std::mutex                 mutex{};
+	std::vector<std::string>   events{};
+
+	void
+	name_track(std::uint32_t id, std::string const& name) noexcept {
+		std::ostringstream e;
+		e << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << pid
+		  << ", \"tid\": " << id << ", \"args\": {\"name\": \"" << name << "\"}},\n"
+		  << "{\"name\": \"thread_sort_index\", \"ph\": \"M\", \"pid\": " << pid
+		  << ", \"tid\": " << id << ", \"args\": {\"sort_index\": " << id << "}}";
+		std::lock_guard lock{mutex};
+		events.push_back(e.str());
+	}
+};
+
+inline static tracer trace;
+
 struct context_writer {
    public:
 	context_writer(fs::path path, std::string content) noexcept
 	    : _f{open_file(path, "r+")},
 	      _buf{std::move(content)},
 	      _path{std::move(path)},
-	      _l{} {
+	      _l{},
+	      _track{trace.track("context")} {
 		_l.l_type   = F_WRLCK;
 		_l.l_whence = SEEK_SET;
 		_l.l_start  = 0;
@@ -421,6 +854,15 @@ struct context_writer {
 
 		if (::fcntl(::fileno(_f), F_SETLK, &_l) < 0)
 			die("failed to lock the context file ", _path, ": ", std::strerror(errno));
+
+		// a fork only writes what follows its fork point
+		std::string file = read_file(_path, _f);
+		if (std::size_t header = fork_header_size(file)) {
+			if (!std::string_view{_buf}.ends_with(std::string_view{file}.substr(header)))
+				die("the context file ", _path, " changed while reading");
+			_header = file.substr(0, header);
+			_base   = _buf.size() - (file.size() - header);
+		}
 	};
 
 	~context_writer() {
@@ -431,44 +873,73 @@ struct context_writer {
 		std::fclose(_f);
 	}
 
+	// the content last written (or read)
+	[[nodiscard]] std::string const&
+	content() const noexcept {
+		return _buf;
+	}
+
 	void
 	overwrite(ryml::Tree const& tree) noexcept {
-		std::string cur = ryml::emitrs_yaml<std::string>(tree);
-		size_t      bi  = 0;
-		size_t      ci  = 0;
+		auto             _   = trace.scope("context_writer::overwrite", _track);
+		std::string      cur = ryml::emitrs_yaml<std::string>(tree);
+		std::string_view old = _buf;
+
+		if (_header.empty()) {
+			write_changes(old, cur, 0);
+		} else if (std::string_view{cur}.starts_with(old.substr(0, _base))) {
+			write_changes(old.substr(_base), std::string_view{cur}.substr(_base),
+			              _header.size());
+		} else { // the fork point itself changed; store the whole context from now on
+			write_changes(_header + _buf.substr(_base), cur, 0);
+			_header.clear();
+			_base = 0;
+		}
+
+		_buf = std::move(cur);
+	}
 
-		seek_file(_path, _f, 0);
+   private:
+	// writes the differences between old and cur, stored at ofs
+	void
+	write_changes(std::string_view old, std::string_view cur, std::size_t ofs) noexcept {
+		size_t bi = 0;
+		size_t ci = 0;
 
-		while (bi < _buf.size() && ci < cur.size()) {
-			if (_buf[bi] == cur[ci]) { // iterate over like chars
+		while (bi < old.size() && ci < cur.size()) {
+			if (old[bi] == cur[ci]) { // iterate over like chars
 				++bi;
 				++ci;
 			} else { // find the end of this diff string and write the changes
 				size_t dbegin = ci;
-				for (; bi < _buf.size() && ci < cur.size() && _buf[bi] != cur[ci];
+				for (; bi < old.size() && ci < cur.size() && old[bi] != cur[ci];
 				     ++bi, ++ci)
 					;
 				size_t dend = ci;
-				seek_file(_path, _f, dbegin);
+				seek_file(_path, _f, ofs + dbegin);
 				write_file(_path, _f, {cur.data() + dbegin, dend - dbegin});
 			}
 		}
 
 		if (ci < cur.size()) {
-			seek_file(_path, _f, ci);
+			seek_file(_path, _f, ofs + ci);
 			write_file(_path, _f, {cur.data() + ci, cur.size() - ci});
 		}
 
-		_buf = std::move(cur);
-
 		std::fflush(_f);
+
+		// the context may shrink (e.g. if a reply is trimmed or discarded)
+		if (cur.size() < old.size() && ::ftruncate(::fileno(_f), ofs + cur.size()) < 0)
+			die("failed to truncate the context file ", _path, ": ", std::strerror(errno));
 	}
 
-   private:
 	FILE*       _f;
 	std::string _buf;
 	fs::path    _path;
 	::flock     _l;
+	std::string   _header{}; // the fork header, if forked
+	std::size_t   _base{0};  // the length of the fork point content in _buf
+	std::uint32_t _track;
 };
 
 [[nodiscard]] inline static bool
@@ -481,6 +952,7 @@ struct llmq_args_result {
 	bool           quiet;
 	bool           verbose;
 	bool           no_stdin;
+	bool           dedup;
 	enum action    action;
 	unsigned       ofs; // offset for argc after parsing
 	struct plugin* plugin;
@@ -490,10 +962,12 @@ struct llmq_args_result {
 // reads all args up to OPTIONS
 [[nodiscard]] inline static llmq_args_result
 parse_llmq_args(int argc, char** argv) {
+	auto             _ = trace.scope("parse_llmq_args");
 	llmq_args_result res{
 	    .quiet    = false,
 	    .verbose  = false,
 	    .no_stdin = false,
+	    .dedup    = false,
 	    .action   = action::unset,
 	    .ofs      = 1,
 	    .plugin   = nullptr,
@@ -505,32 +979,47 @@ parse_llmq_args(int argc, char** argv) {
 			if (!std::strcmp(argv[res.ofs], "--"))
 				die("\"--\" may only be used to separate OPTIONS from MSGS after "
 				    "PLUGIN is provided");
+			if (!std::strcmp(argv[res.ofs], "--trace")) {
+				if (++res.ofs == (unsigned)argc)
+					die("--trace requires FILE");
+				trace.open(argv[res.ofs]);
+				continue;
+			}
+			if (!std::strncmp(argv[res.ofs], "--trace=", 8)) {
+				trace.open(argv[res.ofs] + 8);
+				continue;
+			}
 			if (hasopt(argv[res.ofs], 'h', "--help"))
 				std::exit((std::cout << help << '\n', 0));
 			if (hasopt(argv[res.ofs], 'q', "--quiet")) {
 				res.quiet = true;
-				if (res.action != action::unset && res.action != action::chat)
+				if (res.action != action::unset && res.action != action::chat &&
+				    res.action != action::resume && res.action != action::watch)
 					die("quiet flag only supported for chat mode");
 			}
 			if (hasopt(argv[res.ofs], 'i', "--no-stdin"))
 				res.no_stdin = true;
 			if (hasopt(argv[res.ofs], 'v', "--verbose"))
 				res.verbose = true;
+			if (hasopt(argv[res.ofs], 'd', "--dedup"))
+				res.dedup = true;
 			continue;
 		}
 
 		if (res.action == action::unset) {
 			if ((res.action = parse_action(argv[res.ofs])) == action::unset)
 				die("invalid action \"", argv[res.ofs], "\"");
-			if (res.quiet && res.action != action::chat)
+			if (res.quiet && res.action != action::chat && res.action != action::resume &&
+			    res.action != action::watch)
 				die("quiet flag only supported for chat mode");
 		} else if (!res.plugin) {
 			auto [plg, ctx] = parse_plug_ctx_arg(argv[res.ofs]);
 			{
-				auto it = std::ranges::find(*registry, plg, &plugin::name);
-				if (it == registry->end())
+				auto it = std::ranges::find(registry(), plg, &plugin::name);
+				if (it != registry().end())
+					res.plugin = *it;
+				else if (!(res.plugin = load_plugin(plg, res.verbose)))
 					die("plugin \"", plg, "\" not found\n");
-				res.plugin = *it;
 			}
 			if (!ctx.empty() && ctx.back() == '/')
 				die("CONTEXT \"", ctx, "\" is not a valid filename");
@@ -690,6 +1179,12 @@ compute_ctxfile(llmq_args_result const& a) noexcept {
 	return f;
 }
 
+// the path of the live sink next to a context file (see live_sink)
+[[nodiscard]] inline static fs::path
+compute_livefile(fs::path ctxfile) noexcept {
+	return ctxfile.replace_extension(".live");
+}
+
 // finds a new tempfile to use
 [[nodiscard]] inline static std::string
 compute_tmpctx(llmq_args_result const& a) noexcept {
@@ -787,10 +1282,11 @@ spawn_editor(fs::path const& dir, fs::path const& file) noexcept {
 
 inline static void
 print_plugins() noexcept {
+	load_all_plugins();
 	std::size_t max = 0;
-	for (auto* v : *registry)
+	for (auto* v : registry())
 		max = std::max(max, v->name().size());
-	for (auto* v : *registry)
+	for (auto* v : registry())
 		std::cout << std::left << std::setw(max + 1) << v->name() << ": " << v->descr()
 			  << std::endl;
 }
@@ -806,42 +1302,77 @@ trim(std::string_view s) noexcept {
 	return {begin, end};
 }
 
-inline static size_t
-onwrite(char* ptr, size_t size, size_t nmemb, void* plug_update_void) {
-	auto plug_update =
-	    reinterpret_cast<std::function<void(std::string_view)>*>(plug_update_void);
-	size_t len = size * nmemb;
-	(*plug_update)(std::string_view(ptr, len));
-	return len;
+// the signal that interrupted the request, if any
+inline static volatile ::sig_atomic_t interrupted = 0;
+
+// the executor to wake when interrupted, if one is running
+inline static std::atomic<executor const*> interruptible = nullptr;
+
+// stops the request gracefully; a second signal terminates immediately
+inline static void
+oninterrupt(int sig) noexcept {
+	if (interrupted) {
+		::signal(sig, SIG_DFL);
+		::raise(sig);
+	}
+	interrupted = sig;
+	if (auto ex = interruptible.load())
+		ex->interrupt();
 }
 
-// a wrapper for throwable plugin operations
+// returning nonzero (when interrupted) aborts the transfer
+inline static int
+onprogress(void*, curl_off_t, curl_off_t, curl_off_t, curl_off_t) noexcept {
+	return interrupted != 0;
+}
+
+// a wrapper for throwable plugin operations that rethrows their errors as
+// std::runtime_error, naming the operation and the plugin
 template <class Op>
 	requires std::is_invocable_v<Op>
 inline static auto
-plugop(std::string_view plugname, std::string_view opdescr, Op&& op) noexcept {
+plugcall(std::string_view plugname, std::string_view opdescr, Op&& op) {
+	auto failed = [&](std::string_view what) {
+		std::ostringstream msg;
+		msg << "failed to " << opdescr << " plugin \"" << plugname << "\": " << what;
+		return std::runtime_error{msg.str()};
+	};
 	try {
 		return op();
 	} catch (std::exception const& e) {
-		die("failed to ", opdescr, " plugin \"", plugname, "\": ", e.what());
+		throw failed(e.what());
 	} catch (char const* e) {
-		die("failed to ", opdescr, " plugin \"", plugname, "\": ", e);
+		throw failed(e);
 	} catch (...) {
-		die("failed to ", opdescr, " plugin \"", plugname, "\": unknown error");
+		throw failed("unknown error");
+	}
+}
+
+// a wrapper for throwable plugin operations that dies on error
+template <class Op>
+	requires std::is_invocable_v<Op>
+inline static auto
+plugop(std::string_view plugname, std::string_view opdescr, Op&& op) noexcept {
+	try {
+		return plugcall(plugname, opdescr, std::forward<Op>(op));
+	} catch (std::exception const& e) {
+		die(e.what());
 	}
 }
 
 [[nodiscard]] inline static std::string
 read_context(fs::path const& ctxfile) noexcept {
+	auto        _      = trace.scope("read_context");
 	FILE*       f      = open_file(ctxfile.c_str(), "r");
 	std::string oldctx = read_file(ctxfile, f);
 	std::fclose(f);
 
-	return oldctx;
+	return expand_context(ctxfile, std::move(oldctx));
 }
 
 [[nodiscard]] inline static ryml::Tree
 parse_context(std::string_view oldctx) noexcept {
+	auto _ = trace.scope("parse_context");
 	// read the entire context file as YAML (if needed)
 	ryml::Tree ctx;
 	try {
@@ -861,201 +1392,3424 @@ read_auth(fs::path const& authfile) noexcept {
 	return auth;
 }
 
-inline static void
+[[nodiscard]] inline static std::unique_ptr<plugin::session>
 init_plugin(int argc, char** argv, llmq_args_result& a, std::string const& oldctx,
             fs::path const& authfile) noexcept {
 	ryml::Tree ctx = parse_context(oldctx);
 
 	// read plugin args, if enabled
-	auto args =
-	    parse_plugin_args(argc, argv, a.ofs, a.plugin, a.no_stdin || a.action == action::init);
+	auto args = parse_plugin_args(argc, argv, a.ofs, a.plugin,
+	                              a.no_stdin || a.action == action::init ||
+	                                  a.action == action::resume);
 
 	// load authfile contents
 	std::string auth = read_auth(authfile);
 
-	plugop(a.plugin->name(), "initialize", [&a, &ctx, &args, &auth] {
-		a.plugin->init(std::move(ctx), std::move(args), std::move(auth));
+	return plugop(a.plugin->name(), "initialize", [&a, &ctx, &args, &auth] {
+		auto _ = trace.scope("plugin::init");
+		return a.plugin->init(std::move(ctx), std::move(args), std::move(auth));
 	});
 }
 
-[[nodiscard]] inline static context_writer
+// a session whose context is saved to CONTEXT
+struct plugctx {
+	std::unique_ptr<plugin::session> session;
+	context_writer                   writer;
+};
+
+[[nodiscard]] inline static plugctx
 init_plugctx(int argc, char** argv, llmq_args_result& a) noexcept {
 	fs::path    ctxfile = prepare_ctxfile(a);
 	std::string oldctx  = read_context(ctxfile);
 
-	// initialize the plugin
-	init_plugin(argc, argv, a, oldctx, prepare_authfile(a));
+	// initialize the plugin, then the yaml writer
+	return {init_plugin(argc, argv, a, oldctx, prepare_authfile(a)),
+	        {std::move(ctxfile), std::move(oldctx)}};
+}
+
+// snapshots ctxfile as a fork point in dir (once a writer finishes), unless an identical
+// one exists. the file is cloned where the filesystem supports reflinks, and copied
+// otherwise; either way, the snapshot of a fork only stores its own suffix.
+[[nodiscard]] inline static fs::path
+snapshot_context(fs::path const& ctxfile, fs::path const& dir) noexcept {
+	FILE*   f = open_file(ctxfile, "r");
+	::flock l{};
+	l.l_type   = F_RDLCK;
+	l.l_whence = SEEK_SET;
+	if (::fcntl(::fileno(f), F_SETLKW, &l) < 0)
+		die("failed to lock the context file ", ctxfile, ": ", std::strerror(errno));
+
+	std::string file = read_file(ctxfile, f);
+	fs::path    snap = dir / hash_name(expand_context(ctxfile, file));
+	if (!fs::exists(snap)) {
+		mkdir_p(dir);
+		fs::path tmp = snap;
+		tmp += "." + std::to_string(::getpid());
+
+		int out = ::open(tmp.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, S_IRUSR);
+		if (out < 0)
+			die("could not create file ", tmp, ": ", std::strerror(errno));
+		if (::ioctl(out, FICLONE, ::fileno(f)) < 0) {
+			for (std::size_t n = 0; n < file.size();) {
+				::ssize_t w = ::write(out, file.data() + n, file.size() - n);
+				if (w < 0)
+					die("could not write to ", tmp, ": ", std::strerror(errno));
+				n += w;
+			}
+		}
+		if (::close(out) < 0 || ::rename(tmp.c_str(), snap.c_str()) < 0)
+			die("could not create fork point ", snap, ": ", std::strerror(errno));
+	}
 
-	// initialize the yaml writer
-	return {std::move(ctxfile), std::move(oldctx)};
+	std::fclose(f);
+	return snap;
 }
 
+// forks CONTEXT into each context named by MSGS (or a new temporary context) and prints
+// them. instead of a copy of CONTEXT, each begins with a reference to a snapshot of it
+// in DATADIR/.forks, which all forks of the same content share.
 inline static void
-request(plugin* plug, bool verbose, std::function<void(std::string_view)> plug_update,
-        std::function<void()> plug_finish) {
-	auto init = ::curl_global_init(CURL_GLOBAL_DEFAULT);
-	if (init != CURLE_OK)
-		die("cURL error: ", ::curl_easy_strerror(init));
-	CURL*              curl;
-	std::string        prompt;
-	struct curl_slist* headers = NULL;
+fork_ctx(llmq_args_result const& a, int argc, char** argv) noexcept {
+	fs::path ctxfile = compute_ctxfile(a);
+	if (!fs::exists(ctxfile))
+		die("invalid context path ", ctxfile);
 
-	auto url = plugop(plug->name(), "get url from", [plug] {
-		return plug->url();
-	});
+	fs::path    snap   = snapshot_context(ctxfile, compute_datadir(a) / ".forks");
+	std::string header = std::string{fork_magic} + snap.string() + '\n';
 
-	plugop(plug->name(), "append headers from", [plug, &headers] {
-		plug->append_headers([&headers](std::string_view h) {
-			headers = ::curl_slist_append(headers, h.data());
-		});
-	});
+	std::vector<std::string> names{argv + a.ofs + 1, argv + argc};
+	if (names.empty())
+		names.push_back(compute_tmpctx(a));
 
-	auto post = plugop(plug->name(), "get postdata from", [plug] {
-		return plug->post();
-	});
+	for (auto const& name : names) {
+		if (name.empty() || name.back() == '/')
+			die("CONTEXT \"", name, "\" is not a valid filename");
+		llmq_args_result child = a;
+		child.context          = name;
 
-	curl = ::curl_easy_init();
-	if (!curl)
-		die("could not initialize cURL");
+		fs::path f = compute_ctxfile(child);
+		mkdir_p(f.parent_path());
+		int fd = ::open(f.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if (fd < 0)
+			die("could not create context file ", f, ": ", std::strerror(errno));
+		if (::write(fd, header.data(), header.size()) != (::ssize_t)header.size())
+			die("could not write to ", f, ": ", std::strerror(errno));
+		::close(fd);
 
-	curl_easy_setopt(curl, post ? CURLOPT_POST : CURLOPT_HTTPGET, 1L);
-	curl_easy_setopt(curl, CURLOPT_URL, url.data());
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
-	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 2L);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, onwrite);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &plug_update);
-	if (verbose) {
-		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-		if (post)
-			std::cerr << "\nloading postdata:\n" << post->data() << "\n\n";
-	}
-	if (post) {
-		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post->data());
-		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, post->size());
+		std::cout << a.plugin->name() << "://" << name << '\n';
 	}
+}
 
-	// send the request
-	{
-		CURLcode _ = ::curl_easy_perform(curl);
-		if (_ != CURLE_OK)
-			die("cURL error: ", ::curl_easy_strerror(_));
-	}
+// a fixed-size ledger record. each is appended with a single O_APPEND write, so records
+// from concurrent llmq processes never interleave. strings are truncated, not terminated.
+struct ledger_record {
+	char          magic[2]; // "lq"
+	std::uint8_t  version;
+	std::uint8_t  flags;
+	std::uint32_t duration_ms;
+	std::int64_t  time; // unix time at the start of the transfer
+	std::uint32_t ttfb_ms;
+	std::uint32_t prompt;
+	std::uint32_t completion;
+	std::uint32_t cached;
+	std::uint32_t cost; // micro-USD
+	char          model[28];
+	char          context[48];
+	char          tag[16];
+
+	static constexpr std::uint8_t current   = 1;
+	static constexpr std::uint8_t estimated = 1 << 0;
+	static constexpr std::uint8_t hit       = 1 << 1; // served from the plugin cache
+	static constexpr std::uint8_t miss      = 1 << 2; // not found in the plugin cache
+};
 
-	::curl_easy_cleanup(curl);
-	::curl_slist_free_all(headers);
-	::curl_global_cleanup();
+static_assert(sizeof(ledger_record) == 128);
+
+template <std::size_t N>
+inline static void
+write_field(char (&dst)[N], std::string_view src) noexcept {
+	std::memset(dst, 0, N);
+	std::memcpy(dst, src.data(), std::min(N, src.size()));
+}
 
-	plug_finish();
+template <std::size_t N>
+[[nodiscard]] inline static std::string_view
+read_field(char const (&src)[N]) noexcept {
+	return {src, ::strnlen(src, N)};
 }
 
-inline static struct ryml_error_handler {
-	void
-	on_error(const char* msg, size_t len, ryml::Location loc) {
-		throw std::runtime_error(
-		    ryml::formatrs<std::string>("{}:{}:{} ({}B): ERROR: {}", loc.name, loc.line,
-		                                loc.col, loc.offset, ryml::csubstr(msg, len)));
-	}
+struct price {
+	double prompt; // USD per 1M tokens
+	double cached;
+	double completion;
+};
 
-	static void
-	s_error(const char* msg, size_t len, ryml::Location loc, void* this_) {
-		return ((ryml_error_handler*)this_)->on_error(msg, len, loc);
+struct transfer_timing {
+	std::chrono::system_clock::time_point start;
+	std::chrono::milliseconds             ttfb;
+	std::chrono::milliseconds             duration;
+	bool                                  shared{false}; // replayed from another process
+};
+
+struct ledger {
+	fs::path                                   path;
+	std::string                                context;
+	std::string                                tag;
+	std::vector<std::pair<std::string, price>> prices;
+
+	// returns the cost in micro-USD using the longest matching model prefix
+	[[nodiscard]] std::uint32_t
+	cost(plugin::tokens const& t) const noexcept {
+		price const* best = nullptr;
+		std::size_t  len  = 0;
+		for (auto&& [model, p] : prices) {
+			if (t.model.starts_with(model) && (!best || model.size() > len)) {
+				best = &p;
+				len  = model.size();
+			}
+		}
+		if (!best)
+			return 0;
+		auto   cached = std::min(t.cached, t.prompt);
+		double micro  = (t.prompt - cached) * best->prompt + cached * best->cached +
+		               t.completion * best->completion;
+		return std::min<double>(micro, std::numeric_limits<std::uint32_t>::max());
 	}
 
-	ryml::Callbacks
-	callbacks() {
-		return ryml::Callbacks(this, nullptr, nullptr, ryml_error_handler::s_error);
+	void
+	append(plugin::tokens const& t, transfer_timing const& timing,
+	       std::uint8_t flags = 0) const noexcept {
+		auto clamp = [](auto v) {
+			return (std::uint32_t)std::min<std::uint64_t>(
+			    v, std::numeric_limits<std::uint32_t>::max());
+		};
+
+		ledger_record r{};
+		r.magic[0]    = 'l';
+		r.magic[1]    = 'q';
+		r.version     = ledger_record::current;
+		r.flags       = flags | (t.estimated ? ledger_record::estimated : 0);
+		r.duration_ms = clamp(timing.duration.count());
+		r.time        = std::chrono::system_clock::to_time_t(timing.start);
+		r.ttfb_ms     = clamp(timing.ttfb.count());
+		r.prompt      = clamp(t.prompt);
+		r.completion  = clamp(t.completion);
+		r.cached      = clamp(t.cached);
+		r.cost        = cost(t);
+		write_field(r.model, t.model);
+		write_field(r.context, context);
+		write_field(r.tag, tag);
+
+		int fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+		                S_IRUSR | S_IWUSR);
+		if (fd < 0)
+			return warn("could not open the ledger ", path, ": ", std::strerror(errno));
+		if (::write(fd, &r, sizeof r) != sizeof r)
+			warn("could not write to the ledger ", path, ": ", std::strerror(errno));
+		::close(fd);
 	}
-} ryml_error_handler;
+};
 
-} // namespace llmq
+// reads MODEL: {prompt: NUM, cached: NUM, completion: NUM} (USD per 1M tokens)
+[[nodiscard]] inline static std::vector<std::pair<std::string, price>>
+read_prices(fs::path const& path) noexcept {
+	std::vector<std::pair<std::string, price>> res;
+	if (!fs::exists(path))
+		return res;
 
-int
-main(int argc, char** argv) {
-	using namespace llmq;
-	using enum llmq::action;
+	FILE*       f    = open_file(path, "r");
+	std::string data = read_file(path, f);
+	std::fclose(f);
 
-	// prevent any new plugins from being constructed
-	main_started = true;
+	try {
+		ryml::Tree tree = ryml::parse_in_arena(ryml::csubstr{data.data(), data.size()});
+		auto       root = tree.crootref();
+		if (root.empty())
+			return res;
+		if (!root.is_map())
+			throw std::runtime_error{"expected a map of model prices"};
+		for (auto&& m : root) {
+			price p{0, 0, 0};
+			if (m.has_child("prompt"))
+				m["prompt"] >> p.prompt;
+			p.cached = p.prompt;
+			if (m.has_child("cached"))
+				m["cached"] >> p.cached;
+			if (m.has_child("completion"))
+				m["completion"] >> p.completion;
+			res.emplace_back(std::string{m.key().str, m.key().len}, p);
+		}
+	} catch (std::exception const& e) {
+		die("could not parse prices ", path, ": ", e.what());
+	}
 
-	// set rapidyaml to use exceptions
-	ryml::set_callbacks(ryml_error_handler.callbacks());
+	return res;
+}
 
-	// read plugin, action, and context (and assert validity)
-	// note: list and help are handled by parse_llmq_args
-	auto a = parse_llmq_args(argc, argv);
+// a spending limit read from budgets.yml
+struct budget {
+	enum class unit : uint8_t { day, month };
+
+	unit                         period;
+	std::optional<std::uint64_t> tokens{}; // prompt + completion
+	std::optional<std::uint64_t> cost{};    // micro-USD
+	std::string                  context{}; // applies to contexts with this prefix
+	std::string                  tag{};     // applies to this $LLMQ_TAG
+	std::uint64_t                id{};      // identifies the counter
+
+	[[nodiscard]] std::string
+	describe() const {
+		std::string res = period == unit::day ? "daily budget" : "monthly budget";
+		if (!context.empty())
+			res += " for context \"" + context + "*\"";
+		if (!tag.empty())
+			res += " for tag \"" + tag + "\"";
+		return res;
+	}
 
-	// handle any action that does not require the plugin to be initialized
-	switch (a.action) {
-		case query: {
-			// initialize the plugin
-			init_plugin(argc, argv, a,
-			            a.context.empty() ? std::string{}
-			                              : read_context(prepare_ctxfile(a)),
-			            prepare_authfile(a));
+	// the current day or month number
+	[[nodiscard]] std::int64_t
+	current() const noexcept {
+		std::time_t now = std::time(nullptr);
+		std::tm     tm;
+		::localtime_r(&now, &tm);
+		if (period == unit::month)
+			return (tm.tm_year + 1900) * 12 + tm.tm_mon;
+		return (now + tm.tm_gmtoff) / 86400;
+	}
+};
 
-			// make the request without saving context
-			request(
-			    a.plugin, a.verbose,
-			    [a](std::string_view reply) {
-				    // update plugin and print deltas
-				    plugop(a.plugin->name(), "process reply using", [&a, &reply] {
-					    a.plugin->onreply(reply, true);
-				    });
-			    },
-			    [a] {
-				    // notify the plugin that the request has completed
-				    plugop(a.plugin->name(), "finalize", [&a] {
-					    a.plugin->onfinish(true);
-				    });
-			    });
-		} break;
+// reads a sequence of {period: day|month, tokens: INT, usd: NUM, context: STR, tag: STR}
+[[nodiscard]] inline static std::vector<budget>
+read_budgets(fs::path const& path) noexcept {
+	std::vector<budget> res;
+	if (!fs::exists(path))
+		return res;
 
-		case chat: {
-			context_writer wctx = init_plugctx(argc, argv, a);
-
-			// make the request; save context each reply
-			request(
-			    a.plugin, a.verbose,
-			    [a, &wctx](std::string_view reply) {
-				    // update plugin and print deltas
-				    plugop(a.plugin->name(), "process reply using", [&a, &reply] {
-					    a.plugin->onreply(reply, !a.quiet);
-				    });
-
-				    wctx.overwrite(
-					plugop(a.plugin->name(), "get context from", [&a] {
-						return a.plugin->context();
-					}));
-			    },
-			    [a] {
-				    // notify the plugin that the request has completed
-				    plugop(a.plugin->name(), "finalize", [&a] {
-					    a.plugin->onfinish(!a.quiet);
-				    });
-			    });
+	FILE*       f    = open_file(path, "r");
+	std::string data = read_file(path, f);
+	std::fclose(f);
 
-		} break;
+	try {
+		ryml::Tree tree = ryml::parse_in_arena(ryml::csubstr{data.data(), data.size()});
+		auto       root = tree.crootref();
+		if (root.empty())
+			return res;
+		if (!root.is_seq())
+			throw std::runtime_error{"expected a sequence of budgets"};
+		for (auto&& b : root) {
+			if (!b.is_map() || !b.has_child("period"))
+				throw std::runtime_error{"each budget must be a map with a period"};
+			budget v{budget::unit::day};
+			if (b["period"].val() == "month")
+				v.period = budget::unit::month;
+			else if (b["period"].val() != "day")
+				throw std::runtime_error{"period must be one of: day, month"};
+			if (b.has_child("tokens")) {
+				std::uint64_t t;
+				b["tokens"] >> t;
+				v.tokens = t;
+			}
+			if (b.has_child("usd")) {
+				double usd;
+				b["usd"] >> usd;
+				v.cost = usd * 1e6;
+			}
+			if (!v.tokens && !v.cost)
+				throw std::runtime_error{"each budget must set tokens and/or usd"};
+			if (b.has_child("context"))
+				b["context"] >> v.context;
+			if (b.has_child("tag"))
+				b["tag"] >> v.tag;
+
+			// limits may change without resetting the counter
+			v.id = content_hash(std::string{b["period"].val().str, b["period"].val().len} +
+			                    '\0' + v.context + '\0' + v.tag) |
+			       1; // 0 marks a free slot
+			res.push_back(std::move(v));
+		}
+	} catch (std::exception const& e) {
+		die("could not parse budgets ", path, ": ", e.what());
+	}
 
-		case init: {
-			if (a.context.empty())
-				a.context = compute_tmpctx(a);
-			context_writer wctx = init_plugctx(argc, argv, a);
+	return res;
+}
 
-			wctx.overwrite(plugop(a.plugin->name(), "get context from", [&a] {
-				return a.plugin->context();
-			}));
-			std::cout << a.plugin->name() << "://" << a.context << '\n';
-		} break;
+// budget counters shared by every llmq process through a mmapped file.
+// requests reserve their estimated spend with atomic adds before the transfer begins,
+// so concurrent processes can never overcommit, and reconcile once the spend is known.
+// reservations are charged against the counters of the period in which they were made;
+// any still held when the process exits (e.g. through die) are released.
+struct budgets {
+   public:
+	struct reservation {
+		std::uint64_t tokens{0};
+		std::uint64_t cost{0};
+	};
 
-		case edit: {
-			fs::path f = prepare_ctxfile(a);
-			return (spawn_editor(f.parent_path().parent_path(), f), 0);
-		}
+	// releases its reservation unless it has been reconciled
+	class hold {
+	   public:
+		hold() noexcept = default;
 
-		case auth: {
-			fs::path f = prepare_authfile(a);
-			return (spawn_editor(f.parent_path().parent_path(), f), 0);
+		hold(hold&& other) noexcept
+		    : _owner{std::exchange(other._owner, nullptr)},
+		      _ticket{other._ticket} {
+		}
+
+		hold&
+		operator=(hold&& other) noexcept {
+			if (this != &other) {
+				release();
+				_owner  = std::exchange(other._owner, nullptr);
+				_ticket = other._ticket;
+			}
+			return *this;
+		}
+
+		~hold() {
+			release();
+		}
+
+		// replaces the reservation with the actual spend
+		void
+		reconcile(reservation actual) noexcept {
+			if (auto owner = std::exchange(_owner, nullptr))
+				owner->settle(_ticket, actual);
+		}
+
+		void
+		release() noexcept {
+			reconcile({});
+		}
+
+	   private:
+		friend budgets;
+
+		hold(budgets const* owner, std::uint64_t ticket) noexcept
+		    : _owner{owner},
+		      _ticket{ticket} {
+		}
+
+		budgets const* _owner{nullptr};
+		std::uint64_t  _ticket{0};
+	};
+
+	budgets(fs::path path, std::vector<budget> applicable) noexcept
+	    : _budgets{std::move(applicable)},
+	      _path{std::move(path)} {
+		if (_budgets.empty())
+			return;
+
+		_fd = ::open(_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if (_fd < 0)
+			die("could not open the budget counters ", _path, ": ", std::strerror(errno));
+
+		lock(F_WRLCK);
+		struct stat st;
+		if (::fstat(_fd, &st) < 0)
+			die("could not stat the budget counters ", _path, ": ", std::strerror(errno));
+		if ((std::size_t)st.st_size < sizeof(slot) * nslots &&
+		    ::ftruncate(_fd, sizeof(slot) * nslots) < 0)
+			die("could not size the budget counters ", _path, ": ", std::strerror(errno));
+		lock(F_UNLCK);
+
+		void* map = ::mmap(nullptr, sizeof(slot) * nslots, PROT_READ | PROT_WRITE,
+		                   MAP_SHARED, _fd, 0);
+		if (map == MAP_FAILED)
+			die("could not map the budget counters ", _path, ": ", std::strerror(errno));
+		_slots = static_cast<slot*>(map);
+
+		// die exits without unwinding, so outstanding reservations are released at exit
+		// (the registry is constructed first so it outlives the handler)
+		std::lock_guard lock{live_mutex()};
+		auto&           registry = live();
+		static std::once_flag registered;
+		std::call_once(registered, [] {
+			std::atexit([] {
+				std::lock_guard lock{live_mutex()};
+				for (auto b : live())
+					b->release_all();
+			});
+		});
+		registry.push_back(this);
+	}
+
+	budgets(budgets const&)            = delete;
+	budgets& operator=(budgets const&) = delete;
+
+	~budgets() {
+		if (_slots) {
+			{
+				std::lock_guard lock{live_mutex()};
+				std::erase(live(), this);
+			}
+			release_all();
+			::munmap(_slots, sizeof(slot) * nslots);
+		}
+		if (_fd >= 0)
+			::close(_fd);
+	}
+
+	[[nodiscard]] bool
+	empty() const noexcept {
+		return _budgets.empty();
+	}
+
+	// reserves the estimated spend against every budget or dies if any would be exceeded
+	[[nodiscard]] hold
+	reserve(reservation r) const noexcept {
+		std::string exceeded;
+		auto        h = try_reserve(r, exceeded);
+		if (!h)
+			die(exceeded, ". see budgets.yml in the plugin confdir");
+		return std::move(*h);
+	}
+
+	// reserves the estimated spend against every budget, unless any would be exceeded
+	// (which is described by exceeded)
+	[[nodiscard]] std::optional<hold>
+	try_reserve(reservation r, std::string& exceeded) const noexcept {
+		std::vector<charge> charges;
+		for (auto&& b : _budgets) {
+			auto& s = find(b);
+			auto  t = std::atomic_ref{s.tokens}.fetch_add(r.tokens) + r.tokens;
+			auto  c = std::atomic_ref{s.cost}.fetch_add(r.cost) + r.cost;
+			charges.push_back({&s, b.id, std::atomic_ref{s.period}.load(), r});
+			if ((b.tokens && t > *b.tokens) || (b.cost && c > *b.cost)) {
+				// undo this and all previous reservations
+				for (auto&& ch : charges)
+					ch.settle({});
+				std::ostringstream used;
+				if (b.tokens && t > *b.tokens)
+					used << t - r.tokens << '/' << *b.tokens << " tokens used";
+				else
+					used << std::fixed << std::setprecision(4) << (c - r.cost) / 1e6
+					     << '/' << *b.cost / 1e6 << " USD used";
+				exceeded = b.describe() + " exceeded (" + used.str() + ")";
+				return std::nullopt;
+			}
+		}
+		std::lock_guard lock{_mutex};
+		_held.emplace(++_tickets, std::move(charges));
+		return hold{this, _tickets};
+	}
+
+   private:
+	struct slot {
+		std::uint64_t id; // budget::id, 0 if free
+		std::int64_t  period;
+		std::uint64_t tokens;
+		std::uint64_t cost;
+	};
+
+	// a reservation made against one counter
+	struct charge {
+		slot*         s;
+		std::uint64_t id;
+		std::int64_t  period;
+		reservation   reserved;
+
+		// replaces the reservation with the actual spend. if the counter has since
+		// rolled over to a later period, the reservation went with it.
+		void
+		settle(reservation actual) const noexcept {
+			if (std::atomic_ref{s->id}.load() != id ||
+			    std::atomic_ref{s->period}.load() != period)
+				return;
+			add(s->tokens, actual.tokens, reserved.tokens);
+			add(s->cost, actual.cost, reserved.cost);
+		}
+	};
+
+	static constexpr std::size_t nslots = 256;
+
+	std::vector<budget> _budgets;
+	fs::path            _path;
+	int                 _fd{-1};
+	slot*               _slots{nullptr};
+
+	mutable std::mutex                                             _mutex;
+	mutable std::uint64_t                                          _tickets{0};
+	mutable std::unordered_map<std::uint64_t, std::vector<charge>> _held;
+
+	[[nodiscard]] static std::mutex&
+	live_mutex() noexcept {
+		static std::mutex m;
+		return m;
+	}
+
+	[[nodiscard]] static std::vector<budgets const*>&
+	live() noexcept {
+		static std::vector<budgets const*> v;
+		return v;
+	}
+
+	// adds `plus` and subtracts `minus` without dropping below zero; a counter can
+	// have been rolled over and reset between the period check and the update
+	static void
+	add(std::uint64_t& counter, std::uint64_t plus, std::uint64_t minus) noexcept {
+		std::atomic_ref a{counter};
+		auto            v = a.load();
+		while (!a.compare_exchange_weak(v, v + plus > minus ? v + plus - minus : 0))
+			;
+	}
+
+	void
+	settle(std::uint64_t ticket, reservation actual) const noexcept {
+		std::vector<charge> charges;
+		{
+			std::lock_guard lock{_mutex};
+			auto            it = _held.find(ticket);
+			if (it == _held.end())
+				return;
+			charges = std::move(it->second);
+			_held.erase(it);
+		}
+		for (auto&& ch : charges)
+			ch.settle(actual);
+	}
+
+	void
+	release_all() const noexcept {
+		std::lock_guard lock{_mutex};
+		for (auto&& [_, charges] : _held)
+			for (auto&& ch : charges)
+				ch.settle({});
+		_held.clear();
+	}
+
+	void
+	lock(short type) const noexcept {
+		::flock l{};
+		l.l_type   = type;
+		l.l_whence = SEEK_SET;
+		if (::fcntl(_fd, F_SETLKW, &l) < 0)
+			die("could not lock the budget counters ", _path, ": ", std::strerror(errno));
+	}
+
+	[[nodiscard]] slot*
+	lookup(std::uint64_t id, std::int64_t period) const noexcept {
+		for (std::size_t i = 0; i < nslots; ++i)
+			if (std::atomic_ref{_slots[i].id}.load() == id &&
+			    std::atomic_ref{_slots[i].period}.load() == period)
+				return &_slots[i];
+		return nullptr;
+	}
+
+	// finds the counter for the current period. counters are only claimed or rolled
+	// over under a file lock; everything else is lock-free.
+	[[nodiscard]] slot&
+	find(budget const& b) const noexcept {
+		auto period = b.current();
+		if (auto s = lookup(b.id, period))
+			return *s;
+
+		lock(F_WRLCK);
+		slot* s = lookup(b.id, period);
+		if (!s) {
+			// reuse this budget's expired counter, a free one, or the stalest one
+			for (std::size_t i = 0; i < nslots && !s; ++i)
+				if (_slots[i].id == b.id)
+					s = &_slots[i];
+			for (std::size_t i = 0; i < nslots && !s; ++i)
+				if (_slots[i].id == 0)
+					s = &_slots[i];
+			if (!s)
+				s = &*std::ranges::min_element(std::span{_slots, nslots}, {}, &slot::period);
+			std::atomic_ref{s->tokens}.store(0);
+			std::atomic_ref{s->cost}.store(0);
+			std::atomic_ref{s->period}.store(period);
+			std::atomic_ref{s->id}.store(b.id);
+		}
+		lock(F_UNLCK);
+		return *s;
+	}
+};
+
+[[nodiscard]] inline static ledger
+prepare_ledger(llmq_args_result const& a) noexcept {
+	fs::path dir = compute_datadir(a);
+	mkdir_p(dir);
+	char const* tag = std::getenv("LLMQ_TAG");
+	return {dir / ".ledger", a.context, tag ? tag : "",
+	        read_prices(compute_confdir(a) / "prices.yml")};
+}
+
+// priority classes, in order of precedence
+enum class priority : uint8_t { interactive, normal, bulk };
+
+// adapts the number of requests in flight for a plugin across processes (AIMD).
+// the window grows by one per window of successful requests and is cut on 429/5xx
+// responses or latency spikes. rate limit headers cap the window and may pause
+// new requests until a reset. state is shared through a mmapped TMPDIR/.limiter;
+// each request in flight holds an OFD lock on one of the first `window` slot bytes,
+// so slots are released by the kernel even if a process dies.
+struct limiter {
+   public:
+	// a slot in the window, held for the duration of a transfer
+	struct slot {
+		slot() noexcept = default;
+		slot(int fd) noexcept : _fd{fd} {}
+		slot(slot&& other) noexcept : _fd{std::exchange(other._fd, -1)} {}
+		slot& operator=(slot&& other) noexcept {
+			std::swap(_fd, other._fd);
+			return *this;
+		}
+		~slot() {
+			if (_fd >= 0)
+				::close(_fd);
+		}
+
+	   private:
+		int _fd{-1};
+	};
+
+	// feedback from the response headers
+	struct response {
+		long                       status{0};
+		std::chrono::milliseconds  ttfb{0};
+		std::optional<std::size_t> remaining{};   // requests or tokens
+		std::chrono::milliseconds  reset{0};       // until remaining is replenished
+		std::chrono::milliseconds  retry_after{0};
+	};
+
+	// max is the largest window; 0 disables the limiter
+	limiter(fs::path path, std::size_t max, enum priority priority, bool verbose) noexcept
+	    : _path{std::move(path)},
+	      _max{std::min(max, nslots)},
+	      _priority{priority},
+	      _verbose{verbose} {
+		if (!_max)
+			return;
+
+		_fd = ::open(_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if (_fd < 0)
+			die("could not open the limiter ", _path, ": ", std::strerror(errno));
+
+		lock(F_WRLCK);
+		struct stat st;
+		if (::fstat(_fd, &st) < 0)
+			die("could not stat the limiter ", _path, ": ", std::strerror(errno));
+		if ((std::size_t)st.st_size < sizeof(state) && ::ftruncate(_fd, sizeof(state)) < 0)
+			die("could not size the limiter ", _path, ": ", std::strerror(errno));
+		void* map = ::mmap(nullptr, sizeof(state), PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+		if (map == MAP_FAILED)
+			die("could not map the limiter ", _path, ": ", std::strerror(errno));
+		_state = static_cast<state*>(map);
+		if (_state->version != state::current) {
+			*_state         = {};
+			_state->version = state::current;
+			_state->window  = initial;
+		}
+		lock(F_UNLCK);
+	}
+
+	limiter(limiter const&)            = delete;
+	limiter& operator=(limiter const&) = delete;
+
+	~limiter() {
+		if (_state)
+			::munmap(_state, sizeof(state));
+		if (_fd >= 0)
+			::close(_fd);
+	}
+
+	// waits for a slot in the window. waiting processes are admitted by priority class
+	// with weighted fair queuing. empty if disabled or interrupted.
+	[[nodiscard]] task<slot>
+	acquire(executor& ex) {
+		if (!_max)
+			co_return slot{};
+
+		int fd = ::open(_path.c_str(), O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			die("could not open the limiter ", _path, ": ", std::strerror(errno));
+
+		auto c       = static_cast<std::size_t>(_priority);
+		bool waiting = false;
+		bool logged  = false;
+		while (!interrupted) {
+			lock(F_WRLCK);
+			auto& s   = *_state;
+			auto  now = since_epoch();
+			if (!waiting) {
+				// waiters that died are forgotten once their class goes quiet
+				for (std::size_t k = 0; k < nclasses; ++k)
+					if (now - s.seen[k] >= stale.count())
+						s.waiters[k] = 0;
+				// an idle class may not claim the service it missed
+				if (!s.waiters[c])
+					s.vtime[c] = std::max(s.vtime[c], s.vclock);
+				++s.waiters[c];
+				waiting = true;
+			}
+			s.seen[c] = now;
+
+			// the waiters of classes due before this one are left enough free slots
+			std::size_t ahead = 0;
+			for (std::size_t k = 0; k < c; ++k)
+				if (active(k, now) && finish(k) <= finish(c))
+					ahead += s.waiters[k];
+			for (std::size_t k = c + 1; k < nclasses; ++k)
+				if (active(k, now) && finish(k) < finish(c))
+					ahead += s.waiters[k];
+			auto window  = std::clamp<std::size_t>(s.window, 1, _max);
+			auto backoff = s.backoff;
+			lock(F_UNLCK);
+
+			if (now < backoff) {
+				verbose_log(_verbose && !logged, "[limit] backing off for ", backoff - now, "ms");
+				logged = true;
+				co_await ex.sleep(std::min<std::chrono::milliseconds>(
+				    std::chrono::milliseconds{backoff - now}, poll * 5));
+				continue;
+			}
+
+			std::size_t          nfree = 0;
+			std::optional<off_t> pick;
+			for (std::size_t i = 0; i < window; ++i) {
+				off_t off = sizeof(state) + (i + ::getpid()) % window;
+				if (!slot_lock(fd, off, F_OFD_GETLK)) {
+					++nfree;
+					if (!pick)
+						pick = off;
+				}
+			}
+			if (pick && nfree > ahead && slot_lock(fd, *pick, F_OFD_SETLK)) {
+				lock(F_WRLCK);
+				s.vclock = s.vtime[c];
+				s.vtime[c] += 1 / weights[c];
+				if (s.waiters[c])
+					--s.waiters[c];
+				lock(F_UNLCK);
+				verbose_log(_verbose, "[limit] acquired a slot in a window of ", window);
+				co_return slot{fd};
+			}
+
+			verbose_log(_verbose && !logged, "[limit] waiting for a slot in a window of ",
+			            window, " (", ahead, " waiting ahead)");
+			logged = true;
+			co_await ex.sleep(poll);
+		}
+
+		if (waiting) {
+			lock(F_WRLCK);
+			if (_state->waiters[c])
+				--_state->waiters[c];
+			lock(F_UNLCK);
+		}
+		::close(fd);
+		co_return slot{};
+	}
+
+	// adjusts the window and backoff
+	void
+	update(response const& r) noexcept {
+		if (!_max || r.status < 200)
+			return;
+
+		using std::chrono::milliseconds;
+		lock(F_WRLCK);
+		auto& s   = *_state;
+		auto  now = since_epoch();
+		if (r.status == 429 || r.status >= 500) {
+			s.window  = std::max(1.0, s.window * decrease);
+			s.backoff = std::max(s.backoff, now + r.retry_after.count());
+		} else if (r.status < 400) {
+			double ttfb  = r.ttfb.count();
+			bool   spike = s.latency > 0 && ttfb > s.latency * spike_ratio &&
+			             ttfb - s.latency > spike_floor.count();
+			if (spike)
+				s.window = std::max(1.0, s.window * spike_decrease);
+			else
+				s.window = std::min<double>(_max, s.window + 1 / s.window);
+			s.latency = s.latency > 0 ? s.latency * (1 - smoothing) + ttfb * smoothing : ttfb;
+		}
+
+		// the provider knows its limits better than we do
+		if (r.remaining) {
+			s.window = std::clamp<double>(*r.remaining, 1, s.window);
+			if (*r.remaining == 0)
+				s.backoff = std::max(s.backoff, now + r.reset.count());
+		}
+		verbose_log(_verbose, "[limit] status ", r.status, ", window ", s.window);
+		lock(F_UNLCK);
+	}
+
+   private:
+	static constexpr std::size_t nclasses = 3;
+
+	struct state {
+		static constexpr std::uint8_t current = 2;
+
+		std::uint8_t  version;
+		double        window;  // requests allowed in flight
+		double        latency; // moving average time to first byte (ms)
+		std::int64_t  backoff; // ms since epoch; requests wait until then
+		double        vclock;  // virtual time of the last admission
+		double        vtime[nclasses];   // virtual time each class has been served until
+		std::uint32_t waiters[nclasses]; // processes waiting in each class
+		std::int64_t  seen[nclasses];    // ms since epoch a waiter of each class last polled
+	};
+
+	static constexpr std::size_t               nslots         = 256;
+	static constexpr double                    initial        = 4;
+	static constexpr double                    decrease       = 0.5;
+	static constexpr double                    spike_decrease = 0.8;
+	static constexpr double                    spike_ratio    = 2;
+	static constexpr std::chrono::milliseconds spike_floor{250};
+	static constexpr double                    smoothing = 0.1;
+	static constexpr std::chrono::milliseconds poll{10};
+	static constexpr std::chrono::milliseconds stale{250};
+	static constexpr double                    weights[nclasses] = {16, 4, 1};
+
+	fs::path        _path;
+	std::size_t     _max;
+	enum priority   _priority;
+	bool            _verbose;
+	int             _fd{-1};
+	state*          _state{nullptr};
+
+	// whether a class has processes waiting. call with the state locked.
+	[[nodiscard]] bool
+	active(std::size_t k, std::int64_t now) const noexcept {
+		return _state->waiters[k] && now - _state->seen[k] < stale.count();
+	}
+
+	// the virtual time at which the next admission of a class would finish
+	[[nodiscard]] double
+	finish(std::size_t k) const noexcept {
+		return _state->vtime[k] + 1 / weights[k];
+	}
+
+	// true if the slot byte at off is (or becomes, with F_OFD_SETLK) locked
+	[[nodiscard]] static bool
+	slot_lock(int fd, off_t off, int cmd) noexcept {
+		::flock l{};
+		l.l_type   = F_WRLCK;
+		l.l_whence = SEEK_SET;
+		l.l_start  = off;
+		l.l_len    = 1;
+		if (::fcntl(fd, cmd, &l) < 0)
+			return false;
+		return cmd == F_OFD_SETLK || l.l_type != F_UNLCK;
+	}
+
+	[[nodiscard]] static std::int64_t
+	since_epoch() noexcept {
+		return std::chrono::duration_cast<std::chrono::milliseconds>(
+		           std::chrono::system_clock::now().time_since_epoch())
+		    .count();
+	}
+
+	void
+	lock(short type) noexcept {
+		::flock l{};
+		l.l_type   = type;
+		l.l_whence = SEEK_SET;
+		l.l_len    = sizeof(state);
+		if (::fcntl(_fd, F_SETLKW, &l) < 0)
+			die("could not lock the limiter ", _path, ": ", std::strerror(errno));
+	}
+};
+
+// parses a duration such as 20ms, 1.5s, or 6m0s (used by rate limit headers)
+[[nodiscard]] inline static std::chrono::milliseconds
+parse_reset(std::string_view s) noexcept {
+	double ms = 0;
+	while (!s.empty()) {
+		double v;
+		auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), v);
+		if (ec != std::errc{})
+			return {};
+		s.remove_prefix(end - s.data());
+		if (s.starts_with("ms"))
+			ms += v, s.remove_prefix(2);
+		else if (s.starts_with("h"))
+			ms += v * 3600000, s.remove_prefix(1);
+		else if (s.starts_with("m"))
+			ms += v * 60000, s.remove_prefix(1);
+		else if (s.starts_with("s"))
+			ms += v * 1000, s.remove_prefix(1);
+		else
+			ms += v * 1000, s = {}; // retry-after is in seconds
+	}
+	return std::chrono::milliseconds{(std::int64_t)ms};
+}
+
+// collects limiter feedback from the response headers
+struct response_headers {
+	CURL*                                            curl;
+	limiter*                                         lim;
+	std::chrono::steady_clock::time_point            start;
+	limiter::response                                res{};
+};
+
+inline static size_t
+onheader(char* ptr, size_t size, size_t nitems, void* headers_void) {
+	auto&            h   = *static_cast<response_headers*>(headers_void);
+	size_t           len = size * nitems;
+	std::string_view line{ptr, len};
+	while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+		line.remove_suffix(1);
+
+	if (line.empty()) {
+		// the end of a header block; informational responses are skipped
+		::curl_easy_getinfo(h.curl, CURLINFO_RESPONSE_CODE, &h.res.status);
+		h.res.ttfb = std::chrono::duration_cast<std::chrono::milliseconds>(
+		    std::chrono::steady_clock::now() - h.start);
+		h.lim->update(h.res);
+		h.res = {};
+		return len;
+	}
+
+	auto colon = line.find(':');
+	if (colon == line.npos)
+		return len;
+	std::string name{line.substr(0, colon)};
+	std::ranges::transform(name, name.begin(), [](unsigned char c) {
+		return std::tolower(c);
+	});
+	auto value = trim(line.substr(colon + 1));
+
+	if (name == "retry-after") {
+		h.res.retry_after = parse_reset(value);
+	} else if (name == "retry-after-ms") {
+		h.res.retry_after = parse_reset(std::string{value} + "ms");
+	} else if (name == "x-ratelimit-remaining-requests" ||
+	           name == "x-ratelimit-remaining-tokens") {
+		std::size_t n;
+		if (std::from_chars(value.data(), value.data() + value.size(), n).ec == std::errc{} &&
+		    (!h.res.remaining || n < *h.res.remaining))
+			h.res.remaining = n;
+	} else if (name == "x-ratelimit-reset-requests" || name == "x-ratelimit-reset-tokens") {
+		h.res.reset = std::max(h.res.reset, parse_reset(value));
+	}
+	return len;
+}
+
+// the directory of in-flight request spools, or empty if dedup is disabled
+[[nodiscard]] inline static fs::path
+prepare_spooldir(llmq_args_result const& a) noexcept {
+	if (!a.dedup)
+		return {};
+	fs::path dir = compute_tmpdir(a) / ".inflight";
+	mkdir_p(dir);
+	return dir;
+}
+
+// the adaptive concurrency limiter, with the window capped by $LLMQ_CONCURRENCY
+// and requests admitted by $LLMQ_PRIORITY
+[[nodiscard]] inline static limiter
+prepare_limiter(llmq_args_result const& a) noexcept {
+	std::size_t max = 64;
+	if (char const* env = std::getenv("LLMQ_CONCURRENCY")) {
+		std::string_view v{env};
+		if (std::from_chars(v.data(), v.data() + v.size(), max).ec != std::errc{})
+			die("$LLMQ_CONCURRENCY must be a non-negative integer");
+	}
+	enum priority prio = priority::normal;
+	if (char const* env = std::getenv("LLMQ_PRIORITY")) {
+		std::string_view v{env};
+		if (v == "interactive")
+			prio = priority::interactive;
+		else if (v == "bulk")
+			prio = priority::bulk;
+		else if (!v.empty() && v != "default")
+			die("$LLMQ_PRIORITY must be one of: interactive, default, bulk");
+	}
+	fs::path dir = compute_tmpdir(a);
+	mkdir_p(dir);
+	return {dir / ".limiter", max, prio, a.verbose};
+}
+
+// reads the budgets that apply to the context and $LLMQ_TAG
+[[nodiscard]] inline static budgets
+prepare_budgets(llmq_args_result const& a) noexcept {
+	char const*         tag = std::getenv("LLMQ_TAG");
+	std::vector<budget> applicable;
+	for (auto&& b : read_budgets(compute_confdir(a) / "budgets.yml"))
+		if (a.context.starts_with(b.context) && (b.tag.empty() || (tag && b.tag == tag)))
+			applicable.push_back(std::move(b));
+	return {compute_datadir(a) / ".budgets", std::move(applicable)};
+}
+
+// sums the ledger by the provided keys for all contexts that begin with prefix
+inline static void
+print_ledger(fs::path const& path, std::string_view prefix,
+             std::span<char* const> keys) noexcept {
+	enum class key : uint8_t { day, month, model, context, tag };
+	std::vector<key> by;
+	for (std::string_view k : keys) {
+		if (k == "day")
+			by.push_back(key::day);
+		else if (k == "month")
+			by.push_back(key::month);
+		else if (k == "model")
+			by.push_back(key::model);
+		else if (k == "context")
+			by.push_back(key::context);
+		else if (k == "tag")
+			by.push_back(key::tag);
+		else
+			die("invalid ledger key \"", k, "\". expected day|month|model|context|tag");
+	}
+
+	struct sum {
+		std::uint64_t requests{0};
+		std::uint64_t hits{0};
+		std::uint64_t misses{0};
+		std::uint64_t prompt{0};
+		std::uint64_t cached{0};
+		std::uint64_t completion{0};
+		std::uint64_t estimated{0};
+		std::uint64_t cost{0};
+		std::uint64_t duration_ms{0};
+
+		void
+		add(ledger_record const& r) noexcept {
+			// cache hits made no request
+			if (r.flags & ledger_record::hit) {
+				++hits;
+				return;
+			}
+			++requests;
+			misses += (r.flags & ledger_record::miss) != 0;
+			prompt += r.prompt;
+			cached += r.cached;
+			completion += r.completion;
+			estimated += (r.flags & ledger_record::estimated) != 0;
+			cost += r.cost;
+			duration_ms += r.duration_ms;
+		}
+	};
+
+	std::unordered_map<std::string, sum> groups;
+	sum                                  total;
+
+	if (fs::exists(path)) {
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			die("could not open the ledger ", path, ": ", std::strerror(errno));
+		struct stat st;
+		if (::fstat(fd, &st) < 0)
+			die("could not stat the ledger ", path, ": ", std::strerror(errno));
+		std::size_t n = st.st_size / sizeof(ledger_record);
+
+		if (n) {
+			void* map = ::mmap(nullptr, n * sizeof(ledger_record), PROT_READ, MAP_PRIVATE,
+			                   fd, 0);
+			if (map == MAP_FAILED)
+				die("could not map the ledger ", path, ": ", std::strerror(errno));
+			::madvise(map, n * sizeof(ledger_record), MADV_SEQUENTIAL);
+
+			// dates are computed with the current UTC offset
+			std::time_t now = std::time(nullptr);
+			std::tm     tm;
+			::localtime_r(&now, &tm);
+			long gmtoff = tm.tm_gmtoff;
+
+			std::int64_t last_day = std::numeric_limits<std::int64_t>::min();
+			char         date[16]{};
+			std::string  k;
+
+			auto records = static_cast<ledger_record const*>(map);
+			for (std::size_t i = 0; i < n; ++i) {
+				auto const& r = records[i];
+				if (r.magic[0] != 'l' || r.magic[1] != 'q' ||
+				    r.version != ledger_record::current)
+					continue;
+				if (!read_field(r.context).starts_with(prefix))
+					continue;
+
+				total.add(r);
+				if (by.empty())
+					continue;
+
+				k.clear();
+				for (std::size_t j = 0; j < by.size(); ++j) {
+					auto b = by[j];
+					if (j)
+						k += '\t';
+					if (b == key::day || b == key::month) {
+						std::int64_t day = (r.time + gmtoff) / 86400 -
+						                   ((r.time + gmtoff) % 86400 < 0);
+						if (day != last_day) {
+							std::chrono::year_month_day ymd{std::chrono::sys_days{
+							    std::chrono::days{day}}};
+							std::snprintf(date, sizeof date, "%04d-%02u-%02u",
+							              (int)ymd.year(), (unsigned)ymd.month(),
+							              (unsigned)ymd.day());
+							last_day = day;
+						}
+						k.append(date, b == key::day ? 10 : 7);
+					} else if (b == key::model) {
+						k += read_field(r.model);
+					} else if (b == key::context) {
+						k += read_field(r.context);
+					} else {
+						k += read_field(r.tag);
+					}
+				}
+				if (auto it = groups.find(k); it != groups.end())
+					it->second.add(r);
+				else
+					groups[k].add(r);
+			}
+
+			::munmap(map, n * sizeof(ledger_record));
+		}
+		::close(fd);
+	}
+
+	std::vector<std::vector<std::string>> rows;
+	{
+		std::vector<std::string> header{keys.begin(), keys.end()};
+		for (auto h : {"requests", "hits", "misses", "estimated", "prompt", "cached",
+		               "completion", "cost", "seconds"})
+			header.push_back(h);
+		rows.push_back(std::move(header));
+	}
+
+	auto row = [&by](std::string_view k, sum const& v) {
+		std::vector<std::string> res;
+		for (std::size_t b = 0, i = 0; b < by.size(); ++b) {
+			auto e = k.find('\t', i);
+			res.emplace_back(k.substr(i, e - i));
+			i = e == k.npos ? k.size() : e + 1;
+		}
+		std::ostringstream cost, secs;
+		cost << std::fixed << std::setprecision(4) << v.cost / 1e6;
+		secs << std::fixed << std::setprecision(1) << v.duration_ms / 1e3;
+		for (auto n : {v.requests, v.hits, v.misses, v.estimated, v.prompt, v.cached,
+		               v.completion})
+			res.push_back(std::to_string(n));
+		res.push_back(cost.str());
+		res.push_back(secs.str());
+		return res;
+	};
+
+	std::vector<std::pair<std::string, sum>> sorted{groups.begin(), groups.end()};
+	std::ranges::sort(sorted, {}, &std::pair<std::string, sum>::first);
+	for (auto&& [k, v] : sorted)
+		rows.push_back(row(k, v));
+	{
+		auto t = row(std::string(by.size() ? by.size() - 1 : 0, '\t'), total);
+		if (!by.empty())
+			t[0] = "total";
+		rows.push_back(std::move(t));
+	}
+
+	std::vector<std::size_t> widths(rows.front().size(), 0);
+	for (auto&& r : rows)
+		for (std::size_t i = 0; i < r.size(); ++i)
+			widths[i] = std::max(widths[i], r[i].size());
+	for (auto&& r : rows) {
+		for (std::size_t i = 0; i < r.size(); ++i) {
+			if (i)
+				std::cout << "  ";
+			if (i < by.size())
+				std::cout << std::left;
+			else
+				std::cout << std::right;
+			std::cout << std::setw(widths[i]) << r[i];
+		}
+		std::cout << '\n';
+	}
+}
+
+// shares the stream of an in-flight request with identical concurrent requests.
+// the first process to claim the request key tees the stream into a spool file
+// (DIR/DIGEST, named by the SHA-256 digest of the key, which is all it records of it)
+// as length-prefixed records; duplicates tail it instead of making their own request.
+// the leader locks the first byte of the spool for as long as it is running, and each
+// follower shares a lock of the second for as long as it is attached.
+struct singleflight {
+   public:
+	enum class role : uint8_t { none, leader, follower };
+	enum class outcome : uint8_t { complete, stopped, orphaned };
+
+	singleflight(fs::path const& dir, std::string const& key, bool verbose) noexcept {
+		auto name = digest(key);
+		_path     = dir / name;
+
+		for (int attempt = 0; attempt < 8; ++attempt) {
+			// the spool is linked into place only once it is locked
+			fs::path tmp = _path;
+			tmp += '.' + std::to_string(::getpid());
+			_fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+			if (_fd < 0 || !lock(F_WRLCK, 0) || !write_record(name)) {
+				warn("could not create the spool ", tmp, ": ", std::strerror(errno));
+				close(tmp);
+				return;
+			}
+			if (::link(tmp.c_str(), _path.c_str()) == 0) {
+				::unlink(tmp.c_str());
+				verbose_log(verbose, "[dedup] leading request ", name);
+				_role = role::leader;
+				return;
+			}
+			int err = errno;
+			close(tmp);
+			if (err != EEXIST) {
+				warn("could not claim the spool ", _path, ": ", std::strerror(err));
+				return;
+			}
+
+			// attach to the leader, unless it finished in the meantime
+			_fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+			if (_fd < 0)
+				continue;
+			std::string theirs;
+			if (!read_record(theirs)) {
+				abandon();
+				continue;
+			}
+			if (theirs != name) {
+				verbose_log(verbose, "[dedup] spool ", name, " is another request");
+				close({});
+				return;
+			}
+			if (!lock(F_RDLCK, 1))
+				verbose_log(verbose, "[dedup] could not lock the spool ", name);
+			verbose_log(verbose, "[dedup] attached to request ", name);
+			_role = role::follower;
+			return;
+		}
+	}
+
+	singleflight(singleflight const&)            = delete;
+	singleflight& operator=(singleflight const&) = delete;
+
+	~singleflight() {
+		// followers that attached already have it open
+		if (_role == role::leader)
+			close(_path);
+		else if (_fd >= 0)
+			::close(_fd);
+	}
+
+	[[nodiscard]] enum role
+	role() const noexcept {
+		return _role;
+	}
+
+	// leader: appends a chunk of the stream. abandons the spool on failure.
+	void
+	tee(std::string_view chunk) noexcept {
+		if (_role == role::leader && !write_record(chunk)) {
+			warn("could not write to the spool ", _path, ": ", std::strerror(errno));
+			close(_path);
+			_role = role::none;
+		}
+	}
+
+	// leader: true if any follower is attached
+	[[nodiscard]] bool
+	followed() noexcept {
+		return _role == role::leader && locked(F_WRLCK, 1);
+	}
+
+	// leader: marks the stream as complete
+	void
+	complete() noexcept {
+		std::uint32_t end = spool_end;
+		if (_role == role::leader && !write_all(&end, sizeof(end)))
+			warn("could not write to the spool ", _path, ": ", std::strerror(errno));
+	}
+
+	// follower: replays the stream into update as the leader receives it.
+	// stops early if update reports done or the request is interrupted.
+	[[nodiscard]] task<outcome>
+	follow(executor& ex, std::function<bool(std::string_view)>& update) {
+		std::string chunk;
+		for (;;) {
+			std::uint32_t len;
+			if (!co_await read_exact(ex, &len, sizeof(len)))
+				co_return interrupted ? outcome::stopped : (abandon(), outcome::orphaned);
+			if (len == spool_end)
+				co_return outcome::complete;
+			chunk.resize(len);
+			if (!co_await read_exact(ex, chunk.data(), len))
+				co_return interrupted ? outcome::stopped : (abandon(), outcome::orphaned);
+			if (update(chunk))
+				co_return outcome::stopped;
+		}
+	}
+
+   private:
+	static constexpr std::uint32_t spool_end = 0xffffffff;
+
+	fs::path  _path;
+	int       _fd{-1};
+	enum role _role { role::none };
+
+	void
+	close(fs::path const& unlink) noexcept {
+		if (!unlink.empty())
+			::unlink(unlink.c_str());
+		if (_fd >= 0)
+			::close(_fd);
+		_fd = -1;
+	}
+
+	// removes the spool of a leader that died, if it is still linked
+	void
+	abandon() noexcept {
+		struct stat ours, linked;
+		if (::fstat(_fd, &ours) == 0 && ::stat(_path.c_str(), &linked) == 0 &&
+		    ours.st_ino == linked.st_ino && ours.st_dev == linked.st_dev)
+			::unlink(_path.c_str());
+		close({});
+	}
+
+	// locks byte at of the spool. the locks belong to the descriptor, so that leaders
+	// and followers in the same process see each other.
+	[[nodiscard]] bool
+	lock(short type, off_t at) noexcept {
+		::flock l{};
+		l.l_type   = type;
+		l.l_whence = SEEK_SET;
+		l.l_start  = at;
+		l.l_len    = 1;
+		return ::fcntl(_fd, F_OFD_SETLK, &l) == 0;
+	}
+
+	// true if another descriptor holds a lock of byte at that conflicts with type
+	[[nodiscard]] bool
+	locked(short type, off_t at) noexcept {
+		::flock l{};
+		l.l_type   = type;
+		l.l_whence = SEEK_SET;
+		l.l_start  = at;
+		l.l_len    = 1;
+		return ::fcntl(_fd, F_OFD_GETLK, &l) == 0 && l.l_type != F_UNLCK;
+	}
+
+	[[nodiscard]] bool
+	leader_alive() noexcept {
+		return locked(F_RDLCK, 0);
+	}
+
+	[[nodiscard]] bool
+	write_all(void const* data, std::size_t len) noexcept {
+		auto p = static_cast<char const*>(data);
+		while (len) {
+			auto n = ::write(_fd, p, len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			p += n;
+			len -= n;
+		}
+		return true;
+	}
+
+	[[nodiscard]] bool
+	write_record(std::string_view data) noexcept {
+		std::string rec(sizeof(std::uint32_t), '\0');
+		std::uint32_t len = data.size();
+		std::memcpy(rec.data(), &len, sizeof(len));
+		rec += data;
+		return write_all(rec.data(), rec.size()); // one write per record
+	}
+
+	enum class io : uint8_t { done, pending, failed };
+
+	static constexpr std::chrono::milliseconds poll{2};
+
+	// reads the rest of len bytes, advancing got. pending if the leader has not written
+	// them yet; failed if the leader exits first or the request is interrupted.
+	[[nodiscard]] io
+	read_some(void* data, std::size_t len, std::size_t& got) noexcept {
+		auto p = static_cast<char*>(data);
+		while (got < len) {
+			auto n = ::read(_fd, p + got, len - got);
+			if (n < 0 && errno == EINTR && !interrupted)
+				continue;
+			if (n < 0 || interrupted)
+				return io::failed;
+			if (n == 0) {
+				// the leader writes everything before it releases the lock
+				if (leader_alive())
+					return io::pending;
+				n = ::read(_fd, p + got, len - got);
+				if (n <= 0)
+					return io::failed;
+			}
+			got += n;
+		}
+		return io::done;
+	}
+
+	// reads len bytes, waiting for the leader to write them
+	[[nodiscard]] bool
+	read_exact(void* data, std::size_t len) noexcept {
+		std::size_t got = 0;
+		io          res;
+		while ((res = read_some(data, len, got)) == io::pending)
+			std::this_thread::sleep_for(poll);
+		return res == io::done;
+	}
+
+	[[nodiscard]] task<bool>
+	read_exact(executor& ex, void* data, std::size_t len) {
+		std::size_t got = 0;
+		io          res;
+		while ((res = read_some(data, len, got)) == io::pending)
+			co_await ex.sleep(poll);
+		co_return res == io::done;
+	}
+
+	[[nodiscard]] bool
+	read_record(std::string& out) noexcept {
+		std::uint32_t len;
+		if (!read_exact(&len, sizeof(len)) || len == spool_end)
+			return false;
+		out.resize(len);
+		return read_exact(out.data(), len);
+	}
+};
+
+// appends s as a quoted JSON string
+inline static void
+append_json(std::string& out, std::string_view s) noexcept {
+	out += '"';
+	for (char ch : s) {
+		switch (ch) {
+			case '"': out += "\\\""; break;
+			case '\\': out += "\\\\"; break;
+			case '\n': out += "\\n"; break;
+			case '\r': out += "\\r"; break;
+			case '\t': out += "\\t"; break;
+			default:
+				if ((unsigned char)ch < 0x20) {
+					char hex[8];
+					std::snprintf(hex, sizeof(hex), "\\u%04x", ch);
+					out += hex;
+				} else {
+					out += ch;
+				}
+		}
+	}
+	out += '"';
+}
+
+// publishes reply deltas to an editor through the FIFO or unix socket CONTEXT.live, if
+// something is listening there. each event is a JSON line:
+//   {"type":"delta","message":M,"offset":O,"text":T} (content of message M from byte O)
+//   {"type":"finish","choice":C,"reason":R}
+//   {"type":"saved"} (the context file was written)
+// writes never block: events a slow listener has not read yet are kept until the next
+// write, and a listener that falls max_backlog bytes behind is dropped. if the listener
+// goes away or is dropped, the sink closes and the context is written every batch again.
+struct live_sink {
+	// how often the context is written while a listener follows the deltas
+	static constexpr std::chrono::milliseconds persist_interval{1000};
+
+	// the most bytes kept for a listener that is not reading
+	static constexpr std::size_t max_backlog = 1 << 20;
+
+	live_sink(fs::path path, bool verbose) noexcept : _path{std::move(path)} {
+		struct stat st;
+		if (::stat(_path.c_str(), &st) < 0)
+			return;
+
+		if (S_ISFIFO(st.st_mode)) {
+			// fails with ENXIO unless a reader has the FIFO open
+			_fd = ::open(_path.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+		} else if (S_ISSOCK(st.st_mode)) {
+			::sockaddr_un addr{};
+			addr.sun_family = AF_UNIX;
+			if (_path.native().size() >= sizeof(addr.sun_path))
+				die("live sink path is too long: ", _path);
+			std::strcpy(addr.sun_path, _path.c_str());
+			// fails with EAGAIN rather than waiting if the listener's backlog is full
+			_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if (_fd >= 0 && ::connect(_fd, (::sockaddr*)&addr, sizeof(addr)) < 0)
+				close();
+		} else {
+			warn(_path, " is neither a FIFO nor a socket; not publishing deltas");
+			return;
+		}
+
+		if (_fd < 0) {
+			verbose_log(verbose, "[live] nothing is listening at ", _path);
+			return;
+		}
+		verbose_log(verbose, "[live] publishing deltas to ", _path);
+
+		// a listener that goes away is reported by write, not by a signal
+		::signal(SIGPIPE, SIG_IGN);
+	}
+	live_sink(live_sink const&)            = delete;
+	live_sink& operator=(live_sink const&) = delete;
+	~live_sink() {
+		close();
+	}
+
+	// whether a listener is connected
+	[[nodiscard]] explicit
+	operator bool() const noexcept {
+		return _fd >= 0;
+	}
+
+	void
+	publish(std::span<plugin::event const> events) noexcept {
+		for (auto&& e : events) {
+			if (e.type == plugin::event::kind::delta && e.message) {
+				_buf += "{\"type\":\"delta\",\"message\":" + std::to_string(*e.message) +
+				        ",\"offset\":" + std::to_string(e.offset) + ",\"text\":";
+				append_json(_buf, e.text);
+				_buf += "}\n";
+			} else if (e.type == plugin::event::kind::finish) {
+				_buf += "{\"type\":\"finish\",\"choice\":" + std::to_string(e.choice) +
+				        ",\"reason\":";
+				append_json(_buf, e.text);
+				_buf += "}\n";
+			}
+		}
+		send();
+	}
+
+	void
+	saved() noexcept {
+		_buf += "{\"type\":\"saved\"}\n";
+		send();
+	}
+
+   private:
+	fs::path    _path;
+	int         _fd{-1};
+	std::string _buf{};
+
+	void
+	close() noexcept {
+		if (_fd >= 0)
+			::close(_fd);
+		_fd = -1;
+	}
+
+	// writes as much of the buffer as the listener takes, and keeps the rest
+	void
+	send() noexcept {
+		std::size_t sent = 0;
+		while (_fd >= 0 && sent < _buf.size()) {
+			::ssize_t n = ::write(_fd, _buf.data() + sent, _buf.size() - sent);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				if (_buf.size() - sent <= max_backlog)
+					break;
+				warn("live sink ", _path, " is not reading; writing the context every batch");
+				close();
+			} else if (n < 0) {
+				warn("live sink ", _path, " closed (", std::strerror(errno),
+				     "); writing the context every batch");
+				close();
+			} else {
+				sent += n;
+			}
+		}
+		if (_fd < 0)
+			_buf.clear();
+		else
+			_buf.erase(0, sent);
+	}
+};
+
+// consumes the response chunks of a session. the events of each batch of chunks are
+// handled in stages: printed (or collected), published, persisted, then measured. given
+// a strand, batches are processed in order on its pool; otherwise they are processed on
+// the calling thread.
+struct pipeline {
+	pipeline(plugin* plug, plugin::session* sess, bool print, bool verbose,
+	         std::function<void()> persist = {}, live_sink* live = nullptr,
+	         pool::strand* strand = nullptr, std::string* reply = nullptr) noexcept
+	    : plug{plug},
+	      sess{sess},
+	      print{print},
+	      verbose{verbose},
+	      persist{std::move(persist)},
+	      live{live},
+	      strand{strand},
+	      reply{reply},
+	      track_id{trace.enabled() ? trace.track(std::string{plug->name()} + " request") : 0} {}
+
+	// the trace track of the request
+	[[nodiscard]] std::uint32_t
+	track() const noexcept {
+		return track_id;
+	}
+
+	// hands a batch of chunks to the session
+	void
+	process(std::string batch) {
+		if (!strand) {
+			consume(batch);
+			flush();
+			return;
+		}
+		strand->post([this, batch = std::move(batch)] {
+			consume(batch);
+			flush();
+		});
+	}
+
+	// whether the session is done with the batches processed so far
+	[[nodiscard]] bool
+	done() const noexcept {
+		return is_done.load(std::memory_order_acquire);
+	}
+
+	// waits until every batch has been processed, then rethrows the first error the
+	// session raised while consuming them. the session may then be used again.
+	[[nodiscard]] task<>
+	drain(executor& ex) {
+		if (strand)
+			co_await ex.handoff([this](std::function<void()> resume) {
+				strand->post(std::move(resume));
+			});
+		is_done.store(false, std::memory_order_relaxed); // for the next transfer
+		if (error)
+			std::rethrow_exception(std::exchange(error, nullptr));
+	}
+
+	// finalizes the session; the final reply may have been adjusted or discarded
+	void
+	finish() {
+		dirty = true;
+		flush();
+		plugcall(plug->name(), "finalize", [this] {
+			auto _ = trace.scope("session::onfinish", track_id);
+			sess->onfinish(events);
+		});
+		dirty = true;
+		flush(true);
+		verbose_log(verbose, "[metrics] ", deltas, " deltas (", bytes, " bytes) in ", batches,
+		            " batches; first delta after ",
+		            first_delta ? std::to_string(first_delta->count()) + "ms" : "-");
+	}
+
+   private:
+	plugin*                    plug;
+	plugin::session*           sess;
+	bool                       print;
+	bool                       verbose;
+	std::function<void()>      persist; // saves the context, if any
+	live_sink*                 live;    // publishes deltas, if any
+	pool::strand*              strand;
+	std::string*               reply; // collects the deltas, if any
+	std::uint32_t              track_id;
+	std::vector<plugin::event> events{};
+	bool                       dirty{false}; // chunks were consumed since the last flush
+	std::atomic<bool>          is_done{false};
+	std::exception_ptr         error{}; // raised by consume, rethrown by drain
+
+	std::chrono::steady_clock::time_point    start{std::chrono::steady_clock::now()};
+	std::optional<std::chrono::milliseconds> first_delta{};
+	std::size_t                              batches{0};
+	std::size_t                              deltas{0};
+	std::size_t                              bytes{0};
+	std::chrono::steady_clock::time_point    persisted{};
+
+	// integrates a chunk into the session. once it fails, the rest of the transfer is
+	// ignored and aborted.
+	void
+	consume(std::string_view chunk) {
+		if (error)
+			return;
+		dirty = true;
+		try {
+			is_done.store(plugcall(plug->name(), "process reply using", [this, chunk] {
+				auto _ = trace.scope("session::consume", track_id);
+				sess->consume(chunk, events);
+				return sess->done();
+			}),
+			              std::memory_order_release);
+		} catch (...) {
+			error = std::current_exception();
+			is_done.store(true, std::memory_order_release);
+		}
+	}
+
+	// runs the stages over the pending batch. final batches are always persisted.
+	void
+	flush(bool final = false) {
+		if (!dirty && events.empty())
+			return;
+
+		if (print) {
+			for (auto&& e : events)
+				if (e.type == plugin::event::kind::delta)
+					std::cout << e.text;
+			std::cout << std::flush;
+		}
+
+		if (reply)
+			for (auto&& e : events)
+				if (e.type == plugin::event::kind::delta)
+					*reply += e.text;
+
+		if (live && *live)
+			live->publish(events);
+
+		// the context may change without producing events. while a listener follows the
+		// live deltas, it is only written at coarse intervals.
+		auto now = std::chrono::steady_clock::now();
+		if (persist &&
+		    (final || !live || !*live || now - persisted >= live_sink::persist_interval)) {
+			persist();
+			persisted = now;
+			if (live && *live)
+				live->saved();
+		}
+
+		measure();
+		events.clear();
+		dirty = false;
+	}
+
+	void
+	measure() {
+		++batches;
+		for (auto&& e : events) {
+			switch (e.type) {
+				case plugin::event::kind::delta:
+					if (!first_delta)
+						first_delta = std::chrono::duration_cast<std::chrono::milliseconds>(
+						    std::chrono::steady_clock::now() - start);
+					++deltas;
+					bytes += e.text.size();
+					break;
+				case plugin::event::kind::finish:
+					verbose_log(verbose, "[metrics] reply ", e.choice, " finished: ", e.text);
+					break;
+				case plugin::event::kind::usage:
+					verbose_log(verbose, "[metrics] usage: ", e.usage.prompt, " prompt, ",
+					            e.usage.completion, " completion, ", e.usage.cached,
+					            " cached tokens");
+					break;
+			}
+		}
+	}
+};
+
+// traces the phases of a completed transfer that was sent at sent: name lookup, connect,
+// TLS handshake, sending the request, waiting for the first byte, and receiving the rest
+inline static void
+trace_phases(CURL* curl, tracer::clock::time_point sent, std::uint32_t track) noexcept {
+	static constexpr std::array<std::pair<char const*, CURLINFO>, 6> phases{{
+	    {"dns", CURLINFO_NAMELOOKUP_TIME_T},
+	    {"connect", CURLINFO_CONNECT_TIME_T},
+	    {"tls", CURLINFO_APPCONNECT_TIME_T},
+	    {"send", CURLINFO_PRETRANSFER_TIME_T},
+	    {"wait", CURLINFO_STARTTRANSFER_TIME_T},
+	    {"receive", CURLINFO_TOTAL_TIME_T},
+	}};
+
+	// each phase ends at a time measured from the start (0 if it did not happen)
+	auto       at    = [sent](curl_off_t us) { return sent + std::chrono::microseconds{us}; };
+	curl_off_t begin = 0, total = 0;
+	::curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+	trace.record("transfer", track, sent, at(total));
+	for (auto [name, info] : phases) {
+		curl_off_t end = 0;
+		if (::curl_easy_getinfo(curl, info, &end) != CURLE_OK || end < begin)
+			continue;
+		trace.record(name, track, at(begin), at(end));
+		begin = end;
+	}
+}
+
+// performs a single transfer, handing each batch of chunks to the pipeline.
+// the transfer is aborted if the session is done.
+[[nodiscard]] inline static task<transfer_timing>
+transfer(executor& ex, plugin* plug, plugin::session* sess, bool verbose,
+         fs::path const& spooldir, limiter& limiter, pipeline& pipe) {
+	CURL*              curl    = nullptr;
+	struct curl_slist* headers = NULL;
+	struct cleanup {
+		CURL*&              curl;
+		struct curl_slist*& headers;
+		~cleanup() {
+			if (curl)
+				::curl_easy_cleanup(curl);
+			::curl_slist_free_all(headers);
+		}
+	} cleanup{curl, headers};
+
+	using clock = std::chrono::steady_clock;
+	transfer_timing timing{std::chrono::system_clock::now(), {}, {}};
+	auto            start = clock::now();
+	std::optional<clock::time_point>        first_byte;
+	auto update = [&](std::string batch) {
+		if (!first_byte)
+			first_byte = clock::now();
+		pipe.process(std::move(batch));
+		return pipe.done();
+	};
+	auto elapsed = [&] {
+		auto end        = clock::now();
+		timing.ttfb     = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    first_byte.value_or(end) - start);
+		timing.duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+		return timing;
+	};
+
+	auto url = plugcall(plug->name(), "get url from", [sess] {
+		return sess->url();
+	});
+
+	std::string key{url};
+	plugcall(plug->name(), "append headers from", [sess, &headers, &key] {
+		sess->append_headers([&headers, &key](std::string_view h) {
+			headers = ::curl_slist_append(headers, h.data());
+			(key += '\n') += h;
+		});
+	});
+
+	auto post = plugcall(plug->name(), "get postdata from", [sess, &pipe] {
+		auto _ = trace.scope("session::post", pipe.track());
+		return sess->post();
+	});
+
+	// replay the stream of an identical in-flight request, if any. the key includes the
+	// headers (e.g. the API key), so only its digest is stored.
+	std::optional<singleflight> flight;
+	if (!spooldir.empty()) {
+		(key += "\n\n") += post.value_or("");
+		for (int attempt = 0; attempt < 8; ++attempt) {
+			flight.emplace(spooldir, key, verbose);
+			if (flight->role() != singleflight::role::follower)
+				break;
+
+			bool replayed = false;
+			std::function<bool(std::string_view)> replay = [&](std::string_view reply) {
+				replayed = true;
+				return update(std::string{reply});
+			};
+			auto following = clock::now();
+			if (co_await flight->follow(ex, replay) != singleflight::outcome::orphaned) {
+				co_await pipe.drain(ex);
+				trace.record("replay", pipe.track(), following, clock::now());
+				timing.shared = true;
+				co_return elapsed();
+			}
+			if (replayed) {
+				co_await pipe.drain(ex);
+				throw std::runtime_error{"the shared request was abandoned before it completed"};
+			}
+			verbose_log(verbose, "[dedup] leader exited; claiming the request");
+			flight.reset();
+		}
+	}
+
+	// wait for a slot in the adaptive concurrency window
+	auto          waiting = clock::now();
+	limiter::slot slot    = co_await limiter.acquire(ex);
+	trace.record("limiter", pipe.track(), waiting, clock::now());
+
+	curl = ::curl_easy_init();
+	if (!curl)
+		throw std::runtime_error{"could not initialize cURL"};
+
+	curl_easy_setopt(curl, post ? CURLOPT_POST : CURLOPT_HTTPGET, 1L);
+	curl_easy_setopt(curl, CURLOPT_URL, url.data());
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 2L);
+	response_headers response{curl, &limiter, clock::now()};
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, onheader);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response);
+	curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, onprogress);
+	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+	if (verbose) {
+		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+		if (post)
+			std::cerr << "\nloading postdata:\n" << post->data() << "\n\n";
+	}
+	if (post) {
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post->data());
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, post->size());
+	}
+
+	// send the request
+	auto sent = clock::now();
+	{
+		executor::stream stream{ex, curl};
+		// chunks that arrived together are processed together. once the session is
+		// done, the rest is only received for followers, which may stop elsewhere.
+		bool done = false;
+		while (auto batch = co_await stream.next()) {
+			if (flight)
+				flight->tee(*batch);
+			done = done || update(std::move(*batch));
+			if (done && !(flight && flight->followed()))
+				stream.cancel();
+		}
+		co_await pipe.drain(ex);
+
+		CURLcode _ = stream.result();
+		if (_ == CURLE_WRITE_ERROR && plugcall(plug->name(), "get status from", [sess] {
+			    return sess->done();
+		    }))
+			verbose_log(verbose, "[request] transfer stopped by plugin");
+		else if (_ == CURLE_ABORTED_BY_CALLBACK && interrupted)
+			verbose_log(verbose, "[request] transfer interrupted by signal ", interrupted);
+		else if (_ != CURLE_OK)
+			throw std::runtime_error{std::string{"cURL error: "} + ::curl_easy_strerror(_)};
+		else if (flight)
+			flight->complete(); // followers see incomplete streams as failures
+	}
+
+	if (trace.enabled())
+		trace_phases(curl, sent, pipe.track());
+
+	co_return elapsed();
+}
+
+// the tasks started by join_all
+struct join_state {
+	std::size_t           left;
+	std::function<void()> resume{};
+	std::exception_ptr    error{};
+};
+
+[[nodiscard]] inline static task<>
+joined(task<> t, join_state& j) {
+	try {
+		co_await t;
+	} catch (...) {
+		if (!j.error)
+			j.error = std::current_exception();
+	}
+	if (!--j.left)
+		j.resume();
+}
+
+// runs the tasks make(0) to make(n - 1) concurrently, and returns once every one has
+// returned. rethrows the first error.
+template <class Make>
+[[nodiscard]] inline static task<>
+join_all(executor& ex, std::size_t n, Make make) {
+	if (!n)
+		co_return;
+	join_state j{n};
+	co_await ex.handoff([&](std::function<void()> resume) {
+		j.resume = std::move(resume);
+		for (std::size_t i = 0; i < n; ++i)
+			ex.spawn(joined(make(i), j));
+	});
+	if (j.error)
+		std::rethrow_exception(j.error);
+}
+
+// performs the request, repeating it while the plugin asks to retry.
+// each transfer is recorded in the ledger, and a response the plugin has cached is
+// consumed in place of one. the requests a plugin prepares with are made
+// first, and a request the plugin splits is made as its parts; either are made
+// concurrently, and are not printed.
+[[nodiscard]] inline static task<>
+request(executor& ex, plugin* plug, plugin::session* sess, bool verbose, ledger const& ledger,
+        budgets const& budgets, fs::path const& spooldir, limiter& limiter, pipeline& pipe) {
+	auto _           = trace.scope("request", pipe.track());
+	auto request_all = [&](std::vector<std::unique_ptr<plugin::session>>& sessions) -> task<> {
+		std::deque<pipeline> pipes;
+		for (auto&& s : sessions)
+			pipes.emplace_back(plug, s.get(), false, verbose);
+		co_await join_all(ex, sessions.size(), [&](std::size_t i) {
+			return request(ex, plug, sessions[i].get(), verbose, ledger, budgets, spooldir,
+			               limiter, pipes[i]);
+		});
+	};
+	auto stopped = [&] {
+		if (!interrupted)
+			return false;
+		plugcall(plug->name(), "interrupt", [sess] {
+			sess->interrupt();
+		});
+		pipe.finish();
+		return true;
+	};
+
+	auto deps = plugcall(plug->name(), "prepare the request using", [sess] {
+		return sess->prepare();
+	});
+	if (!deps.empty()) {
+		verbose_log(verbose, "[request] prepared by ", deps.size(), " requests");
+		co_await request_all(deps);
+		if (stopped())
+			co_return;
+	}
+
+	std::vector<std::unique_ptr<plugin::session>> parts;
+	if (plugcall(plug->name(), "split the request using", [sess, &parts] {
+		    return sess->split(parts);
+	    })) {
+		verbose_log(verbose, "[request] split into ", parts.size(), " requests");
+		co_await request_all(parts);
+		if (!stopped())
+			pipe.finish();
+		co_return;
+	}
+
+	for (;;) {
+		// a response the plugin has cached is consumed in place of the transfer
+		std::string response;
+		auto        cached = plugcall(plug->name(), "look up the cache of", [sess, &response] {
+			return sess->cached(response);
+		});
+		if (cached && *cached) {
+			verbose_log(verbose, "[request] cache hit; replaying ", response.size(), " bytes");
+			transfer_timing timing{std::chrono::system_clock::now(), {}, {}};
+			auto            start = std::chrono::steady_clock::now();
+			pipe.process(std::move(response));
+			co_await pipe.drain(ex);
+			trace.record("replay", pipe.track(), start, std::chrono::steady_clock::now());
+			timing.duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+			    std::chrono::steady_clock::now() - start);
+			auto spent = plugcall(plug->name(), "get tokens from", [sess] {
+				return sess->spent();
+			});
+			// nothing was spent
+			ledger.append({.model = spent ? spent->model : std::string{}}, timing,
+			              ledger_record::hit);
+		} else {
+			if (cached)
+				verbose_log(verbose, "[request] cache miss");
+			// released if the request fails before it is reconciled
+			budgets::hold reserved;
+			if (!budgets.empty()) {
+				if (auto t = plugcall(plug->name(), "estimate tokens using", [sess] {
+					    return sess->estimate();
+				    }))
+					reserved = budgets.reserve({t->prompt + t->completion, ledger.cost(*t)});
+			}
+
+			auto timing = co_await transfer(ex, plug, sess, verbose, spooldir, limiter, pipe);
+			auto spent  = plugcall(plug->name(), "get tokens from", [sess] {
+				return sess->spent();
+			});
+			if (spent && !timing.shared)
+				ledger.append(*spent, timing, cached ? ledger_record::miss : 0);
+			if (!budgets.empty()) {
+				budgets::reservation actual{};
+				if (spent && !timing.shared)
+					actual = {spent->prompt + spent->completion, ledger.cost(*spent)};
+				reserved.reconcile(actual);
+			}
+		}
+		plugcall(plug->name(), "finalize the reply using", [sess] {
+			sess->onend();
+		});
+		if (interrupted) {
+			plugcall(plug->name(), "interrupt", [sess] {
+				sess->interrupt();
+			});
+			break;
+		}
+		if (!plugcall(plug->name(), "check reply using", [sess] {
+			    return sess->retry();
+		    }))
+			break;
+		verbose_log(verbose, "[request] retrying");
+	}
+
+	pipe.finish();
+}
+
+// runs the task made by make on an executor. cURL is initialized around it, and SIGTERM
+// and SIGINT stop it gracefully.
+template <class Make>
+	requires std::is_invocable_r_v<task<>, Make, executor&>
+inline static void
+run_executor(Make&& make) noexcept {
+	auto init = ::curl_global_init(CURL_GLOBAL_DEFAULT);
+	if (init != CURLE_OK)
+		die("cURL error: ", ::curl_easy_strerror(init));
+
+	// finalize the context if terminated (e.g. by kill)
+	struct sigaction sa {};
+	sa.sa_handler = oninterrupt;
+	::sigemptyset(&sa.sa_mask);
+	::sigaction(SIGTERM, &sa, nullptr);
+	::sigaction(SIGINT, &sa, nullptr);
+
+	try {
+		executor ex;
+		ex.cancel_on(&interrupted);
+		interruptible = &ex;
+		struct unregister {
+			~unregister() { interruptible = nullptr; }
+		} unregister;
+		ex.spawn(make(ex));
+		ex.run();
+	} catch (std::exception const& e) {
+		die("request failed: ", e.what());
+	}
+
+	::curl_global_cleanup();
+}
+
+// runs the request of a session on an executor. persist saves the context, if any, and
+// live publishes its deltas.
+inline static void
+run_request(llmq_args_result const& a, plugin::session* sess, bool print,
+            std::function<void()> persist = {}, live_sink* live = nullptr) noexcept {
+	auto     ledger   = prepare_ledger(a);
+	auto     budgets  = prepare_budgets(a);
+	auto     spooldir = prepare_spooldir(a);
+	auto     limiter  = prepare_limiter(a);
+	pipeline pipe{a.plugin, sess, print, a.verbose, std::move(persist), live};
+
+	run_executor([&](executor& ex) {
+		return request(ex, a.plugin, sess, a.verbose, ledger, budgets, spooldir, limiter,
+		               pipe);
+	});
+}
+
+// true if any event read from the inotify fd concerns name. reads until drained.
+[[nodiscard]] inline static bool
+read_inotify(int fd, std::string_view name) noexcept {
+	alignas(::inotify_event) std::array<char, 4096> buf;
+
+	bool found = false;
+	for (::ssize_t n; (n = ::read(fd, buf.data(), buf.size())) > 0;) {
+		for (char* p = buf.data(); p < buf.data() + n;) {
+			auto* e = reinterpret_cast<::inotify_event*>(p);
+			if (e->len && name == e->name)
+				found = true;
+			p += sizeof(::inotify_event) + e->len;
+		}
+	}
+	return found;
+}
+
+// chats whenever an external edit leaves the context awaiting a reply. edits are found
+// by a tail diff against the last content seen (or written), so saves without changes
+// and our own writes are never parsed. one executor runs every turn, so connections are
+// reused. returns once interrupted.
+[[nodiscard]] inline static task<>
+watch_context(executor& ex, llmq_args_result const& a, fs::path const& ctxfile,
+              std::string const& auth, ledger const& ledger, budgets const& budgets,
+              fs::path const& spooldir, limiter& limiter) {
+	// editors often save by renaming over the file, so watch its directory
+	int in = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (in < 0 || ::inotify_add_watch(in, ctxfile.parent_path().c_str(),
+	                                  IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+		die("could not watch ", ctxfile, ": ", std::strerror(errno));
+
+	// hold the context open so kill can find this process
+	std::string seen = read_context(ctxfile);
+	int         held = ::open(ctxfile.c_str(), O_RDONLY | O_CLOEXEC);
+	verbose_log(a.verbose, "[watch] watching ", ctxfile);
+
+	std::string const name = ctxfile.filename();
+	while (!interrupted) {
+		co_await ex.readable(in);
+		if (!read_inotify(in, name) || interrupted)
+			continue;
+
+		std::string cur = read_context(ctxfile);
+		auto        end = std::ranges::mismatch(seen, cur).in2;
+		if (end == cur.end() && cur.size() == seen.size())
+			continue;
+		verbose_log(a.verbose, "[watch] context changed from byte ", end - cur.begin());
+		seen = std::move(cur);
+		::close(held);
+		held = ::open(ctxfile.c_str(), O_RDONLY | O_CLOEXEC);
+
+		// the context may be mid-edit; wait for the next save
+		ryml::Tree tree;
+		try {
+			tree = ryml::parse_in_arena(ryml::csubstr{seen.data(), seen.size()});
+		} catch (std::exception const& e) {
+			warn("could not parse YAML context: ", e.what());
+			continue;
+		}
+
+		auto sess = plugop(a.plugin->name(), "initialize", [&a, &tree, &auth] {
+			auto _ = trace.scope("plugin::init");
+			return a.plugin->init(std::move(tree), {}, auth);
+		});
+		if (!plugop(a.plugin->name(), "check context using", [&sess] {
+			    return sess->awaiting();
+		    }))
+			continue;
+		verbose_log(a.verbose, "[watch] requesting a reply");
+
+		// editors may start listening between turns
+		live_sink      live{compute_livefile(ctxfile), a.verbose};
+		context_writer writer{ctxfile, std::move(seen)};
+		auto           persist = [&a, &sess, &writer] {
+			writer.overwrite(plugop(a.plugin->name(), "get context from", [&sess] {
+				return sess->context();
+			}));
+		};
+		pipeline pipe{a.plugin, sess.get(), !a.quiet, a.verbose, persist, &live};
+		co_await request(ex, a.plugin, sess.get(), a.verbose, ledger, budgets, spooldir,
+		                 limiter, pipe);
+		seen = writer.content();
+	}
+
+	::close(held);
+	::close(in);
+}
+
+// runs watch_context until interrupted
+inline static void
+run_watch(llmq_args_result const& a) noexcept {
+	fs::path    ctxfile  = prepare_ctxfile(a);
+	std::string auth     = read_auth(prepare_authfile(a));
+	auto        ledger   = prepare_ledger(a);
+	auto        budgets  = prepare_budgets(a);
+	auto        spooldir = prepare_spooldir(a);
+	auto        limiter  = prepare_limiter(a);
+
+	run_executor([&](executor& ex) {
+		return watch_context(ex, a, ctxfile, auth, ledger, budgets, spooldir, limiter);
+	});
+}
+
+// runs the shell command cmd with input on stdin and returns its output, or nullopt if it
+// could not be run or failed. safe to call from any thread.
+[[nodiscard]] inline static std::optional<std::string>
+run_command(std::string const& cmd, std::string_view input) noexcept {
+	int in[2];
+	int out[2];
+	if (::pipe2(in, O_CLOEXEC) < 0)
+		return std::nullopt;
+	if (::pipe2(out, O_CLOEXEC) < 0)
+		return ::close(in[0]), ::close(in[1]), std::nullopt;
+
+	// the command must not inherit the signal mask of a pool worker
+	::posix_spawn_file_actions_t actions;
+	::posix_spawnattr_t          attr;
+	::sigset_t                   none;
+	::sigemptyset(&none);
+	::posix_spawn_file_actions_init(&actions);
+	::posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+	::posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+	::posix_spawnattr_init(&attr);
+	::posix_spawnattr_setsigmask(&attr, &none);
+	::posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+	char const* argv[] = {"sh", "-c", cmd.c_str(), nullptr};
+	::pid_t     pid;
+	int err = ::posix_spawn(&pid, "/bin/sh", &actions, &attr, const_cast<char**>(argv), environ);
+	::posix_spawn_file_actions_destroy(&actions);
+	::posix_spawnattr_destroy(&attr);
+	::close(in[0]);
+	::close(out[1]);
+	if (err) {
+		::close(in[1]);
+		::close(out[0]);
+		return std::nullopt;
+	}
+
+	// commands that ignore their input may close it early
+	for (::ssize_t n; !input.empty() && (n = ::write(in[1], input.data(), input.size())) > 0;)
+		input.remove_prefix(n);
+	::close(in[1]);
+
+	std::string            res;
+	std::array<char, 4096> buf;
+	for (::ssize_t n; (n = ::read(out[0], buf.data(), buf.size())) > 0;)
+		res.append(buf.data(), n);
+	::close(out[0]);
+
+	int status;
+	if (::waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+		return std::nullopt;
+	return res;
+}
+
+// the first number in s, if any
+[[nodiscard]] inline static std::optional<double>
+first_number(std::string_view s) noexcept {
+	for (std::size_t i = 0; i < s.size(); ++i) {
+		if (!std::isdigit((unsigned char)s[i]))
+			continue;
+		std::size_t begin = i && s[i - 1] == '-' ? i - 1 : i;
+		double      v;
+		if (std::from_chars(s.data() + begin, s.data() + s.size(), v).ec == std::errc{})
+			return v;
+	}
+	return std::nullopt;
+}
+
+// asks for a rating of the last reply unless $LLMQ_SCORER_PROMPT is set
+inline static constexpr std::string_view default_scorer_prompt =
+    "Rate the correctness and quality of your last reply from 0 to 10. "
+    "Answer with the number only.";
+
+// the state shared by the tasks of a tree search
+struct tree_search {
+	llmq_args_result const&  a;
+	std::string const&       auth;
+	std::vector<plugin::arg> options;       // the OPTIONS of every expansion
+	std::string              scorer;        // a shell command, if any
+	std::string              scorer_prompt; // used without a command
+	llmq::ledger const&      ledger;
+	llmq::budgets const&     budgets;
+	fs::path const&          spooldir;
+	llmq::limiter&           limiter;
+	llmq::pool&              workers;
+};
+
+// a scored choice
+struct tree_node {
+	ryml::Tree context;
+	double     score;
+};
+
+// scores a choice by the first number printed by the scorer command (given the context
+// on stdin) or replied to the scorer prompt. choices without a score rank last.
+[[nodiscard]] inline static task<>
+score_choice(executor& ex, tree_search& s, ryml::Tree const& choice, double& score) {
+	std::string out;
+	if (!s.scorer.empty()) {
+		std::string                yaml = ryml::emitrs_yaml<std::string>(choice);
+		std::optional<std::string> res;
+		co_await ex.handoff([&](std::function<void()> resume) {
+			s.workers.submit([&, resume = std::move(resume)] {
+				res = run_command(s.scorer, yaml);
+				resume();
+			});
+		});
+		if (!res)
+			warn("the scorer command failed");
+		else
+			out = std::move(*res);
+	} else {
+		std::vector<plugin::arg> args{{0, s.scorer_prompt}};
+		auto sess = plugop(s.a.plugin->name(), "initialize", [&s, &choice, &args] {
+			return s.a.plugin->init(ryml::Tree{choice}, args, s.auth);
+		});
+		pool::strand strand{s.workers};
+		pipeline     pipe{s.a.plugin, sess.get(), false, s.a.verbose, {}, nullptr, &strand, &out};
+		try {
+			co_await request(ex, s.a.plugin, sess.get(), s.a.verbose, s.ledger, s.budgets,
+			                 s.spooldir, s.limiter, pipe);
+		} catch (std::exception const& e) {
+			warn("the scorer request failed: ", e.what());
+			out.clear();
+		}
+	}
+
+	score = first_number(out).value_or(-std::numeric_limits<double>::infinity());
+	verbose_log(s.a.verbose, "[tree] scored ", score, ": ", trim(out));
+}
+
+// expands a node with prompt, then scores each of its choices into children. a failed
+// expansion adds no children, and a failed score ranks its choice last.
+[[nodiscard]] inline static task<>
+expand_node(executor& ex, tree_search& s, ryml::Tree const& node, std::string const& prompt,
+            std::vector<tree_node>& children) {
+	std::vector<plugin::arg> args = s.options;
+	args.push_back({0, prompt});
+	auto sess = plugop(s.a.plugin->name(), "initialize", [&s, &node, &args] {
+		return s.a.plugin->init(ryml::Tree{node}, args, s.auth);
+	});
+	pool::strand strand{s.workers};
+	pipeline     pipe{s.a.plugin, sess.get(), false, s.a.verbose, {}, nullptr, &strand};
+	try {
+		co_await request(ex, s.a.plugin, sess.get(), s.a.verbose, s.ledger, s.budgets,
+		                 s.spooldir, s.limiter, pipe);
+	} catch (std::exception const& e) {
+		// the other branches of the level go on without it
+		warn("an expansion failed: ", e.what());
+		co_return;
+	}
+	if (interrupted)
+		co_return;
+
+	auto choices = plugop(s.a.plugin->name(), "branch the context using", [&sess] {
+		return sess->choices();
+	});
+	std::vector<double> scores(choices.size());
+	co_await join_all(ex, choices.size(), [&](std::size_t i) {
+		return score_choice(ex, s, choices[i], scores[i]);
+	});
+	for (std::size_t i = 0; i < choices.size(); ++i)
+		children.push_back({std::move(choices[i]), scores[i]});
+}
+
+// a beam search over the replies to prompts: each level expands every node of the
+// frontier with its prompt, concurrently, and keeps the beam best-scored choices. only
+// the frontier is kept. depth counts the levels completed before any interruption.
+[[nodiscard]] inline static task<>
+search_tree(executor& ex, tree_search& s, std::vector<std::string> const& prompts,
+            std::size_t beam, std::vector<tree_node>& frontier, std::size_t& depth) {
+	for (auto const& prompt : prompts) {
+		std::vector<tree_node> children;
+		co_await join_all(ex, frontier.size(), [&](std::size_t i) {
+			return expand_node(ex, s, frontier[i].context, prompt, children);
+		});
+		if (interrupted || children.empty())
+			break;
+
+		std::ranges::stable_sort(children, std::greater{}, &tree_node::score);
+		if (children.size() > beam)
+			children.erase(children.begin() + beam, children.end());
+		verbose_log(s.a.verbose, "[tree] depth ", depth + 1, ": kept ", children.size(),
+		            " choices; best score ", children.front().score);
+		frontier = std::move(children);
+		++depth;
+	}
+}
+
+// searches for the best path from CONTEXT with one level per MSG, and saves it to CONTEXT
+inline static void
+run_tree(int argc, char** argv, llmq_args_result& a) noexcept {
+	std::size_t beam = 3;
+	if (char const* env = std::getenv("LLMQ_BEAM")) {
+		auto [ptr, ec] = std::from_chars(env, env + std::strlen(env), beam);
+		if (ec != std::errc{} || *ptr || !beam)
+			die("$LLMQ_BEAM must be a positive integer");
+	}
+
+	fs::path    ctxfile = prepare_ctxfile(a);
+	std::string oldctx  = read_context(ctxfile);
+
+	// MSGS are the prompts of each level; OPTIONS apply to every expansion
+	std::vector<plugin::arg> options;
+	std::vector<std::string> prompts;
+	for (auto&& arg : parse_plugin_args(argc, argv, a.ofs, a.plugin, a.no_stdin)) {
+		if (arg.name)
+			options.push_back(std::move(arg));
+		else
+			prompts.push_back(std::move(arg.value));
+	}
+	if (prompts.empty())
+		die("tree requires MSGS");
+
+	std::string auth     = read_auth(prepare_authfile(a));
+	auto        ledger   = prepare_ledger(a);
+	auto        budgets  = prepare_budgets(a);
+	auto        spooldir = prepare_spooldir(a);
+	auto        limiter  = prepare_limiter(a);
+	llmq::pool  workers;
+
+	char const* scorer        = std::getenv("LLMQ_SCORER");
+	char const* scorer_prompt = std::getenv("LLMQ_SCORER_PROMPT");
+	tree_search s{a,
+	              auth,
+	              std::move(options),
+	              scorer ? scorer : "",
+	              std::string{scorer_prompt ? scorer_prompt : default_scorer_prompt},
+	              ledger,
+	              budgets,
+	              spooldir,
+	              limiter,
+	              workers};
+
+	std::vector<tree_node> frontier;
+	frontier.push_back({parse_context(oldctx), 0});
+	context_writer writer{ctxfile, std::move(oldctx)};
+
+	std::size_t depth = 0;
+	run_executor([&](executor& ex) {
+		return search_tree(ex, s, prompts, beam, frontier, depth);
+	});
+	if (depth)
+		writer.overwrite(frontier.front().context);
+}
+
+// a positive integer from the environment, or def if unset
+[[nodiscard]] inline static std::size_t
+env_count(char const* name, std::size_t def) noexcept {
+	char const* env = std::getenv(name);
+	if (!env)
+		return def;
+	std::size_t n;
+	auto [ptr, ec] = std::from_chars(env, env + std::strlen(env), n);
+	if (ec != std::errc{} || *ptr || !n)
+		die("$", name, " must be a positive integer");
+	return n;
+}
+
+// embeds each text with the plugin, which must print one JSON array of numbers per line
+// of input. returns the vectors, dims floats each, or none if interrupted.
+[[nodiscard]] inline static std::vector<float>
+embed_texts(llmq_args_result const& a, ryml::Tree const& ctx, std::vector<plugin::arg> args,
+            std::span<std::string_view const> texts, std::size_t& dims) noexcept {
+	std::string input;
+	for (auto t : texts)
+		(input += t) += '\n';
+	args.push_back({0, std::move(input)});
+
+	std::string auth = read_auth(prepare_authfile(a));
+	auto        sess = plugop(a.plugin->name(), "initialize", [&a, &ctx, &args, &auth] {
+		auto _ = trace.scope("plugin::init");
+		return a.plugin->init(ryml::Tree{ctx}, args, auth);
+	});
+	auto        ledger   = prepare_ledger(a);
+	auto        budgets  = prepare_budgets(a);
+	auto        spooldir = prepare_spooldir(a);
+	auto        limiter  = prepare_limiter(a);
+	std::string out;
+	pipeline    pipe{a.plugin, sess.get(), false, a.verbose, {}, nullptr, nullptr, &out};
+	run_executor([&](executor& ex) {
+		return request(ex, a.plugin, sess.get(), a.verbose, ledger, budgets, spooldir, limiter,
+		               pipe);
+	});
+	if (interrupted)
+		return {};
+
+	// removes and returns s up to the next sep (or all of it)
+	auto next = [](std::string_view& s, char sep) {
+		auto tok = s.substr(0, s.find(sep));
+		s.remove_prefix(std::min(s.size(), tok.size() + 1));
+		return tok;
+	};
+
+	std::vector<float> vectors;
+	std::size_t        lines = 0;
+	for (std::string_view rest = out; !rest.empty(); ++lines) {
+		auto line = trim(next(rest, '\n'));
+		if (line.size() < 2 || line.front() != '[' || line.back() != ']')
+			die("plugin \"", a.plugin->name(), "\" did not print an embedding: ", line);
+
+		std::size_t n = 0;
+		for (auto v = line.substr(1, line.size() - 2); !trim(v).empty(); ++n) {
+			auto  x = trim(next(v, ','));
+			float f;
+			if (std::from_chars(x.data(), x.data() + x.size(), f).ec != std::errc{})
+				die("plugin \"", a.plugin->name(), "\" printed an invalid number: ", x);
+			vectors.push_back(f);
+		}
+		if (!lines)
+			dims = n;
+		if (!n || n != dims)
+			die("plugin \"", a.plugin->name(), "\" printed embeddings of different dimensions");
+	}
+	if (lines != texts.size())
+		die("plugin \"", a.plugin->name(), "\" printed ", lines, " embeddings for ",
+		    texts.size(), " texts");
+	return vectors;
+}
+
+// adds each line of stdin to the vector index of CONTEXT (CONTEXT.vec and CONTEXT.txt),
+// or prints the $LLMQ_TOPK items nearest to each MSG. the texts are embedded by the
+// plugin, with OPTIONS and the context (if any).
+inline static void
+run_nearest(int argc, char** argv, llmq_args_result const& a) noexcept {
+	std::size_t k       = env_count("LLMQ_TOPK", 10);
+	std::size_t nprobe  = env_count("LLMQ_NPROBE", 32);
+	std::size_t threads = env_count("LLMQ_THREADS", 1);
+
+	fs::path   ctxfile = compute_ctxfile(a);
+	fs::path   base    = fs::path{ctxfile}.replace_extension();
+	ryml::Tree ctx = fs::exists(ctxfile) ? parse_context(read_context(ctxfile)) : ryml::Tree{};
+
+	// MSGS are queries; without them, stdin is added
+	std::vector<plugin::arg> options;
+	std::vector<std::string> queries;
+	for (auto&& arg : parse_plugin_args(argc, argv, a.ofs, a.plugin, true)) {
+		if (arg.name)
+			options.push_back(std::move(arg));
+		else
+			queries.push_back(std::move(arg.value));
+	}
+
+	std::size_t dims = 0;
+	if (queries.empty()) {
+		if (a.no_stdin)
+			die("nearest requires MSGS or stdin");
+		std::ostringstream oss;
+		oss << std::cin.rdbuf();
+		std::string                   in = oss.str();
+		std::vector<std::string_view> items;
+		for (std::string_view rest = in; !rest.empty();) {
+			auto line = rest.substr(0, rest.find('\n'));
+			rest.remove_prefix(std::min(rest.size(), line.size() + 1));
+			if (line.ends_with('\r'))
+				line.remove_suffix(1);
+			if (!trim(line).empty())
+				items.push_back(line);
+		}
+		if (items.empty())
+			return;
+
+		auto vectors = embed_texts(a, ctx, std::move(options), items, dims);
+		if (interrupted)
+			return;
+		try {
+			mkdir_p(base.parent_path());
+			std::size_t added = vector_index::append(base, items, vectors, dims);
+			verbose_log(a.verbose, "[index] added ", added, " of ", items.size(), " items");
+
+			vector_index index{base};
+			llmq::pool   workers{(unsigned)threads};
+			if (index.cluster(workers))
+				verbose_log(a.verbose, "[index] clustered ", index.size(), " vectors into ",
+				            index.clusters(), " lists");
+		} catch (std::exception const& e) {
+			die("could not update the vector index: ", e.what());
+		}
+		return;
+	}
+
+	try {
+		vector_index index{base};
+		if (!index.size())
+			die("the vector index ", base, " is empty");
+
+		std::vector<std::string_view> texts;
+		for (auto&& q : queries) {
+			std::ranges::replace(q, '\n', ' ');
+			texts.push_back(q);
+		}
+		auto vectors = embed_texts(a, ctx, std::move(options), texts, dims);
+		if (interrupted)
+			return;
+
+		std::optional<llmq::pool> workers;
+		if (threads > 1)
+			workers.emplace(threads);
+		std::cout << std::fixed << std::setprecision(4);
+		for (std::size_t i = 0; i < texts.size(); ++i) {
+			auto hits = index.search({&vectors[i * dims], dims}, k, nprobe,
+			                         workers ? &*workers : nullptr);
+			if (i)
+				std::cout << '\n';
+			for (auto h : hits)
+				std::cout << h.score << '\t' << index.text(h.id) << '\n';
+		}
+	} catch (std::exception const& e) {
+		die("could not search the vector index: ", e.what());
+	}
+}
+
+// a client connection of the gateway. reads and writes suspend on the executor.
+struct connection {
+	connection(executor& ex, int fd) noexcept : ex{ex}, fd{fd} {}
+	connection(connection const&)            = delete;
+	connection& operator=(connection const&) = delete;
+	~connection() {
+		::close(fd);
+	}
+
+	executor&   ex;
+	int         fd;
+	std::string in{}; // received, but not yet consumed
+
+	// receives more into in. false once the client is gone (or interrupted).
+	[[nodiscard]] task<bool>
+	fill() {
+		std::array<char, 16384> buf;
+		for (;;) {
+			::ssize_t n = ::recv(fd, buf.data(), buf.size(), 0);
+			if (n > 0) {
+				in.append(buf.data(), n);
+				co_return true;
+			}
+			if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ||
+			    interrupted)
+				co_return false;
+			co_await ex.readable(fd);
+		}
+	}
+
+	// sends all of data. false once the client is gone (or interrupted).
+	[[nodiscard]] task<bool>
+	send(std::string_view data) {
+		while (!data.empty()) {
+			::ssize_t n = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+			if (n >= 0) {
+				data.remove_prefix(n);
+				continue;
+			}
+			if ((errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) || interrupted)
+				co_return false;
+			co_await ex.writable(fd);
+		}
+		co_return true;
+	}
+};
+
+struct http_request {
+	std::string                                  method;
+	std::string                                  target; // without the query
+	std::unordered_map<std::string, std::string> headers; // names are lowercase
+	std::string                                  body;
+	bool                                         keep_alive;
+};
+
+// a request the gateway answers with status
+struct http_error : std::runtime_error {
+	http_error(long status, std::string const& what) : std::runtime_error{what}, status{status} {}
+	long status;
+};
+
+[[nodiscard]] inline static std::string
+lowercase(std::string_view s) noexcept {
+	std::string res{s};
+	std::ranges::transform(res, res.begin(), [](unsigned char c) {
+		return std::tolower(c);
+	});
+	return res;
+}
+
+// reads the next request of a connection; nullopt once the client is gone.
+// throws http_error for requests that cannot be served.
+[[nodiscard]] inline static task<std::optional<http_request>>
+read_request(connection& c) {
+	constexpr std::size_t max_head = 64 << 10;
+	constexpr std::size_t max_body = 16 << 20;
+
+	std::size_t end;
+	while ((end = c.in.find("\r\n\r\n")) == c.in.npos) {
+		if (c.in.size() > max_head)
+			throw http_error{431, "request headers are too large"};
+		if (!co_await c.fill())
+			co_return std::nullopt;
+	}
+
+	// METHOD TARGET VERSION, then the headers
+	std::string_view head{c.in.data(), end};
+	auto             eol  = std::min(head.find("\r\n"), head.size());
+	std::string_view line = head.substr(0, eol);
+	head.remove_prefix(std::min(eol + 2, head.size()));
+	auto sp1 = line.find(' ');
+	auto sp2 = line.rfind(' ');
+	if (sp1 == line.npos || sp1 == sp2)
+		throw http_error{400, "malformed request line"};
+
+	http_request req{};
+	req.method     = line.substr(0, sp1);
+	req.target     = line.substr(sp1 + 1, sp2 - sp1 - 1);
+	req.target     = req.target.substr(0, req.target.find('?'));
+	req.keep_alive = line.substr(sp2 + 1) == "HTTP/1.1";
+	while (!head.empty()) {
+		eol = std::min(head.find("\r\n"), head.size());
+		auto h = head.substr(0, eol);
+		head.remove_prefix(std::min(eol + 2, head.size()));
+		auto colon = h.find(':');
+		if (colon == h.npos)
+			throw http_error{400, "malformed header"};
+		req.headers[lowercase(h.substr(0, colon))] = trim(h.substr(colon + 1));
+	}
+	c.in.erase(0, end + 4);
+
+	if (auto it = req.headers.find("connection"); it != req.headers.end())
+		req.keep_alive = lowercase(it->second) == "keep-alive" ||
+		                 (req.keep_alive && lowercase(it->second) != "close");
+	if (req.headers.contains("transfer-encoding"))
+		throw http_error{411, "chunked requests are not supported; send Content-Length"};
+
+	std::size_t len = 0;
+	if (auto it = req.headers.find("content-length"); it != req.headers.end()) {
+		auto const& v     = it->second;
+		auto [ptr, ec] = std::from_chars(v.data(), v.data() + v.size(), len);
+		if (ec != std::errc{} || ptr != v.data() + v.size())
+			throw http_error{400, "invalid Content-Length"};
+	}
+	if (len > max_body)
+		throw http_error{413, "request body is too large"};
+
+	if (auto it = req.headers.find("expect");
+	    it != req.headers.end() && lowercase(it->second) == "100-continue" && c.in.size() < len)
+		if (!co_await c.send("HTTP/1.1 100 Continue\r\n\r\n"))
+			co_return std::nullopt;
+	while (c.in.size() < len)
+		if (!co_await c.fill())
+			co_return std::nullopt;
+	req.body = c.in.substr(0, len);
+	c.in.erase(0, len);
+	co_return req;
+}
+
+[[nodiscard]] inline static std::string_view
+http_reason(long status) noexcept {
+	switch (status) {
+		case 200: return "OK";
+		case 400: return "Bad Request";
+		case 404: return "Not Found";
+		case 405: return "Method Not Allowed";
+		case 411: return "Length Required";
+		case 413: return "Content Too Large";
+		case 429: return "Too Many Requests";
+		case 431: return "Request Header Fields Too Large";
+		case 500: return "Internal Server Error";
+		case 502: return "Bad Gateway";
+		case 503: return "Service Unavailable";
+		default: return status < 400 ? "OK" : "Error";
+	}
+}
+
+// the status line and headers of a response. without a length, the body is chunked.
+[[nodiscard]] inline static std::string
+http_head(long status, std::string_view type, bool keep_alive,
+          std::optional<std::size_t> length = {}, std::string_view cache = {}) noexcept {
+	std::string res = "HTTP/1.1 " + std::to_string(status) + ' ' + std::string{http_reason(status)};
+	((res += "\r\nContent-Type: ") += type) += "\r\n";
+	if (length)
+		res += "Content-Length: " + std::to_string(*length) + "\r\n";
+	else
+		res += "Transfer-Encoding: chunked\r\n";
+	if (!cache.empty())
+		((res += "X-Llmq-Cache: ") += cache) += "\r\n";
+	if (!keep_alive)
+		res += "Connection: close\r\n";
+	return res += "\r\n";
+}
+
+// a chunk of a chunked body
+[[nodiscard]] inline static std::string
+http_chunk(std::string_view data) noexcept {
+	std::ostringstream size;
+	size << std::hex << data.size();
+	return size.str() + "\r\n" + std::string{data} + "\r\n";
+}
+
+// an error response, in the format of the upstream API
+[[nodiscard]] inline static std::string
+http_error_response(long status, std::string_view message, bool keep_alive) noexcept {
+	std::string body = "{\"error\":{\"message\":";
+	append_json(body, message);
+	body += ",\"type\":\"llmq_gateway\"}}\n";
+	return http_head(status, "application/json", keep_alive, body.size()) + body;
+}
+
+// completed upstream responses, keyed by the upstream request. each is stored in DIR/HASH
+// as the key, content type, and body, and expires ttl after it was stored.
+struct response_cache {
+	// larger responses are not stored
+	static constexpr std::size_t max_entry = 8 << 20;
+
+	struct entry {
+		std::string type;
+		std::string body;
+	};
+
+	response_cache(fs::path dir, std::chrono::seconds ttl) noexcept
+	    : _dir{std::move(dir)},
+	      _ttl{ttl} {}
+
+	[[nodiscard]] bool
+	enabled() const noexcept {
+		return _ttl.count() > 0;
+	}
+
+	[[nodiscard]] std::optional<entry>
+	find(std::string const& key) const noexcept {
+		fs::path        f = _dir / hash_name(key);
+		std::error_code ec;
+		auto            stored = fs::last_write_time(f, ec);
+		if (ec)
+			return std::nullopt;
+		if (fs::file_time_type::clock::now() - stored > _ttl) {
+			fs::remove(f, ec);
+			return std::nullopt;
+		}
+
+		// KEYSIZE\nKEY TYPE\nBODY
+		std::ifstream in{f, std::ios::binary};
+		std::string   data{std::istreambuf_iterator<char>{in}, {}};
+		std::size_t   size = 0;
+		auto [ptr, err]    = std::from_chars(data.data(), data.data() + data.size(), size);
+		std::size_t ofs    = ptr - data.data() + 1;
+		if (err != std::errc{} || ofs + size > data.size() ||
+		    std::string_view{data}.substr(ofs, size) != key)
+			return std::nullopt; // another request with the same hash, or truncated
+		auto eol = data.find('\n', ofs + size);
+		if (eol == data.npos)
+			return std::nullopt;
+		return entry{data.substr(ofs + size, eol - ofs - size), data.substr(eol + 1)};
+	}
+
+	void
+	store(std::string const& key, std::string_view type, std::string_view body) noexcept {
+		if (body.size() > max_entry)
+			return;
+		fs::path f   = _dir / hash_name(key);
+		fs::path tmp = f;
+		tmp += '.' + std::to_string(::getpid()) + '.' + std::to_string(_seq++);
+		{
+			std::ofstream out{tmp, std::ios::binary};
+			out << key.size() << '\n' << key << type << '\n' << body;
+			if (!out) {
+				warn("could not write to the cache ", tmp);
+				std::error_code ec;
+				fs::remove(tmp, ec);
+				return;
+			}
+		}
+		std::error_code ec;
+		fs::rename(tmp, f, ec);
+		if (ec)
+			warn("could not store ", f, ": ", ec.message());
+	}
+
+   private:
+	fs::path             _dir;
+	std::chrono::seconds _ttl;
+	std::uint64_t        _seq{0};
+};
+
+// serves the endpoint of a plugin to other programs (see the serve action). requests
+// are forwarded with the plugin's url and headers (i.e. its authfile), so clients need
+// no key of their own.
+struct gateway {
+	// per request; 429 and 5xx responses and failed connections are retried
+	static constexpr int attempts = 4;
+
+	plugin*               plug;
+	std::string           auth;
+	std::string           upstream; // replaces the session url, if set
+	bool                  verbose;
+	llmq::ledger const&   ledger;
+	llmq::budgets const&  budgets;
+	llmq::limiter&        limiter;
+	llmq::response_cache& cache;
+};
+
+// forwards a request upstream and streams the response to the client as it arrives.
+// the body sent is the session's postdata (e.g. gpt asks for the usage of streamed
+// replies). failed attempts are retried (after any backoff) as long as nothing has been
+// sent. the reply is passed through the session only to account for its usage, which is
+// reserved against the budgets first. false if the connection must close.
+[[nodiscard]] inline static task<bool>
+forward(executor& ex, gateway& gw, connection& c, http_request const& req) {
+	using clock = std::chrono::steady_clock;
+
+	std::unique_ptr<plugin::session> sess;
+	std::string                      url;
+	std::vector<std::string>         headers;
+	std::string                      body;
+	std::optional<plugin::tokens>    estimate;
+	std::optional<std::string>       invalid;
+	try {
+		sess = gw.plug->init(ryml::parse_in_arena(ryml::csubstr{req.body.data(), req.body.size()}),
+		                     {}, gw.auth);
+		url  = gw.upstream.empty() ? std::string{sess->url()} : gw.upstream;
+		sess->append_headers([&headers](std::string_view h) {
+			headers.emplace_back(h);
+		});
+		auto post = sess->post();
+		body      = post ? std::string{*post} : req.body;
+		if (!gw.budgets.empty())
+			estimate = sess->estimate();
+	} catch (std::exception const& e) {
+		invalid = e.what();
+	}
+	if (invalid)
+		co_return co_await c.send(http_error_response(400, *invalid, req.keep_alive)) &&
+		    req.keep_alive;
+
+	// identical requests are answered from the cache, unless the client opts out
+	std::string key        = url + "\n\n" + req.body;
+	std::string directives = lowercase(
+	    req.headers.contains("cache-control") ? req.headers.at("cache-control") : "");
+	bool lookup = gw.cache.enabled() && directives.find("no-cache") == directives.npos &&
+	              directives.find("no-store") == directives.npos;
+	bool store = gw.cache.enabled() && directives.find("no-store") == directives.npos;
+	if (lookup) {
+		if (auto hit = gw.cache.find(key)) {
+			verbose_log(gw.verbose, "[gateway] ", req.target, ": cache hit");
+			co_return co_await c.send(http_head(200, hit->type, req.keep_alive,
+			                                    hit->body.size(), "hit") +
+			                          hit->body) &&
+			    req.keep_alive;
+		}
+	}
+
+	// released unless the request succeeds
+	budgets::hold reserved;
+	if (estimate) {
+		std::string exceeded;
+		auto        h = gw.budgets.try_reserve(
+		    {estimate->prompt + estimate->completion, gw.ledger.cost(*estimate)}, exceeded);
+		if (!h) {
+			verbose_log(gw.verbose, "[gateway] ", req.target, ": ", exceeded);
+			co_return co_await c.send(http_error_response(429, exceeded, req.keep_alive)) &&
+			    req.keep_alive;
+		}
+		reserved = std::move(*h);
+	}
+
+	struct curl_slist* list = nullptr;
+	for (auto&& h : headers)
+		list = ::curl_slist_append(list, h.c_str());
+
+	transfer_timing                  timing{std::chrono::system_clock::now(), {}, {}};
+	auto                             start = clock::now();
+	std::optional<clock::time_point> first_byte;
+	std::vector<plugin::event>       events;
+	bool                             accounting = true; // until the session fails
+	std::string                      copy;             // for the cache
+	long                             status = 0;
+	std::string                      type{};
+	bool                             sent   = false; // the response head
+	bool                             gone   = false; // the client
+	CURLcode                         result = CURLE_OK;
+
+	for (int attempt = 1; attempt <= gateway::attempts && !interrupted; ++attempt) {
+		limiter::slot slot = co_await gw.limiter.acquire(ex);
+		CURL*         curl = ::curl_easy_init();
+		if (!curl)
+			throw std::runtime_error{"could not initialize cURL"};
+		curl_easy_setopt(curl, CURLOPT_POST, 1L);
+		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
+		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 2L);
+		curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+		curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L); // prefer a shared connection
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.data());
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)body.size());
+		response_headers response{curl, &gw.limiter, clock::now()};
+		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, onheader);
+		curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response);
+
+		bool retry = false;
+		{
+			executor::stream stream{ex, curl};
+			while (auto batch = co_await stream.next()) {
+				if (!first_byte)
+					first_byte = clock::now();
+				if (!sent) {
+					::curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+					if ((status == 429 || status >= 500) && attempt < gateway::attempts) {
+						retry = true;
+						stream.cancel();
+						break;
+					}
+					char* ct = nullptr;
+					::curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &ct);
+					type = ct ? ct : "application/json";
+					sent = true;
+					if (!co_await c.send(http_head(status, type, req.keep_alive, {}, "miss"))) {
+						gone = true;
+						stream.cancel();
+						break;
+					}
+				}
+				if (status == 200 && accounting) {
+					try {
+						sess->consume(*batch, events);
+					} catch (std::exception const&) {
+						accounting = false;
+					}
+					events.clear();
+				}
+				if (status == 200 && store && copy.size() <= response_cache::max_entry)
+					copy += *batch;
+				if (!co_await c.send(http_chunk(*batch))) {
+					gone = true;
+					stream.cancel();
+					break;
+				}
+			}
+			if (!retry && !gone) {
+				result = stream.result();
+				if (result != CURLE_OK && !sent && attempt < gateway::attempts &&
+				    !interrupted)
+					retry = true;
+			}
+		}
+		::curl_easy_cleanup(curl);
+
+		if (!retry)
+			break;
+		verbose_log(gw.verbose, "[gateway] ", req.target, ": retrying after ",
+		            result != CURLE_OK ? ::curl_easy_strerror(result)
+		                               : "status " + std::to_string(status));
+		first_byte.reset();
+	}
+	::curl_slist_free_all(list);
+
+	timing.ttfb = std::chrono::duration_cast<std::chrono::milliseconds>(
+	    first_byte.value_or(clock::now()) - start);
+	timing.duration =
+	    std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - start);
+	verbose_log(gw.verbose, "[gateway] ", req.target, ": status ", status, " in ",
+	            timing.duration.count(), "ms");
+
+	// account for what was spent, even if the client left early
+	if (status == 200 && accounting) {
+		try {
+			if (auto spent = sess->spent()) {
+				gw.ledger.append(*spent, timing);
+				reserved.reconcile({spent->prompt + spent->completion, gw.ledger.cost(*spent)});
+			}
+		} catch (std::exception const& e) {
+			warn("could not account for a gateway request: ", e.what());
+		}
+	}
+
+	if (gone || interrupted)
+		co_return false;
+	if (!sent) {
+		auto what = result != CURLE_OK ? ::curl_easy_strerror(result) : "empty response";
+		co_return co_await c.send(http_error_response(502, what, req.keep_alive)) &&
+		    req.keep_alive;
+	}
+	if (result != CURLE_OK)
+		co_return false; // the client sees the body end early
+	if (status == 200 && store && copy.size() <= response_cache::max_entry)
+		gw.cache.store(key, type, copy);
+	co_return co_await c.send("0\r\n\r\n") && req.keep_alive;
+}
+
+// serves requests on a connection until the client (or the gateway) is done
+[[nodiscard]] inline static task<>
+serve_client(executor& ex, gateway& gw, int fd) {
+	connection c{ex, fd};
+	try {
+		for (bool keep = true; keep && !interrupted;) {
+			std::optional<http_request> req;
+			std::optional<http_error>   bad;
+			try {
+				req = co_await read_request(c);
+			} catch (http_error const& e) {
+				bad = e;
+			}
+			if (bad) {
+				(void)co_await c.send(http_error_response(bad->status, bad->what(), false));
+				break;
+			}
+			if (!req)
+				break;
+
+			verbose_log(gw.verbose, "[gateway] ", req->method, ' ', req->target);
+			if (req->method != "POST")
+				keep = co_await c.send(http_error_response(405, "only POST is supported",
+				                                           req->keep_alive)) &&
+				       req->keep_alive;
+			else if (!req->target.ends_with("/chat/completions"))
+				keep = co_await c.send(http_error_response(
+				           404, "only /v1/chat/completions is served", req->keep_alive)) &&
+				       req->keep_alive;
+			else
+				keep = co_await forward(ex, gw, c, *req);
+		}
+	} catch (std::exception const& e) {
+		warn("gateway connection failed: ", e.what());
+	}
+}
+
+// accepts connections until interrupted
+[[nodiscard]] inline static task<>
+serve(executor& ex, gateway& gw, int listener) {
+	while (!interrupted) {
+		co_await ex.readable(listener);
+		for (int fd; (fd = ::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0;)
+			ex.spawn(serve_client(ex, gw, fd));
+	}
+}
+
+// true if sa is a loopback address (127.0.0.0/8 or ::1, also as an IPv4-mapped address)
+[[nodiscard]] inline static bool
+is_loopback(::sockaddr const* sa) noexcept {
+	if (sa->sa_family == AF_INET)
+		return (ntohl(((::sockaddr_in const*)sa)->sin_addr.s_addr) >> 24) == 127;
+	if (sa->sa_family != AF_INET6)
+		return false;
+	auto const& a = ((::sockaddr_in6 const*)sa)->sin6_addr;
+	return IN6_IS_ADDR_LOOPBACK(&a) || (IN6_IS_ADDR_V4MAPPED(&a) && a.s6_addr[12] == 127);
+}
+
+// opens a listening socket at unix:PATH or [HOST:]PORT (TCP; HOST defaults to 127.0.0.1,
+// and must be a loopback address)
+[[nodiscard]] inline static int
+listen_on(std::string_view addr) noexcept {
+	int fd;
+	if (addr.starts_with("unix:")) {
+		std::string   path{addr.substr(5)};
+		::sockaddr_un sa{};
+		sa.sun_family = AF_UNIX;
+		if (path.empty() || path.size() >= sizeof(sa.sun_path))
+			die("invalid socket path \"", path, "\"");
+		std::strcpy(sa.sun_path, path.c_str());
+
+		// replace the socket of an earlier gateway
+		struct stat st;
+		if (::stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+			::unlink(path.c_str());
+
+		fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0 || ::bind(fd, (::sockaddr*)&sa, sizeof(sa)) < 0)
+			die("could not bind ", path, ": ", std::strerror(errno));
+	} else {
+		auto        colon = addr.rfind(':');
+		std::string host  = colon == addr.npos ? "127.0.0.1" : std::string{addr.substr(0, colon)};
+		std::string port{colon == addr.npos ? addr : addr.substr(colon + 1)};
+
+		::addrinfo hints{};
+		hints.ai_family   = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags    = AI_PASSIVE;
+		::addrinfo* res;
+		if (int err = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &res))
+			die("could not resolve \"", addr, "\": ", ::gai_strerror(err));
+		// requests are sent with the authfile's key, so only local clients may connect
+		if (!is_loopback(res->ai_addr))
+			die("refusing to serve on \"", addr, "\", which is not a loopback address. ",
+			    "use unix:PATH, or forward a local port (e.g. with ssh -L)");
+		fd      = ::socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		int one = 1;
+		if (fd < 0 || ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+		    ::bind(fd, res->ai_addr, res->ai_addrlen) < 0)
+			die("could not bind \"", addr, "\": ", std::strerror(errno));
+		::freeaddrinfo(res);
+	}
+	if (::listen(fd, SOMAXCONN) < 0)
+		die("could not listen on \"", addr, "\": ", std::strerror(errno));
+	return fd;
+}
+
+// runs the gateway on MSGS (the address; 127.0.0.1:8080 by default) until interrupted
+inline static void
+run_serve(llmq_args_result const& a, int argc, char** argv) noexcept {
+	std::string_view addr = (int)a.ofs + 1 < argc ? argv[a.ofs + 1] : "127.0.0.1:8080";
+
+	long ttl = 3600;
+	if (char const* env = std::getenv("LLMQ_CACHE_TTL")) {
+		auto [ptr, ec] = std::from_chars(env, env + std::strlen(env), ttl);
+		if (ec != std::errc{} || *ptr || ttl < 0)
+			die("$LLMQ_CACHE_TTL must be a non-negative integer");
+	}
+	fs::path cachedir = compute_tmpdir(a) / ".cache";
+	if (ttl)
+		mkdir_p(cachedir);
+	char const* upstream = std::getenv("LLMQ_UPSTREAM");
+
+	auto           ledger  = prepare_ledger(a);
+	auto           budgets = prepare_budgets(a);
+	auto           limiter = prepare_limiter(a);
+	response_cache cache{cachedir, std::chrono::seconds{ttl}};
+	gateway        gw{a.plugin, read_auth(prepare_authfile(a)), upstream ? upstream : "",
+                   a.verbose,  ledger,  budgets, limiter, cache};
+
+	int listener = listen_on(addr);
+	verbose_log(a.verbose, "[gateway] serving ", a.plugin->name(), " on ", addr);
+	run_executor([&](executor& ex) {
+		return serve(ex, gw, listener);
+	});
+	::close(listener);
+	if (addr.starts_with("unix:"))
+		::unlink(std::string{addr.substr(5)}.c_str());
+}
+
+inline static struct ryml_error_handler {
+	void
+	on_error(const char* msg, size_t len, ryml::Location loc) {
+		throw std::runtime_error(
+		    ryml::formatrs<std::string>("{}:{}:{} ({}B): ERROR: {}", loc.name, loc.line,
+		                                loc.col, loc.offset, ryml::csubstr(msg, len)));
+	}
+
+	static void
+	s_error(const char* msg, size_t len, ryml::Location loc, void* this_) {
+		return ((ryml_error_handler*)this_)->on_error(msg, len, loc);
+	}
+
+	ryml::Callbacks
+	callbacks() {
+		return ryml::Callbacks(this, nullptr, nullptr, ryml_error_handler::s_error);
+	}
+} ryml_error_handler;
+
+} // namespace llmq
+
+int
+main(int argc, char** argv) {
+	using namespace llmq;
+	using enum llmq::action;
+
+	// prevent any new plugins from being constructed
+	main_started = true;
+
+	// set rapidyaml to use exceptions
+	ryml::set_callbacks(ryml_error_handler.callbacks());
+
+	// read plugin, action, and context (and assert validity)
+	// note: list and help are handled by parse_llmq_args
+	auto a = parse_llmq_args(argc, argv);
+
+	// handle any action that does not require the plugin to be initialized
+	switch (a.action) {
+		case query: {
+			// initialize the plugin
+			auto sess = init_plugin(argc, argv, a,
+			                        a.context.empty() ? std::string{}
+			                                          : read_context(prepare_ctxfile(a)),
+			                        prepare_authfile(a));
+
+			// make the request without saving context
+			run_request(a, sess.get(), true);
+		} break;
+
+		case chat:
+		case resume: {
+			plugctx pctx = init_plugctx(argc, argv, a);
+			auto&   sess = pctx.session;
+			auto&   wctx = pctx.writer;
+
+			// prepare the plugin to continue the unfinished reply
+			if (a.action == resume && !plugop(a.plugin->name(), "resume using", [&sess] {
+				    return sess->resume();
+			    }))
+				die("CONTEXT \"", a.context, "\" has no unfinished reply to resume");
+
+			// make the request; save context each batch of replies (or coarsely, if an
+			// editor follows the live deltas)
+			live_sink live{compute_livefile(compute_ctxfile(a)), a.verbose};
+			run_request(
+			    a, sess.get(), !a.quiet,
+			    [&a, &sess, &wctx] {
+				    wctx.overwrite(plugop(a.plugin->name(), "get context from", [&sess] {
+					    return sess->context();
+				    }));
+			    },
+			    &live);
+		} break;
+
+		case watch: {
+			run_watch(a);
+		} break;
+
+		case serve: {
+			run_serve(a, argc, argv);
+		} break;
+
+		case fork: {
+			return (fork_ctx(a, argc, argv), 0);
+		}
+
+		case tree: {
+			run_tree(argc, argv, a);
+		} break;
+
+		case nearest: {
+			run_nearest(argc, argv, a);
+		} break;
+
+		case init: {
+			if (a.context.empty())
+				a.context = compute_tmpctx(a);
+			plugctx pctx = init_plugctx(argc, argv, a);
+
+			pctx.writer.overwrite(plugop(a.plugin->name(), "get context from", [&pctx] {
+				return pctx.session->context();
+			}));
+			std::cout << a.plugin->name() << "://" << a.context << '\n';
+		} break;
+
+		case edit: {
+			fs::path f = prepare_ctxfile(a);
+			return (spawn_editor(f.parent_path().parent_path(), f), 0);
+		}
+
+		case auth: {
+			fs::path f = prepare_authfile(a);
+			return (spawn_editor(f.parent_path().parent_path(), f), 0);
 		}
 
 		case path: {
@@ -1067,8 +4821,11 @@ main(int argc, char** argv) {
 
 		case del: {
 			fs::path f = compute_ctxfile(a);
-			if (fs::exists(f)) {
-				fs::remove(f);
+			// along with its vector index, if any (see nearest)
+			bool found = false;
+			for (auto suffix : {".yml", ".vec", ".txt", ".ivf"})
+				found |= fs::remove(fs::path{f}.replace_extension(suffix));
+			if (found) {
 				if (fs::is_empty(f.parent_path())) // <dir>/llmq/PLUGIN
 					fs::remove(f.parent_path());
 				if (fs::is_empty(f.parent_path().parent_path())) // <dir>/llmq
@@ -1088,6 +4845,11 @@ main(int argc, char** argv) {
 			return (print_plugins(), 0);
 		}
 
+		case usage: {
+			fs::path f = compute_datadir(a) / ".ledger";
+			return (print_ledger(f, a.context, {argv + a.ofs + 1, argv + argc}), 0);
+		}
+
 		case help: {
 			if (a.plugin) {
 				return (std::cout << a.plugin->help() << '\n', 0);
@@ -1099,5 +4861,5 @@ main(int argc, char** argv) {
 		default: break;
 	}
 
-	return 0;
+	return llmq::interrupted ? 128 + llmq::interrupted : 0;
 }
@@ -29,8 +29,10 @@
 
 #include <getopt.h>
 
+#include <cstdint>
 #include <filesystem>
 #include <functional>
+#include <memory>
 #include <optional>
 #include <source_location>
 #include <span>
@@ -38,16 +40,60 @@
 #include <string_view>
 #include <unordered_map>
 #include <variant>
+#include <vector>
 
 namespace llmq {
 
-// base class for plugins. create a static instance to register it with the executable.
+// the plugin ABI version, bumped whenever this interface changes. loadable plugins
+// built against a different version are refused.
+#define LLMQ_PLUGIN_ABI 7
+
+// exports a static plugin instance from a loadable plugin (PLUGIN.so), which llmq
+// loads by name from the plugin path when PLUGIN is not built in. expands to nothing
+// unless LLMQ_SHARED_PLUGIN is defined, so the same source may be linked in instead.
+#ifdef LLMQ_SHARED_PLUGIN
+#define LLMQ_PLUGIN_EXPORT(instance)                                              \
+	extern "C" unsigned llmq_plugin_abi() noexcept { return LLMQ_PLUGIN_ABI; } \
+	extern "C" ::llmq::plugin* llmq_plugin() noexcept { return &(instance); }
+#else
+#define LLMQ_PLUGIN_EXPORT(instance)
+#endif
+
+// base class for plugins. create a static instance to register it with the executable,
+// or export it with LLMQ_PLUGIN_EXPORT to build a loadable plugin.
+// plugins are stateless factories of sessions, which make the requests.
 struct plugin {
 	struct arg {
 		int         name;  // shortopt char or longopt val, 0 if unnamed
 		std::string value; // empty if no value (flag)
 	};
 
+	struct tokens {
+		std::string   model{};
+		std::uint64_t prompt{0};
+		std::uint64_t completion{0};
+		std::uint64_t cached{0};       // prompt tokens served from a provider cache
+		bool          estimated{false}; // true if not reported by the provider
+	};
+
+	// a structured event produced by a session. llmq prints, persists, and measures them.
+	struct event {
+		enum class kind : std::uint8_t {
+			delta,  // output that will not change (printed unless quiet)
+			finish, // the end of a reply; text is the finish reason
+			usage,  // tokens reported by the provider
+		};
+		kind        type;
+		std::size_t choice{0}; // the reply index, if applicable
+		std::string text{};
+		tokens      usage{};
+
+		// for deltas of reply content: the index of the message in the context and the
+		// byte offset of text in its content, so editors may apply them in place
+		std::optional<std::size_t> message{};
+		std::size_t                offset{0};
+	};
+
 	// name of the plugin. called before init.
 	[[nodiscard]] virtual std::string_view name() const noexcept = 0;
 
@@ -83,7 +129,7 @@ struct plugin {
 	// a short one-line description of the plugin. called before init.
 	[[nodiscard]] virtual std::string_view descr() const noexcept = 0;
 
-	// registers the plugin. instances must be static.
+	// registers the plugin. instances must be static (or exported by a loadable plugin).
 	plugin(std::source_location loc = std::source_location::current()) noexcept;
 	plugin(plugin const&)            = delete;
 	plugin(plugin&&)                 = delete;
@@ -91,28 +137,101 @@ struct plugin {
 	plugin& operator=(plugin&&)      = delete;
 	virtual ~plugin()                = default;
 
-	// initialize the plugin with the context tree, plugin args, and authfile data.
-	// guaranteed to be called before context, url, headers, post, and onreply.
-	virtual void init(ryml::Tree context, std::span<arg const> args, std::string auth) = 0;
-
-	// provides the current, updated context.
-	[[nodiscard]] virtual ryml::Tree const& context() const = 0;
-
-	// provides the endpoint URL.
-	[[nodiscard]] virtual std::string_view url() const = 0;
-
-	// appends the request headers.
-	virtual void append_headers(std::function<void(std::string_view)> append) const = 0;
-
-	// computes the postdata. if not overridden (or nullopt), llmq uses GET instead.
-	[[nodiscard]] virtual std::optional<std::string_view> post() const;
-
-	// integrate a reply into the context.
-	// onreply should print content if print is true (if applicable).
-	virtual void onreply(std::string_view reply, bool print) = 0;
+	// a single request made with the plugin. sessions own all request state (the context
+	// tree, buffers, and replies), so a process may run many at once on different threads.
+	struct session {
+		session()                          = default;
+		session(session const&)            = delete;
+		session(session&&)                 = delete;
+		session& operator=(session const&) = delete;
+		session& operator=(session&&)      = delete;
+		virtual ~session()                 = default;
+
+		// provides the current, updated context.
+		[[nodiscard]] virtual ryml::Tree const& context() const = 0;
+
+		// provides the endpoint URL.
+		[[nodiscard]] virtual std::string_view url() const = 0;
+
+		// appends the request headers.
+		virtual void append_headers(std::function<void(std::string_view)> append) const = 0;
+
+		// computes the postdata. if not overridden (or nullopt), llmq uses GET instead.
+		[[nodiscard]] virtual std::optional<std::string_view> post() const;
+
+		// integrates a chunk of the response into the context, appending any resulting
+		// events. sessions must not print; llmq handles the events once per batch of chunks.
+		virtual void consume(std::span<char const> chunk, std::vector<event>& events) = 0;
+
+		// requests to make before this one (e.g. to gather what its postdata needs), which
+		// llmq makes concurrently and finishes (with onfinish) before the first transfer
+		// (and before split). called once per request. their events are measured, but not
+		// printed or persisted. none by default.
+		[[nodiscard]] virtual std::vector<std::unique_ptr<session>> prepare();
+
+		// splits the request into independent parts (e.g. batches of inputs), which llmq
+		// requests concurrently in its place. called before the first transfer. if true,
+		// the session itself is never requested: it is finished (with onfinish) once
+		// every part is, and may have no parts at all. the events of parts are measured,
+		// but not printed or persisted. false by default.
+		[[nodiscard]] virtual bool split(std::vector<std::unique_ptr<session>>& parts);
+
+		// looks the request up in a cache kept by the plugin (e.g. of similar requests).
+		// called before each transfer. if true, llmq consumes response in place of the
+		// transfer, which is recorded in the ledger as a cache hit; if false, the request
+		// is made and recorded as a cache miss. nullopt (no cache) by default.
+		[[nodiscard]] virtual std::optional<bool> cached(std::string& response);
+
+		// whether the reply is complete. checked after each consume; if true, llmq aborts
+		// the transfer early (e.g. for client-side stop conditions). false by default.
+		[[nodiscard]] virtual bool done() const;
+
+		// called when a transfer (or a cached reply) ends, even if interrupted, before
+		// interrupt, retry, and onfinish. finalizes what the chunks left open (e.g. a
+		// trailing line or a partial document). nothing by default.
+		virtual void onend();
+
+		// called after onend. if true, llmq repeats the request (recomputing the
+		// postdata), so the session must first undo the failed reply. false by default.
+		[[nodiscard]] virtual bool retry();
+
+		// reports the tokens spent by the last transfer, if known. called after each
+		// transfer (before retry); llmq records it in the ledger. nullopt by default.
+		[[nodiscard]] virtual std::optional<tokens> spent() const;
+
+		// estimates the tokens the next transfer will spend at most. called before each
+		// transfer when budgets apply; llmq reserves it against every budget and
+		// reconciles with spent. nullopt by default (reserves nothing).
+		[[nodiscard]] virtual std::optional<tokens> estimate() const;
+
+		// prepares the context to continue an unfinished reply, which should be recorded
+		// with a finish marker as it streams in. called by the resume action before the
+		// request; the next replies are integrated into the unfinished message. false if
+		// there is nothing to resume.
+		[[nodiscard]] virtual bool resume();
+
+		// whether the context ends with a message awaiting a reply (e.g. a user message).
+		// checked by the watch action after each external edit; if true, llmq makes the
+		// request. false by default.
+		[[nodiscard]] virtual bool awaiting() const;
+
+		// splits the context after a reply with several choices into one context per
+		// choice, each as if it were the only reply. called by the tree action to branch
+		// its search. the context itself by default.
+		[[nodiscard]] virtual std::vector<ryml::Tree> choices() const;
+
+		// called after a transfer is aborted by SIGTERM or SIGINT, before onfinish.
+		// the unfinished reply should be marked as interrupted.
+		virtual void interrupt();
+
+		// called when the response has completed. appends a newline delta by default.
+		virtual void onfinish(std::vector<event>& events);
+	};
 
-	// called when the response has completed. prints a newline by default (if print).
-	virtual void onfinish(bool print);
+	// creates a session with the context tree, plugin args, and authfile data.
+	// plugins are shared by every session, so init must not modify the plugin.
+	[[nodiscard]] virtual std::unique_ptr<session>
+	init(ryml::Tree context, std::span<arg const> args, std::string auth) const = 0;
 };
 
 } // namespace llmq
@@ -0,0 +1,571 @@
+//  oooo  oooo
+//  `888  `888
+//   888   888  ooo. .oo.  .oo.    .ooooo oo
+//   888   888  `888P"Y88bP"Y88b  d88' `888
+//   888   888   888   888   888  888   888
+//  o888o o888o o888o o888o o888o `V8bod888
+//  ┌─────────────────────────────────┐ 888
+//  │ a query CLI and context manager │ 888.
+//  │ for LLM-powered shell pipelines │ 8P'
+//  └─────────────────────────────────┘ "
+//  Copyright (C) 2023 Justin Collier <m@jpcx.dev>
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "embed.h"
+#include "cache.h"
+#include "embeddings.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <unordered_map>
+
+namespace llmq {
+
+[[nodiscard]] std::string_view
+embed::name() const noexcept {
+	return "embed";
+}
+
+[[nodiscard]] std::string_view
+embed::shortopts() const noexcept {
+	return "hm:d:b:o:";
+}
+
+[[nodiscard]] option const*
+embed::longopts() const noexcept {
+	static constexpr std::array<option, 6> opts = {{
+	    {"help", no_argument, nullptr, 'h'},
+	    {"model", required_argument, nullptr, 'm'},
+	    {"dimensions", required_argument, nullptr, 'd'},
+	    {"batch", required_argument, nullptr, 'b'},
+	    {"output", required_argument, nullptr, 'o'},
+	    {nullptr, 0, nullptr, 0},
+	}};
+	return opts.data();
+}
+
+namespace embed_impl {
+using event  = plugin::event;
+using tokens = plugin::tokens;
+
+inline static constexpr std::string_view help =
+    "usage: llmq ARGS... embed[://CONTEXT] [OPTIONS]... [INPUT]...\n"
+    "an llmq plugin for the OpenAI Embeddings endpoint.\n"
+    "authfile must be a YAML map with properties \"key\" and optionally \"org\".\n"
+    "\n"
+    "prints the embedding of each line of INPUT as a JSON array, in order (blank lines\n"
+    "print null). identical lines are requested once, and embeddings are cached by\n"
+    "model and content hash in $XDG_CACHE_HOME/llmq/embed (or ~/.cache/llmq/embed), so\n"
+    "cached lines are never requested again. the rest are requested in batches of up\n"
+    "to -b lines (and 1MiB), concurrently.\n"
+    "\n"
+    "context file stores the model and dimensions.\n"
+    "see https://platform.openai.com/docs/api-reference/embeddings for details.\n"
+    "\n"
+    "ARGS:\n"
+    "  arguments for llmq. see llmq --help for info.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  -h --help              display this help and exit\n"
+    "  -m --model STR         model endpoint (default text-embedding-3-small)\n"
+    "  -d --dimensions INT    number of dimensions of each embedding\n"
+    "  -b --batch INT         most lines per request (default 2048)\n"
+    "  -o --output json|none  print the embeddings, or only cache them (default json)\n"
+    "\n"
+    "note: OPTIONS override CONTEXT\n"
+    "note: each batch is cached as soon as it arrives, so an interrupted or failed run\n"
+    "      only requests the remaining lines when repeated.\n"
+    "\n"
+    "INPUT:\n"
+    "  text to embed, one input per line";
+
+inline static constexpr std::string_view usage = help.substr(0, help.find('\n'));
+
+inline static constexpr std::string_view descr =
+    help.substr(usage.size() + 1, help.find('\n', help.find('\n') + 1) - (usage.size() + 1));
+
+// the provider accepts up to 2048 inputs and 300k tokens per request
+inline static constexpr std::size_t max_batch         = 2048;
+inline static constexpr std::size_t max_request_bytes = 1 << 20;
+
+// the cache of the embeddings of one model: a header, then records of a content hash and
+// a vector of float32s. records are appended under an exclusive lock, so any number of
+// processes may share it; lookups read the vectors from a mapping of the file as opened.
+struct vector_cache {
+	struct header {
+		std::array<char, 8> magic;
+		std::uint32_t       dims;
+		std::uint32_t       reserved;
+	};
+	static constexpr std::array<char, 8> magic = {'l', 'l', 'm', 'q', 'v', 'e', 'c', '1'};
+
+	explicit vector_cache(std::filesystem::path path) : _path{std::move(path)} {
+		int fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			if (errno == ENOENT)
+				return;
+			throw std::runtime_error{"could not open the vector cache " + _path.string() +
+			                         ": " + std::strerror(errno)};
+		}
+		struct stat st;
+		if (::fstat(fd, &st) == 0 && (std::size_t)st.st_size >= sizeof(header)) {
+			_size = st.st_size;
+			_map  = ::mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+		}
+		::close(fd);
+		if (_map == MAP_FAILED)
+			return;
+
+		header h;
+		std::memcpy(&h, _map, sizeof(h));
+		if (h.magic != magic || !h.dims)
+			throw std::runtime_error{_path.string() + " is not a vector cache"};
+		_dims = h.dims;
+
+		// a torn record at the end (from a crash) is ignored
+		auto* base   = static_cast<char const*>(_map) + sizeof(header);
+		auto  stride = stride_of(_dims);
+		for (std::size_t n = (_size - sizeof(header)) / stride, i = 0; i < n; ++i) {
+			std::uint64_t key;
+			std::memcpy(&key, base + i * stride, sizeof(key));
+			_index.emplace(key, reinterpret_cast<float const*>(base + i * stride + sizeof(key)));
+		}
+	}
+	vector_cache(vector_cache const&)            = delete;
+	vector_cache& operator=(vector_cache const&) = delete;
+
+	~vector_cache() {
+		if (_map != MAP_FAILED)
+			::munmap(_map, _size);
+	}
+
+	// the dimensions of the cached vectors, or 0 if none are cached
+	[[nodiscard]] std::size_t
+	dims() const noexcept {
+		return _dims;
+	}
+
+	// the cached vector of an input by its content hash, if any
+	[[nodiscard]] float const*
+	find(std::uint64_t key) const noexcept {
+		auto it = _index.find(key);
+		return it == _index.end() ? nullptr : it->second;
+	}
+
+	// appends the vectors of keys (dims floats each) with a single write
+	void
+	append(std::span<std::uint64_t const> keys, std::span<float const> vectors, std::size_t dims) {
+		if (_dims && dims != _dims)
+			throw std::runtime_error{"received " + std::to_string(dims) +
+			                         "-dimensional embeddings, but " + _path.string() +
+			                         " has " + std::to_string(_dims)};
+		std::filesystem::create_directories(_path.parent_path());
+		int fd = ::open(_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if (fd < 0 || ::flock(fd, LOCK_EX) < 0)
+			fail(fd, "could not lock");
+
+		struct stat st;
+		if (::fstat(fd, &st) < 0)
+			fail(fd, "could not stat");
+		std::size_t size   = st.st_size;
+		std::size_t stride = stride_of(dims);
+
+		std::string buf;
+		if (size < sizeof(header)) {
+			header h{magic, (std::uint32_t)dims, 0};
+			buf.append(reinterpret_cast<char const*>(&h), sizeof(h));
+			size = 0;
+		} else {
+			header h;
+			if (::pread(fd, &h, sizeof(h), 0) != sizeof(h))
+				fail(fd, "could not read");
+			if (h.magic != magic || h.dims != dims)
+				throw ::close(fd), std::runtime_error{_path.string() + " has " +
+				                                      std::to_string(h.dims) +
+				                                      "-dimensional embeddings"};
+			size -= (size - sizeof(header)) % stride; // drop a torn record
+		}
+
+		buf.reserve(buf.size() + keys.size() * stride);
+		for (std::size_t i = 0; i < keys.size(); ++i) {
+			buf.append(reinterpret_cast<char const*>(&keys[i]), sizeof(keys[i]));
+			buf.append(reinterpret_cast<char const*>(vectors.data() + i * dims),
+			           dims * sizeof(float));
+		}
+		if (::ftruncate(fd, size) < 0)
+			fail(fd, "could not truncate");
+		for (std::size_t n = 0; n < buf.size();) {
+			::ssize_t w = ::pwrite(fd, buf.data() + n, buf.size() - n, size + n);
+			if (w < 0)
+				fail(fd, "could not write to");
+			n += w;
+		}
+		::close(fd);
+		_dims = dims;
+	}
+
+   private:
+	std::filesystem::path                           _path;
+	void*                                           _map{MAP_FAILED};
+	std::size_t                                     _size{0};
+	std::size_t                                     _dims{0};
+	std::unordered_map<std::uint64_t, float const*> _index{};
+
+	[[nodiscard]] static constexpr std::size_t
+	stride_of(std::size_t dims) noexcept {
+		return sizeof(std::uint64_t) + dims * sizeof(float);
+	}
+
+	[[noreturn]] void
+	fail(int fd, std::string_view what) const {
+		int err = errno;
+		if (fd >= 0)
+			::close(fd);
+		throw std::runtime_error{std::string{what} + " the vector cache " + _path.string() +
+		                         ": " + std::strerror(err)};
+	}
+};
+
+// the cache file of a model (and dimensions, if requested)
+[[nodiscard]] inline static std::string
+cache_name(std::string_view model, std::string_view dims) {
+	std::string name;
+	for (char c : model)
+		name += std::isalnum((unsigned char)c) || c == '.' || c == '-' ? c : '_';
+	if (!dims.empty())
+		(name += '.') += dims;
+	return name + ".f32";
+}
+
+// the state of a session, shared with its parts
+struct state {
+	std::string key{};
+	std::string org{};
+	std::string model{};
+	std::string dims{}; // as requested; empty for the model's default
+	std::size_t batch{max_batch};
+	bool        print{true};
+	bool        interrupted{false};
+
+	std::deque<std::string>       texts{};   // the INPUT args
+	std::vector<std::string_view> inputs{};  // unique non-blank lines of texts
+	std::vector<std::size_t>      lines{};   // the input of each line, or npos if blank
+	std::vector<float const*>     vectors{}; // the embedding of each input, once known
+	std::vector<std::size_t>      missing{}; // the inputs not cached
+	std::size_t                   width{0};  // the dimensions of the embeddings
+
+	std::unique_ptr<vector_cache>  cache{};
+	std::deque<std::vector<float>> received{}; // the embeddings of each part
+};
+
+inline static void
+append_headers(state const& st, std::function<void(std::string_view)> const& append) {
+	embeddings::append_headers(st.key, st.org, append);
+}
+
+// a request of the inputs missing[begin, end) of a session
+struct part : plugin::session {
+	part(std::shared_ptr<state> st, std::size_t begin, std::size_t end) noexcept
+	    : st{std::move(st)}, begin{begin}, end{end} {}
+
+	[[nodiscard]] ryml::Tree const&
+	context() const noexcept override {
+		return empty;
+	}
+
+	[[nodiscard]] std::string_view
+	url() const noexcept override {
+		return embeddings::endpoint;
+	}
+
+	void
+	append_headers(std::function<void(std::string_view)> append) const noexcept override {
+		embed_impl::append_headers(*st, append);
+	}
+
+	[[nodiscard]] std::optional<std::string_view>
+	post() const override {
+		std::vector<std::string_view> inputs;
+		for (std::size_t i = begin; i < end; ++i)
+			inputs.push_back(st->inputs[st->missing[i]]);
+		post_buf = embeddings::body(st->model, st->dims, inputs);
+		return {post_buf};
+	}
+
+	void
+	consume(std::span<char const> chunk, std::vector<event>&) override {
+		response.append(chunk.data(), chunk.size());
+	}
+
+	// reads the usage from the response, once complete
+	[[nodiscard]] std::optional<tokens>
+	spent() const override {
+		if (auto t = embeddings::usage(response, st->model))
+			return t;
+		return estimate();
+	}
+
+	[[nodiscard]] std::optional<tokens>
+	estimate() const override {
+		tokens t{.model = st->model, .estimated = true};
+		for (std::size_t i = begin; i < end; ++i)
+			t.prompt += st->inputs[st->missing[i]].size() / 4 + 1;
+		return t;
+	}
+
+	void
+	interrupt() override {
+		st->interrupted = true;
+	}
+
+	// stores the embeddings, and caches them right away
+	void
+	onfinish(std::vector<event>& events) override {
+		if (st->interrupted)
+			return;
+
+		std::size_t count = end - begin;
+		auto        block = embeddings::read(response, count, st->dims, st->width);
+
+		std::vector<std::uint64_t> keys;
+		for (std::size_t i = begin; i < end; ++i)
+			keys.push_back(content_hash(st->inputs[st->missing[i]]));
+		st->cache->append(keys, block, st->width);
+
+		auto& stored = st->received.emplace_back(std::move(block));
+		for (std::size_t i = 0; i < count; ++i)
+			st->vectors[st->missing[begin + i]] = stored.data() + i * st->width;
+
+		if (auto t = spent(); t && !t->estimated)
+			events.push_back({event::kind::usage, 0, {}, *t});
+	}
+
+   private:
+	std::shared_ptr<state> st;
+	std::size_t            begin;
+	std::size_t            end;
+	ryml::Tree             empty{};
+	mutable std::string    post_buf{};
+	std::string            response{};
+};
+
+// parses a positive count option
+[[nodiscard]] inline static std::size_t
+parse_count(std::string_view name, std::string const& v) {
+	std::size_t n;
+	auto [ptr, ec] = std::from_chars(v.data(), v.data() + v.size(), n);
+	if (ec != std::errc{} || ptr != v.data() + v.size() || !n)
+		throw std::runtime_error{std::string{name} + " must be a positive integer"};
+	return n;
+}
+} // namespace embed_impl
+
+[[nodiscard]] std::string_view
+embed::help() const noexcept {
+	return embed_impl::help;
+}
+
+[[nodiscard]] std::string_view
+embed::usage() const noexcept {
+	return embed_impl::usage;
+}
+
+[[nodiscard]] std::string_view
+embed::descr() const noexcept {
+	return embed_impl::descr;
+}
+
+[[nodiscard]] std::unique_ptr<plugin::session>
+embed::init(ryml::Tree context, std::span<arg const> args, std::string auth) const {
+	return std::make_unique<session>(std::move(context), args, std::move(auth));
+}
+
+embed::session::session(ryml::Tree ctx_, std::span<arg const> args, std::string auth)
+    : ctx{std::move(ctx_)}, st{std::make_shared<embed_impl::state>()} {
+	ryml::Tree authyaml;
+	try {
+		authyaml = ryml::parse_in_place(ryml::substr{auth.data(), auth.size()});
+	} catch (std::exception const& e) {
+		throw std::runtime_error("could not parse authentication data: " +
+		                         std::string{e.what()});
+	}
+	auto authroot = authyaml.rootref();
+	if (!authroot.is_map())
+		throw std::runtime_error{"authfile must be a YAML map with properties \"key\" and "
+		                         "optionally \"org\""};
+	try {
+		authroot["key"] >> st->key;
+		if (!authroot["org"].is_seed())
+			authroot["org"] >> st->org;
+	} catch (std::exception const& e) {
+		throw std::runtime_error("could not parse authentication data: " +
+		                         std::string{e.what()});
+	}
+	auto root = ctx.rootref();
+	if (root.empty())
+		root |= ryml::MAP;
+	if (!root.is_map())
+		throw std::runtime_error{
+		    "embed context must be a YAML map- see `llmq help embed` for details"};
+
+	for (auto&& [n, v] : args) {
+		if (n == 'h')
+			exit((std::cout << embed_impl::help << '\n', 0));
+
+		if (n != 0 && v.empty())
+			throw std::runtime_error{"invalid flag: " + (std::isalpha(n)
+			                                                 ? std::string{1, (char)n}
+			                                                 : std::to_string(n))};
+
+		if (n == 'm') {
+			root["model"] << v;
+		} else if (n == 'd') {
+			root["dimensions"] << embed_impl::parse_count("dimensions", v);
+		} else if (n == 'b') {
+			st->batch = std::min(embed_impl::parse_count("batch", v), embed_impl::max_batch);
+		} else if (n == 'o') {
+			if (v != "json" && v != "none")
+				throw std::runtime_error{"output must be one of: json, none"};
+			st->print = v == "json";
+		} else if (n == 0) {
+			st->texts.push_back(v);
+		} else {
+			throw std::runtime_error{"invalid option: " + (std::isalpha(n)
+			                                                   ? std::string{1, (char)n}
+			                                                   : std::to_string(n))};
+		}
+	}
+
+	st->model = embeddings::default_model;
+	if (root.has_child("model"))
+		root["model"] >> st->model;
+	if (root.has_child("dimensions"))
+		root["dimensions"] >> st->dims;
+
+	// one input per line; identical lines share an input
+	std::unordered_map<std::string_view, std::size_t> seen;
+	for (std::string_view text : st->texts) {
+		if (text.ends_with('\n'))
+			text.remove_suffix(1);
+		for (std::size_t pos = 0; pos <= text.size();) {
+			auto eol  = std::min(text.find('\n', pos), text.size());
+			auto line = text.substr(pos, eol - pos);
+			if (line.ends_with('\r'))
+				line.remove_suffix(1);
+			pos = eol + 1;
+
+			if (line.find_first_not_of(" \t") == line.npos) {
+				st->lines.push_back(std::string_view::npos);
+				continue;
+			}
+			auto [it, added] = seen.emplace(line, st->inputs.size());
+			if (added)
+				st->inputs.push_back(line);
+			st->lines.push_back(it->second);
+		}
+	}
+	st->vectors.resize(st->inputs.size());
+}
+
+embed::session::~session() = default;
+
+[[nodiscard]] ryml::Tree const&
+embed::session::context() const noexcept {
+	return ctx;
+}
+
+[[nodiscard]] std::string_view
+embed::session::url() const noexcept {
+	return embeddings::endpoint;
+}
+
+void
+embed::session::append_headers(std::function<void(std::string_view)> append) const noexcept {
+	embed_impl::append_headers(*st, append);
+}
+
+void
+embed::session::consume(std::span<char const>, std::vector<event>&) {}
+
+// looks up every input in the cache, and requests the rest in batches
+bool
+embed::session::split(std::vector<std::unique_ptr<plugin::session>>& parts) {
+	st->cache = std::make_unique<embed_impl::vector_cache>(
+	    cache_dir("embed") / embed_impl::cache_name(st->model, st->dims));
+	st->width = st->cache->dims();
+
+	for (std::size_t i = 0; i < st->inputs.size(); ++i) {
+		if (auto v = st->cache->find(content_hash(st->inputs[i])))
+			st->vectors[i] = v;
+		else
+			st->missing.push_back(i);
+	}
+
+	for (std::size_t begin = 0, end = 0; begin < st->missing.size(); begin = end) {
+		std::size_t bytes = 0;
+		for (; end < st->missing.size() && end - begin < st->batch; ++end) {
+			bytes += st->inputs[st->missing[end]].size();
+			if (end > begin && bytes > embed_impl::max_request_bytes)
+				break;
+		}
+		parts.push_back(std::make_unique<embed_impl::part>(st, begin, end));
+	}
+	return true;
+}
+
+void
+embed::session::interrupt() {
+	st->interrupted = true;
+}
+
+// prints the embedding of each line
+void
+embed::session::onfinish(std::vector<event>& events) {
+	if (st->interrupted || !st->print)
+		return;
+	if (auto n = std::ranges::count(st->vectors, nullptr))
+		throw std::runtime_error{std::to_string(n) + " inputs were not embedded"};
+
+	std::string line;
+	for (auto input : st->lines) {
+		if (input == std::string_view::npos) {
+			events.push_back({event::kind::delta, 0, "null\n"});
+			continue;
+		}
+		line = '[';
+		for (std::size_t i = 0; i < st->width; ++i) {
+			std::array<char, 32> buf;
+			auto                 end = std::to_chars(buf.begin(), buf.end(), st->vectors[input][i]).ptr;
+			if (i)
+				line += ',';
+			line.append(buf.data(), end);
+		}
+		line += "]\n";
+		events.push_back({event::kind::delta, 0, line});
+	}
+}
+
+} // namespace llmq
+
+LLMQ_PLUGIN_EXPORT(::llmq::embed)
@@ -0,0 +1,71 @@
+#ifndef LLMQ_PLUGINS_EMBED_H_INCLUDED
+#define LLMQ_PLUGINS_EMBED_H_INCLUDED
+//  oooo  oooo
+//  `888  `888
+//   888   888  ooo. .oo.  .oo.    .ooooo oo
+//   888   888  `888P"Y88bP"Y88b  d88' `888
+//   888   888   888   888   888  888   888
+//  o888o o888o o888o o888o o888o `V8bod888
+//  ┌─────────────────────────────────┐ 888
+//  │ a query CLI and context manager │ 888.
+//  │ for LLM-powered shell pipelines │ 8P'
+//  └─────────────────────────────────┘ "
+//  Copyright (C) 2023 Justin Collier <m@jpcx.dev>
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "llmq.h"
+
+#include <memory>
+
+namespace llmq {
+
+namespace embed_impl {
+struct state;
+} // namespace embed_impl
+
+// usage: llmq ARGS... embed[://CONTEXT] [OPTIONS]... [INPUT]...
+// a llmq plugin for the OpenAI Embeddings endpoint. inputs are deduplicated, looked up in
+// a local vector cache, and the rest are requested in large concurrent batches.
+inline struct embed : plugin {
+	[[nodiscard]] std::string_view name() const noexcept override;
+	[[nodiscard]] std::string_view shortopts() const noexcept override;
+	[[nodiscard]] option const*    longopts() const noexcept override;
+	[[nodiscard]] std::string_view help() const noexcept override;
+	[[nodiscard]] std::string_view usage() const noexcept override;
+	[[nodiscard]] std::string_view descr() const noexcept override;
+	[[nodiscard]] std::unique_ptr<plugin::session>
+	init(ryml::Tree context, std::span<arg const> args, std::string auth) const override;
+
+	struct session : plugin::session {
+		session(ryml::Tree context, std::span<arg const> args, std::string auth);
+		~session() override;
+
+		[[nodiscard]] ryml::Tree const& context() const noexcept override;
+		[[nodiscard]] std::string_view  url() const noexcept override;
+		void append_headers(std::function<void(std::string_view)> append) const noexcept override;
+		void consume(std::span<char const> chunk, std::vector<event>& events) override;
+		[[nodiscard]] bool split(std::vector<std::unique_ptr<plugin::session>>& parts) override;
+		void               interrupt() override;
+		void               onfinish(std::vector<event>& events) override;
+
+	   protected:
+		ryml::Tree                         ctx;
+		std::shared_ptr<embed_impl::state> st; // shared with the parts
+	};
+} embed;
+
+} // namespace llmq
+
+#endif
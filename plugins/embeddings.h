@@ -0,0 +1,167 @@
+#ifndef LLMQ_PLUGINS_EMBEDDINGS_H_INCLUDED
+#define LLMQ_PLUGINS_EMBEDDINGS_H_INCLUDED
+//  oooo  oooo
+//  `888  `888
+//   888   888  ooo. .oo.  .oo.    .ooooo oo
+//   888   888  `888P"Y88bP"Y88b  d88' `888
+//   888   888   888   888   888  888   888
+//  o888o o888o o888o o888o o888o `V8bod888
+//  ┌─────────────────────────────────┐ 888
+//  │ a query CLI and context manager │ 888.
+//  │ for LLM-powered shell pipelines │ 8P'
+//  └─────────────────────────────────┘ "
+//  Copyright (C) 2023 Justin Collier <m@jpcx.dev>
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#include "llmq.h"
+
+#include <algorithm>
+#include <charconv>
+#include <functional>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace llmq {
+
+// the client of the OpenAI Embeddings endpoint shared by plugins that request embeddings
+namespace embeddings {
+
+inline constexpr std::string_view endpoint = "https://api.openai.com/v1/embeddings";
+
+inline constexpr std::string_view default_model = "text-embedding-3-small";
+
+inline void
+append_headers(std::string_view key, std::string_view org,
+               std::function<void(std::string_view)> const& append) {
+	append("Content-Type: application/json");
+	append("Authorization: Bearer " + std::string{key});
+	if (!org.empty())
+		append("OpenAI-Organization: " + std::string{org});
+}
+
+// the JSON body of a request of the embeddings of inputs (as base64-encoded float32s).
+// dims may be empty for the model's default.
+[[nodiscard]] inline std::string
+body(std::string_view model, std::string_view dims, std::span<std::string_view const> inputs) {
+	ryml::Tree    tree;
+	ryml::NodeRef root = tree.rootref();
+	root |= ryml::MAP;
+	root["model"] << ryml::csubstr{model.data(), model.size()};
+	if (!dims.empty())
+		root["dimensions"] << ryml::csubstr{dims.data(), dims.size()};
+	root["encoding_format"] << "base64";
+	ryml::NodeRef input = root["input"];
+	input |= ryml::SEQ;
+	for (auto s : inputs) {
+		auto v = input.append_child();
+		v |= ryml::VALQUO;
+		v << ryml::csubstr{s.data(), s.size()};
+	}
+	return ryml::emitrs_json<std::string>(tree);
+}
+
+// the usage of a complete response, if reported
+[[nodiscard]] inline std::optional<plugin::tokens>
+usage(std::string_view response, std::string_view model) {
+	try {
+		ryml::Tree tree = ryml::parse_in_arena(ryml::csubstr{response.data(), response.size()});
+		auto       root = tree.crootref();
+		if (!root.is_map() || !root.has_child("usage") || !root["usage"].is_map() ||
+		    !root["usage"].has_child("prompt_tokens"))
+			return std::nullopt;
+		plugin::tokens t{.model = std::string{model}};
+		if (root.has_child("model"))
+			root["model"] >> t.model;
+		root["usage"]["prompt_tokens"] >> t.prompt;
+		return t;
+	} catch (std::exception const&) {
+		return std::nullopt;
+	}
+}
+
+// reads an embedding, which is a sequence of numbers or base64-encoded float32s
+[[nodiscard]] inline std::vector<float>
+read_embedding(ryml::ConstNodeRef node) {
+	std::vector<float> res;
+	if (node.is_seq()) {
+		res.reserve(node.num_children());
+		for (auto v : node.children()) {
+			float f;
+			auto  s = v.val();
+			if (std::from_chars(s.begin(), s.end(), f).ec != std::errc{})
+				throw std::runtime_error{"invalid embedding value: " + std::string{s.str, s.len}};
+			res.push_back(f);
+		}
+	} else if (node.has_val()) {
+		std::size_t len = c4::base64_decode(node.val(), {});
+		if (len % sizeof(float))
+			throw std::runtime_error{"invalid base64 embedding"};
+		res.resize(len / sizeof(float));
+		c4::base64_decode(node.val(), {reinterpret_cast<char*>(res.data()), len});
+	}
+	if (res.empty())
+		throw std::runtime_error{"invalid response: empty embedding"};
+	return res;
+}
+
+// reads the embeddings of a complete response to a request of count inputs, in order,
+// width floats each. width is set by the first embedding if 0 (and must match dims, if
+// requested); every embedding must have width floats.
+[[nodiscard]] inline std::vector<float>
+read(std::string_view response, std::size_t count, std::string_view dims, std::size_t& width) {
+	ryml::Tree tree = ryml::parse_in_arena(ryml::csubstr{response.data(), response.size()});
+	auto       root = tree.crootref();
+	if (root.is_map() && root.has_child("error")) {
+		std::string msg = "unknown error";
+		if (auto e = root["error"]; e.is_map() && e.has_child("message"))
+			e["message"] >> msg;
+		throw std::runtime_error{"embeddings request failed: " + msg};
+	}
+	if (!root.is_map() || !root.has_child("data") || !root["data"].is_seq())
+		throw std::runtime_error{"invalid response: " + std::string{response.substr(0, 256)}};
+
+	std::vector<float> block;
+	std::vector<bool>  seen(count);
+	for (auto item : root["data"].children()) {
+		std::size_t idx;
+		if (!item.is_map() || !item.has_child("index") || !ryml::read(item["index"], &idx) ||
+		    idx >= count || !item.has_child("embedding"))
+			throw std::runtime_error{"invalid response: unexpected embedding"};
+		auto v = read_embedding(item["embedding"]);
+		if (!width && !dims.empty() && std::to_string(v.size()) != dims)
+			throw std::runtime_error{"invalid response: embeddings have " +
+			                         std::to_string(v.size()) + " dimensions, not " +
+			                         std::string{dims}};
+		if (!width)
+			width = v.size();
+		if (v.size() != width)
+			throw std::runtime_error{"invalid response: embeddings differ in dimensions"};
+		block.resize(count * width);
+		std::ranges::copy(v, block.begin() + idx * width);
+		seen[idx] = true;
+	}
+	if (std::ranges::find(seen, false) != seen.end())
+		throw std::runtime_error{"invalid response: missing embeddings"};
+	return block;
+}
+
+} // namespace embeddings
+
+} // namespace llmq
+
+#endif
@@ -24,8 +24,18 @@
 //  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "gpt.h"
+#include "cache.h"
+#include "embeddings.h"
+#include "index.h"
 
+#include <unistd.h>
+
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <regex>
 #include <sstream>
 
 namespace llmq {
@@ -37,12 +47,12 @@ gpt::name() const noexcept {
 
 [[nodiscard]] std::string_view
 gpt::shortopts() const noexcept {
-	return "hm:T:p:n:S:X:t:P:F:L:U:s:g:u:";
+	return "hm:T:p:n:S:X:t:P:F:L:U:R:E:B:N:j:Y:r:O:x:k:K:C:s:g:u:";
 }
 
 [[nodiscard]] option const*
 gpt::longopts() const noexcept {
-	static constexpr std::array<option, 16> opts = {{
+	static constexpr std::array<option, 28> opts = {{
 	    {"help", no_argument, nullptr, 'h'},
 	    {"model", required_argument, nullptr, 'm'},
 	    {"temperature", required_argument, nullptr, 'T'},
@@ -55,6 +65,18 @@ gpt::longopts() const noexcept {
 	    {"frequency-penalty", required_argument, nullptr, 'F'},
 	    {"logit-bias", required_argument, nullptr, 'L'},
 	    {"user", required_argument, nullptr, 'U'},
+	    {"stop-regex", required_argument, nullptr, 'R'},
+	    {"stop-on", required_argument, nullptr, 'E'},
+	    {"max-bytes", required_argument, nullptr, 'B'},
+	    {"max-lines", required_argument, nullptr, 'N'},
+	    {"json", required_argument, nullptr, 'j'},
+	    {"json-schema", required_argument, nullptr, 'Y'},
+	    {"retries", required_argument, nullptr, 'r'},
+	    {"emit-tools", required_argument, nullptr, 'O'},
+	    {"index", required_argument, nullptr, 'x'},
+	    {"index-top", required_argument, nullptr, 'k'},
+	    {"index-tokens", required_argument, nullptr, 'K'},
+	    {"semantic-cache", required_argument, nullptr, 'C'},
 	    {"sys", required_argument, nullptr, 's'},
 	    {"gpt", required_argument, nullptr, 'g'},
 	    {"usr", required_argument, nullptr, 'u'},
@@ -88,8 +110,43 @@ inline static constexpr std::string_view help =
     "  -F --frequency-penalty NUM  penalty for token frequency\n"
     "  -L --logit-bias MAP         JSON map of token biases\n"
     "  -U --user STR               unique user identifier\n"
+    "  -R --stop-regex RE          stop when a line of the reply matches RE\n"
+    "  -E --stop-on fence|json     stop after a closing code fence or JSON object/array\n"
+    "  -B --max-bytes INT          stop after INT bytes of reply content\n"
+    "  -N --max-lines INT          stop after INT lines of reply content\n"
+    "  -j --json BOOL              validate the reply as JSON while it streams\n"
+    "  -Y --json-schema FILE       validate the reply against a JSON schema (implies -j)\n"
+    "  -r --retries INT            retry up to INT times if validation fails\n"
+    "  -O --emit-tools BOOL        print each tool call as a JSON line once complete\n"
+    "  -x --index PATH             send excerpts of the vector index at PATH nearest to\n"
+    "                              the last user message (see `llmq help`, NEAREST)\n"
+    "  -k --index-top INT          send at most INT excerpts (default 5)\n"
+    "  -K --index-tokens INT       send at most about INT tokens of excerpts (default 1000)\n"
+    "  -C --semantic-cache NUM     replay the cached response to a similar request if the\n"
+    "                              similarity of its last user message is at least NUM\n"
     "\n"
     "note: OPTIONS override CONTEXT\n"
+    "note: -R|E|B|N are evaluated by llmq as the reply streams in. they abort the\n"
+    "      transfer and trim the reply at the match, and are not stored in CONTEXT.\n"
+    "      -R is matched against each line (and holds back printing until the line\n"
+    "      is complete); the match and anything after it are discarded.\n"
+    "note: -j|Y abort the transfer on the first invalid byte. schemas support type,\n"
+    "      properties, required, additionalProperties, items, and enum. with -r,\n"
+    "      output is held until the reply is validated.\n"
+    "note: when budgets apply, each request reserves its prompt plus -t (or 1024)\n"
+    "      tokens per choice until the actual usage is known.\n"
+    "note: replies are stored with `partial: true` (or `partial: interrupted`, if\n"
+    "      stopped by a signal) until they finish or are cut off by -t, so that\n"
+    "      `llmq resume` can continue them. the marker is not sent.\n"
+    "note: with -x, each request first embeds the last user message (with the model\n"
+    "      and dimensions of PATH.yml, e.g. `llmq p embed://NAME`, or else\n"
+    "      text-embedding-3-small), then sends the nearest excerpts in a system message\n"
+    "      before it (the first excerpt is cut to fit -K). excerpts are not stored in\n"
+    "      CONTEXT. clustered indexes are searched as by `llmq nearest` ($LLMQ_NPROBE).\n"
+    "note: with -C, the last user message (lowercased, with whitespace collapsed) is\n"
+    "      embedded with text-embedding-3-small and looked up among the requests with\n"
+    "      the same rest of the context in $XDG_CACHE_HOME/llmq/gpt/semantic. responses\n"
+    "      of finished replies are cached. hits and misses are counted by `llmq u`.\n"
     "\n"
     "TAGMSG:\n"
     "  -s --sys STR  append a system message to the context\n"
@@ -104,11 +161,952 @@ inline static constexpr std::string_view usage = help.substr(0, help.find('\n'))
 inline static constexpr std::string_view descr =
     help.substr(usage.size() + 1, help.find('\n', help.find('\n') + 1) - (usage.size() + 1));
 
-inline static std::string                key{};
-inline static std::string                org{};
-inline static std::vector<ryml::NodeRef> replies{};
-inline static std::string                reply_buf{};
-inline static std::string                post_buf{};
+enum class stop_on : uint8_t { none, fence, json };
+
+// the client-side stop conditions of a session
+struct stop_conditions {
+	std::vector<std::regex> regex{};
+	enum stop_on            on{stop_on::none};
+	std::size_t             max_bytes{0}; // 0 if unlimited
+	std::size_t             max_lines{0}; // 0 if unlimited
+};
+
+// evaluates the client-side stop conditions over a growing reply.
+// each byte of content is examined once; scan returns the trim offset on a match.
+struct stopper {
+	stop_conditions const* cond;
+	std::size_t scanned{0}; // content already examined
+	std::size_t line{0};    // offset of the current (incomplete) line
+	std::size_t lines{0};   // number of completed lines
+	bool        fenced{false};
+	int         depth{0}; // json nesting depth
+	bool        str{false};
+	bool        esc{false};
+	bool        stopped{false};
+
+	[[nodiscard]] std::optional<std::size_t>
+	scan(std::string_view content) {
+		std::size_t end =
+		    cond->max_bytes ? std::min(content.size(), cond->max_bytes) : content.size();
+		for (; scanned < end; ++scanned) {
+			char c = content[scanned];
+			if (cond->on == stop_on::json) {
+				if (str) {
+					if (esc)
+						esc = false;
+					else if (c == '\\')
+						esc = true;
+					else if (c == '"')
+						str = false;
+				} else if (c == '"' && depth) {
+					str = true;
+				} else if (c == '{' || c == '[') {
+					++depth;
+				} else if ((c == '}' || c == ']') && depth && --depth == 0) {
+					return scanned + 1;
+				}
+			}
+			if (c == '\n')
+				if (auto cut = endline(content, scanned))
+					return cut;
+		}
+		if (cond->max_bytes && content.size() >= cond->max_bytes) {
+			// do not split a UTF-8 sequence
+			std::size_t cut = cond->max_bytes;
+			while (cut > 0 && cut < content.size() && (content[cut] & 0xC0) == 0x80)
+				--cut;
+			return cut;
+		}
+		return std::nullopt;
+	}
+
+	// scans the trailing line at the end of the stream
+	[[nodiscard]] std::optional<std::size_t>
+	flush(std::string_view content) {
+		if (line >= content.size())
+			return std::nullopt;
+		return endline(content, content.size());
+	}
+
+   private:
+	[[nodiscard]] std::optional<std::size_t>
+	endline(std::string_view content, std::size_t end) {
+		std::string_view l = content.substr(line, end - line);
+		std::size_t      begin = line;
+		line                   = end + 1;
+		++lines;
+
+		for (auto&& re : cond->regex) {
+			std::match_results<std::string_view::const_iterator> m;
+			if (std::regex_search(l.begin(), l.end(), m, re))
+				return begin + m.position(0);
+		}
+
+		if (cond->on == stop_on::fence) {
+			auto fence = l.find_first_not_of(" \t");
+			if (fence != l.npos && l.substr(fence).starts_with("```")) {
+				if (fenced && l.find_first_not_of("` \t", fence) == l.npos)
+					return end;
+				fenced = true;
+			}
+		}
+
+		if (cond->max_lines && lines >= cond->max_lines)
+			return end;
+
+		return std::nullopt;
+	}
+};
+
+// a subset of JSON Schema: type, properties, required, additionalProperties, items, enum.
+struct json_schema {
+	static constexpr std::size_t any = -1;
+
+	enum type : uint8_t {
+		object  = 1 << 0,
+		array   = 1 << 1,
+		string  = 1 << 2,
+		number  = 1 << 3,
+		integer = 1 << 4,
+		boolean = 1 << 5,
+		null    = 1 << 6,
+	};
+
+	struct node {
+		uint8_t                                      types{0}; // 0 if unconstrained
+		std::unordered_map<std::string, std::size_t> properties{};
+		std::vector<std::string>                     required{};
+		bool                                         additional{true};
+		std::size_t                                  additional_schema{any};
+		std::size_t                                  items{any};
+		std::vector<std::string>                     enums{}; // raw JSON tokens
+	};
+
+	std::vector<node> nodes{};
+
+	// compiles the schema; the root is nodes[0] if not empty
+	explicit json_schema(ryml::ConstNodeRef root) {
+		compile(root);
+	}
+
+	json_schema() = default;
+
+   private:
+	// whether an unquoted scalar is a JSON number or keyword
+	[[nodiscard]] static bool
+	is_literal(std::string const& v) {
+		if (v == "true" || v == "false" || v == "null")
+			return true;
+		char* end;
+		std::strtod(v.c_str(), &end);
+		return !v.empty() && *end == '\0';
+	}
+
+	[[nodiscard]] static uint8_t
+	parse_type(ryml::csubstr t) {
+		if (t == "object")
+			return object;
+		if (t == "array")
+			return array;
+		if (t == "string")
+			return string;
+		if (t == "number")
+			return number;
+		if (t == "integer")
+			return integer;
+		if (t == "boolean")
+			return boolean;
+		if (t == "null")
+			return null;
+		throw std::runtime_error{"unsupported schema type \"" + std::string{t.str, t.len} +
+		                         "\""};
+	}
+
+	std::size_t
+	compile(ryml::ConstNodeRef n) {
+		if (!n.is_map())
+			return any;
+		std::size_t idx = nodes.size();
+		nodes.emplace_back();
+		node s;
+		if (n.has_child("type")) {
+			auto t = n["type"];
+			if (t.is_seq())
+				for (auto&& v : t)
+					s.types |= parse_type(v.val());
+			else
+				s.types = parse_type(t.val());
+		}
+		if (n.has_child("properties"))
+			for (auto&& p : n["properties"])
+				s.properties.emplace(std::string{p.key().str, p.key().len}, compile(p));
+		if (n.has_child("required"))
+			for (auto&& r : n["required"])
+				s.required.emplace_back(r.val().str, r.val().len);
+		if (n.has_child("additionalProperties")) {
+			auto a = n["additionalProperties"];
+			if (a.is_map())
+				s.additional_schema = compile(a);
+			else
+				s.additional = a.val() != "false";
+		}
+		if (n.has_child("items"))
+			s.items = compile(n["items"]);
+		if (n.has_child("enum"))
+			for (auto&& e : n["enum"]) {
+				std::string v{e.val().str, e.val().len};
+				s.enums.push_back(e.is_val_quoted() || !is_literal(v) ? '"' + v + '"' : v);
+			}
+		nodes[idx] = std::move(s);
+		return idx;
+	}
+};
+
+// an incremental JSON validator. feed examines each byte once and throws on the first
+// irrecoverable syntax or schema error; finish throws if the value is incomplete.
+struct json_validator {
+	explicit json_validator(json_schema const* schema = nullptr) noexcept
+	    : schema{schema} {}
+
+	void
+	feed(std::string_view s) {
+		for (char c : s) {
+			while (!step(c))
+				;
+			++offset;
+		}
+	}
+
+	void
+	finish() {
+		if (state == st::number)
+			end_number();
+		if (state != st::end)
+			fail("unexpected end of reply");
+	}
+
+   private:
+	json_schema const* schema; // optional
+
+	enum class st : uint8_t {
+		value,       // expecting a value
+		first_value, // expecting a value or ']'
+		key,         // expecting a key
+		first_key,   // expecting a key or '}'
+		colon,
+		next, // expecting ',' or a closing bracket
+		string,
+		escape,
+		unicode,
+		number,
+		literal,
+		end, // expecting whitespace only
+	};
+
+	enum class num : uint8_t { minus, zero, integer, dot, fraction, exp, exp_sign, exponent };
+
+	struct frame {
+		bool              object;
+		std::size_t       schema;
+		std::vector<bool> seen{}; // required properties received
+	};
+
+	st                 state{st::value};
+	num                nstate{};
+	bool               in_key{false};
+	bool               capture{false}; // token is needed for key or enum matching
+	std::string        token{};
+	std::string_view   literal{};
+	std::size_t        pos{0};    // literal or unicode escape progress
+	std::size_t        pending{0}; // schema for the next value
+	std::size_t        offset{0};
+	std::vector<frame> stack{};
+
+	[[noreturn]] void
+	fail(std::string_view msg) const {
+		throw std::runtime_error{"invalid JSON reply at byte " + std::to_string(offset) + ": " +
+		                         std::string{msg}};
+	}
+
+	[[noreturn]] void
+	unexpected(char c) const {
+		if (c < 0x20)
+			fail("unexpected control character");
+		fail("unexpected '" + std::string{1, c} + "'");
+	}
+
+	[[nodiscard]] json_schema::node const*
+	node(std::size_t idx) const {
+		return schema && idx < schema->nodes.size() ? &schema->nodes[idx] : nullptr;
+	}
+
+	[[nodiscard]] static bool
+	space(char c) noexcept {
+		return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+	}
+
+	// checks the schema type of a value that begins here
+	void
+	begin_value(uint8_t type) {
+		token.clear();
+		capture = false;
+		auto s  = node(pending);
+		if (!s)
+			return;
+		uint8_t accepted = s->types;
+		if (accepted & json_schema::integer)
+			accepted |= json_schema::number;
+		if (accepted && !(accepted & type))
+			fail("value does not match the schema type");
+		capture = type != json_schema::object && type != json_schema::array &&
+		          !s->enums.empty();
+	}
+
+	void
+	end_value() {
+		if (capture) {
+			auto s = node(pending);
+			if (std::ranges::find(s->enums, token) == s->enums.end())
+				fail("value " + token + " is not in the schema enum");
+		}
+		capture = false;
+		if (stack.empty()) {
+			state = st::end;
+			return;
+		}
+		state = st::next;
+		if (auto s = node(stack.back().schema); s && !stack.back().object)
+			pending = s->items;
+		else
+			pending = json_schema::any;
+	}
+
+	void
+	end_number() {
+		if (nstate == num::minus || nstate == num::dot || nstate == num::exp ||
+		    nstate == num::exp_sign)
+			fail("incomplete number");
+		auto s = node(pending);
+		if (s && s->types && !(s->types & json_schema::number) &&
+		    nstate != num::zero && nstate != num::integer)
+			fail("value does not match the schema type");
+		end_value();
+	}
+
+	void
+	push(bool object) {
+		frame f{object, pending};
+		if (auto s = node(pending); s && object)
+			f.seen.resize(s->required.size());
+		stack.push_back(std::move(f));
+		pending = !object && node(pending) ? node(pending)->items : json_schema::any;
+	}
+
+	void
+	pop() {
+		auto& f = stack.back();
+		if (auto s = node(f.schema); s && f.object)
+			for (std::size_t i = 0; i < f.seen.size(); ++i)
+				if (!f.seen[i])
+					fail("missing required property \"" + s->required[i] + "\"");
+		pending = f.schema;
+		stack.pop_back();
+		end_value();
+	}
+
+	void
+	end_key() {
+		auto& f = stack.back();
+		auto  s = node(f.schema);
+		state   = st::colon;
+		if (!s) {
+			pending = json_schema::any;
+			return;
+		}
+		for (std::size_t i = 0; i < s->required.size(); ++i)
+			if (s->required[i] == token)
+				f.seen[i] = true;
+		if (auto it = s->properties.find(token); it != s->properties.end())
+			pending = it->second;
+		else if (!s->additional)
+			fail("unexpected property \"" + token + "\"");
+		else
+			pending = s->additional_schema;
+	}
+
+	// returns false if c must be processed again in the new state
+	[[nodiscard]] bool
+	step(char c) {
+		switch (state) {
+			case st::first_value:
+				if (c == ']')
+					return pop(), true;
+				[[fallthrough]];
+			case st::value:
+				if (space(c))
+					return true;
+				if (c == '{') {
+					begin_value(json_schema::object);
+					push(true);
+					state = st::first_key;
+				} else if (c == '[') {
+					begin_value(json_schema::array);
+					push(false);
+					state = st::first_value;
+				} else if (c == '"') {
+					begin_value(json_schema::string);
+					in_key = false;
+					state  = st::string;
+				} else if (c == '-' || (c >= '0' && c <= '9')) {
+					begin_value(json_schema::number);
+					nstate = c == '-' ? num::minus : c == '0' ? num::zero : num::integer;
+					state  = st::number;
+				} else if (c == 't' || c == 'f' || c == 'n') {
+					begin_value(c == 'n' ? json_schema::null : json_schema::boolean);
+					literal = c == 't' ? "true" : c == 'f' ? "false" : "null";
+					pos     = 1;
+					state   = st::literal;
+				} else {
+					unexpected(c);
+				}
+				if (capture)
+					token += c;
+				return true;
+			case st::first_key:
+				if (c == '}')
+					return pop(), true;
+				[[fallthrough]];
+			case st::key:
+				if (space(c))
+					return true;
+				if (c != '"')
+					unexpected(c);
+				token.clear();
+				in_key = capture = true;
+				state            = st::string;
+				return true;
+			case st::colon:
+				if (space(c))
+					return true;
+				if (c != ':')
+					unexpected(c);
+				state = st::value;
+				return true;
+			case st::next:
+				if (space(c))
+					return true;
+				if (c == ',')
+					state = stack.back().object ? st::key : st::value;
+				else if (c == (stack.back().object ? '}' : ']'))
+					pop();
+				else
+					unexpected(c);
+				return true;
+			case st::string:
+				if ((unsigned char)c < 0x20)
+					unexpected(c);
+				if (c == '\\')
+					state = st::escape;
+				else if (c == '"' && in_key)
+					return end_key(), true;
+				if (capture && !(c == '"' && in_key))
+					token += c;
+				if (c == '"')
+					end_value();
+				return true;
+			case st::escape:
+				if (capture)
+					token += c;
+				if (c == 'u') {
+					pos   = 0;
+					state = st::unicode;
+				} else if (std::string_view{"\"\\/bfnrt"}.find(c) != std::string_view::npos) {
+					state = st::string;
+				} else {
+					unexpected(c);
+				}
+				return true;
+			case st::unicode:
+				if (!std::isxdigit((unsigned char)c))
+					unexpected(c);
+				if (capture)
+					token += c;
+				if (++pos == 4)
+					state = st::string;
+				return true;
+			case st::number: {
+				bool digit = c >= '0' && c <= '9';
+				bool exp   = c == 'e' || c == 'E';
+				switch (nstate) {
+					case num::minus:
+						if (!digit)
+							unexpected(c);
+						nstate = c == '0' ? num::zero : num::integer;
+						break;
+					case num::zero:
+					case num::integer:
+						if (digit && nstate == num::integer)
+							break;
+						if (c == '.')
+							nstate = num::dot;
+						else if (exp)
+							nstate = num::exp;
+						else
+							return end_number(), false;
+						break;
+					case num::dot:
+						if (!digit)
+							unexpected(c);
+						nstate = num::fraction;
+						break;
+					case num::fraction:
+						if (exp)
+							nstate = num::exp;
+						else if (!digit)
+							return end_number(), false;
+						break;
+					case num::exp:
+						if (c == '+' || c == '-')
+							nstate = num::exp_sign;
+						else if (digit)
+							nstate = num::exponent;
+						else
+							unexpected(c);
+						break;
+					case num::exp_sign:
+						if (!digit)
+							unexpected(c);
+						nstate = num::exponent;
+						break;
+					case num::exponent:
+						if (!digit)
+							return end_number(), false;
+						break;
+				}
+				if (capture)
+					token += c;
+				return true;
+			}
+			case st::literal:
+				if (c != literal[pos])
+					unexpected(c);
+				if (capture)
+					token += c;
+				if (++pos == literal.size())
+					end_value();
+				return true;
+			case st::end:
+				if (!space(c))
+					unexpected(c);
+				return true;
+		}
+		return true;
+	}
+};
+
+// the options of a session
+struct options {
+	stop_conditions stop{};
+	bool            validate_json{false};
+	json_schema     schema{};
+	std::size_t     retries{0};
+	bool            emit_tools{false};
+};
+
+// a tool call assembled from streamed deltas
+struct tool_call {
+	std::string id{};
+	std::string type{};
+	std::string name{};
+	std::string arguments{};
+	bool        complete{false};
+	bool        emitted{false};
+};
+
+struct reply {
+	reply(ryml::NodeRef node, options const& opts) noexcept
+	    : node{node}, stop{&opts.stop}, json{&opts.schema}, opts{&opts} {}
+
+	ryml::NodeRef          node;
+	std::string            content{};
+	std::vector<tool_call> calls{};
+	std::size_t    settled{0}; // content that can no longer be trimmed
+	std::size_t    printed{0};
+	stopper        stop;
+	json_validator json;
+	std::string    failed{}; // validation error, if any
+
+	// advances settled to end, validating the new content
+	void
+	settle(std::size_t end) {
+		if (opts->validate_json && failed.empty()) {
+			try {
+				json.feed(std::string_view{content}.substr(settled, end - settled));
+			} catch (std::runtime_error const& e) {
+				failed       = e.what();
+				stop.stopped = true;
+			}
+		}
+		settled = end;
+	}
+
+   private:
+	options const* opts;
+};
+
+// the retrieval of excerpts from a vector index for the last user message (-x|k|K)
+struct retrieval {
+	std::filesystem::path index{}; // without a suffix; empty if disabled
+	std::size_t           top{5};
+	std::size_t           tokens{1000};
+	std::string           message{}; // sent before the last user message, if any
+};
+
+// the cache of responses to requests that differ only by a similar last user message (-C)
+struct semantic_cache {
+	float                      threshold{0}; // the similarity of a hit; 0 if disabled
+	std::filesystem::path      dir{};        // of the requests with the same rest
+	std::string                query{};      // the normalized last user message
+	std::vector<float>         vector{};     // its embedding, once looked up
+	std::optional<std::string> hit{};        // the cached response, if found
+	std::string                response{};   // of the transfer, to cache
+	bool                       looked_up{false};
+	bool                       replayed{false};
+};
+
+// the state of a session. heap-allocated, so replies may point into the options.
+struct state {
+	options                       opts{};
+	retrieval                     rag{};
+	semantic_cache                cache{};
+	std::string                   key{};
+	std::string                   org{};
+	std::size_t                   attempts{0};
+	std::string                   error{}; // set if the final attempt failed validation
+	std::optional<plugin::tokens> usage_reported{};
+	std::string                   model_reported{};
+	std::vector<reply>            replies{};
+	std::string                   reply_buf{};
+	std::string                   post_buf{};
+	std::optional<std::string>    resumed{}; // the unfinished content, if resuming
+};
+
+// sent after the unfinished reply when resuming; not stored in the context
+inline static constexpr std::string_view resume_prompt =
+    "Continue your previous reply exactly where it was cut off. "
+    "Do not repeat any of it or add any commentary.";
+
+// marks assistant messages that have not finished. stripped from the postdata.
+inline static constexpr ryml::csubstr partial = "partial";
+
+inline static void
+mark_finished(ryml::NodeRef node) {
+	if (node.has_child(partial))
+		node.remove_child(partial);
+}
+
+// reads an optional string property, treating null as empty
+[[nodiscard]] inline static bool
+read_opt(ryml::ConstNodeRef parent, ryml::csubstr key, std::string* out) {
+	if (!parent.has_child(key))
+		return true;
+	auto v = parent[key];
+	if (v.has_val() && v.val_is_null())
+		return true;
+	return v.has_val() && ryml::read(v, out);
+}
+
+// formats a completed tool call as a line of JSON
+[[nodiscard]] inline static std::string
+emit_tool_call(std::size_t index, tool_call& c) {
+	ryml::Tree    t;
+	ryml::NodeRef root = t.rootref();
+	root |= ryml::MAP;
+	root["index"] << index;
+	root["id"] |= ryml::VALQUO;
+	root["id"] << c.id;
+	root["name"] |= ryml::VALQUO;
+	root["name"] << c.name;
+	root["arguments"] |= ryml::VALQUO;
+	root["arguments"] << c.arguments;
+	c.emitted = true;
+	return ryml::emitrs_json<std::string>(t) + '\n';
+}
+
+[[nodiscard]] inline static std::size_t
+parse_count(std::string_view opt, std::string const& v) {
+	std::size_t n;
+	try {
+		std::size_t end;
+		n = std::stoull(v, &end);
+		if (end != v.size() || v.front() == '-')
+			throw std::invalid_argument{v};
+	} catch (std::exception const&) {
+		throw std::runtime_error{std::string{opt} + " must be a positive integer"};
+	}
+	if (n == 0)
+		throw std::runtime_error{std::string{opt} + " must be a positive integer"};
+	return n;
+}
+
+// continues the unfinished reply in node
+inline static void
+continue_reply(state& st, ryml::NodeRef node) {
+	reply r{node, st.opts};
+	if (!read_opt(node, "content", &r.content))
+		throw std::runtime_error{"the unfinished reply has invalid content"};
+	st.resumed = r.content;
+	r.printed  = r.content.size();
+	r.settle(r.content.size());
+	st.replies.push_back(std::move(r));
+}
+
+// a delta of the reply content from printed to end, located in the context
+[[nodiscard]] inline static plugin::event
+content_delta(std::size_t idx, reply& r, std::size_t end) {
+	plugin::event e{plugin::event::kind::delta, idx, r.content.substr(r.printed, end - r.printed)};
+	e.message = r.node.parent().child_pos(r.node);
+	e.offset  = r.printed;
+	r.printed = end;
+	return e;
+}
+
+// number of choices requested by the context
+[[nodiscard]] inline static unsigned
+num_choices(ryml::ConstNodeRef root) {
+	unsigned n = 1;
+	if (root.has_child("n") && root["n"].has_val())
+		root["n"] >> n;
+	return n;
+}
+
+// the content of the last user message, if any
+[[nodiscard]] inline static std::optional<std::string>
+last_user_message(ryml::ConstNodeRef root) {
+	if (!root.has_child("messages") || !root["messages"].is_seq())
+		return std::nullopt;
+	std::optional<std::string> res;
+	for (auto&& m : root["messages"]) {
+		std::string content;
+		if (m.is_map() && m.has_child("role") && m["role"].val() == "user" &&
+		    read_opt(m, "content", &content))
+			res = std::move(content);
+	}
+	return res;
+}
+
+inline static constexpr std::string_view excerpts_intro =
+    "Excerpts that may be relevant to the next message, most relevant first:\n\n";
+
+// the model and dimensions of the index at base, as set by the context of its embed
+// plugin (BASE.yml), if any
+inline static void
+read_index_model(std::filesystem::path base, std::string& model, std::string& dims) {
+	if (std::ifstream f{base += ".yml"}) {
+		std::string data{std::istreambuf_iterator<char>{f}, {}};
+		auto        tree = ryml::parse_in_arena(ryml::csubstr{data.data(), data.size()});
+		auto        root = tree.crootref();
+		if (root.is_map() && root.has_child("model"))
+			root["model"] >> model;
+		if (root.is_map() && root.has_child("dimensions"))
+			root["dimensions"] >> dims;
+	}
+}
+
+// the number of clusters of a vector index to search ($LLMQ_NPROBE, as for llmq nearest)
+[[nodiscard]] inline static std::size_t
+nprobe() {
+	char const* env = std::getenv("LLMQ_NPROBE");
+	if (!env)
+		return 32;
+	std::size_t n;
+	auto [ptr, ec] = std::from_chars(env, env + std::strlen(env), n);
+	if (ec != std::errc{} || *ptr || !n)
+		throw std::runtime_error{"$LLMQ_NPROBE must be a positive integer"};
+	return n;
+}
+
+// retrieves the excerpts of the index nearest to the embedding of the last user message
+// into the message of the retrieval, up to about rag.tokens tokens (4 bytes each)
+inline static void
+retrieve(retrieval& rag, std::span<float const> v) {
+	vector_index index{rag.index};
+	if (!index.size())
+		throw std::runtime_error{"the vector index " + rag.index.string() + " is empty"};
+	std::string excerpts;
+	std::size_t budget = rag.tokens * 4;
+	for (auto h : index.search(v, rag.top, nprobe())) {
+		auto text = index.text(h.id);
+		if (excerpts.size() + text.size() > budget) {
+			if (!excerpts.empty())
+				break;
+			// the first excerpt is cut to the budget, at a character boundary
+			std::size_t n = budget;
+			while (n && ((unsigned char)text[n] & 0xC0) == 0x80)
+				--n;
+			excerpts = text.substr(0, n);
+			break;
+		}
+		(excerpts += text) += "\n\n";
+	}
+	while (excerpts.ends_with('\n'))
+		excerpts.pop_back();
+	rag.message = std::string{excerpts_intro} + excerpts;
+}
+
+// the lowercase text with runs of whitespace collapsed, so that trivial differences
+// between requests do not miss the cache
+[[nodiscard]] inline static std::string
+normalize_query(std::string_view text) {
+	std::string res;
+	for (char c : text) {
+		if (std::isspace((unsigned char)c)) {
+			if (!res.empty() && res.back() != ' ')
+				res += ' ';
+		} else {
+			res += (char)std::tolower((unsigned char)c);
+		}
+	}
+	if (res.ends_with(' '))
+		res.pop_back();
+	return res;
+}
+
+// sets up the semantic cache of the request: its query is the normalized last user
+// message, and its directory is named by a hash of the rest of the request (the context
+// without that message, and the index of -x). false if there is no user message.
+[[nodiscard]] inline static bool
+scope_cache(semantic_cache& c, ryml::Tree const& ctx, retrieval const& rag) {
+	ryml::Tree    rest = ctx;
+	ryml::NodeRef root = rest.rootref();
+	if (!root.has_child("messages") || !root["messages"].is_seq())
+		return false;
+	auto                       msgs = root["messages"];
+	std::optional<std::size_t> pos;
+	std::string                content;
+	for (std::size_t i = 0; i < msgs.num_children(); ++i)
+		if (auto m = msgs[i]; m.is_map() && m.has_child("role") && m["role"].val() == "user")
+			pos = i;
+	if (!pos || !read_opt(msgs[*pos], "content", &content))
+		return false;
+	c.query = normalize_query(content);
+	if (c.query.empty())
+		return false;
+	rest.remove(msgs[*pos].id());
+	auto scope = ryml::emitrs_json<std::string>(rest);
+	(scope += '\n') += rag.index.string();
+	c.dir = cache_dir("gpt/semantic") / hash_name(scope);
+	return true;
+}
+
+// looks up the response to the query nearest to the embedding of the normalized last
+// user message, if similar enough
+inline static void
+look_up(semantic_cache& c, std::span<float const> v) {
+	c.vector.assign(v.begin(), v.end());
+	vector_index index{c.dir / "queries"};
+	if (!index.size() || index.dims() != v.size())
+		return;
+	auto hits = index.search(v, 1, nprobe());
+	if (hits.empty() || hits.front().score < c.threshold)
+		return;
+	auto name = hash_name(index.text(hits.front().id));
+	if (std::ifstream f{c.dir / name})
+		c.hit = std::string{std::istreambuf_iterator<char>{f}, {}};
+}
+
+// caches the response of the transfer under the query. the cache is only an
+// optimization, so failures are ignored.
+inline static void
+store(semantic_cache& c) noexcept {
+	try {
+		// the response is in place before the query can find it
+		std::filesystem::create_directories(c.dir);
+		auto name = hash_name(c.query);
+		auto tmp  = c.dir / (name + '.' + std::to_string(::getpid()));
+		{
+			std::ofstream f{tmp, std::ios::binary};
+			if (!f.write(c.response.data(), c.response.size()))
+				return;
+		}
+		std::filesystem::rename(tmp, c.dir / name);
+		std::string_view query{c.query};
+		vector_index::append(c.dir / "queries", {&query, 1}, c.vector, c.vector.size());
+	} catch (std::exception const&) {
+	}
+}
+
+// embeds the last user message (for the retrieval or the semantic cache), and hands the
+// embedding to found
+struct embedding : plugin::session {
+	embedding(state& st, std::string query, std::string model, std::string dims,
+	          std::function<void(std::span<float const>)> found)
+	    : st{st},
+	      query{std::move(query)},
+	      model{std::move(model)},
+	      dims{std::move(dims)},
+	      found{std::move(found)} {}
+
+	[[nodiscard]] ryml::Tree const&
+	context() const noexcept override {
+		return empty;
+	}
+
+	[[nodiscard]] std::string_view
+	url() const noexcept override {
+		return embeddings::endpoint;
+	}
+
+	void
+	append_headers(std::function<void(std::string_view)> append) const noexcept override {
+		embeddings::append_headers(st.key, st.org, append);
+	}
+
+	[[nodiscard]] std::optional<std::string_view>
+	post() const override {
+		std::string_view input{query};
+		post_buf = embeddings::body(model, dims, {&input, 1});
+		return {post_buf};
+	}
+
+	void
+	consume(std::span<char const> chunk, std::vector<plugin::event>&) override {
+		response.append(chunk.data(), chunk.size());
+	}
+
+	// reads the usage from the response, once complete
+	[[nodiscard]] std::optional<plugin::tokens>
+	spent() const override {
+		return embeddings::usage(response, model);
+	}
+
+	void
+	interrupt() override {
+		interrupted = true;
+	}
+
+	void
+	onfinish(std::vector<plugin::event>& events) override {
+		if (interrupted)
+			return;
+		std::size_t width = 0;
+		found(embeddings::read(response, 1, dims, width));
+
+		if (auto t = spent())
+			events.push_back({plugin::event::kind::usage, 0, {}, *t});
+	}
+
+   private:
+	state&                                      st;
+	std::string                                 query;
+	std::string                                 model;
+	std::string                                 dims;
+	std::function<void(std::span<float const>)> found;
+	ryml::Tree                                  empty{};
+	mutable std::string                         post_buf{};
+	std::string                                 response{};
+	bool                                        interrupted{false};
+};
 } // namespace impl
 
 [[nodiscard]] std::string_view
@@ -126,9 +1124,13 @@ gpt::descr() const noexcept {
 	return impl::descr;
 }
 
-void
-gpt::init(ryml::Tree ctx_, std::span<arg const> args, std::string auth) {
-	ctx = std::move(ctx_);
+[[nodiscard]] std::unique_ptr<plugin::session>
+gpt::init(ryml::Tree context, std::span<arg const> args, std::string auth) const {
+	return std::make_unique<session>(std::move(context), args, std::move(auth));
+}
+
+gpt::session::session(ryml::Tree ctx_, std::span<arg const> args, std::string auth)
+    : ctx{std::move(ctx_)}, st{std::make_unique<impl::state>()} {
 	ryml::Tree authyaml;
 	try {
 		authyaml = ryml::parse_in_place(ryml::substr{auth.data(), auth.size()});
@@ -141,9 +1143,9 @@ gpt::init(ryml::Tree ctx_, std::span<arg const> args, std::string auth) {
 		throw std::runtime_error{"authfile must be a YAML map with properties \"key\" and "
 		                         "optionally \"org\""};
 	try {
-		authroot["key"] >> impl::key;
+		authroot["key"] >> st->key;
 		if (!authroot["org"].is_seed())
-			authroot["org"] >> impl::org;
+			authroot["org"] >> st->org;
 	} catch (std::exception const& e) {
 		throw std::runtime_error("could not parse authentication data: " +
 		                         std::string{e.what()});
@@ -157,7 +1159,7 @@ gpt::init(ryml::Tree ctx_, std::span<arg const> args, std::string auth) {
 
 	for (auto&& [n, v] : args) {
 		if (n == 'h')
-			exit((std::cout << help() << '\n', 0));
+			exit((std::cout << impl::help << '\n', 0));
 
 		if (n != 0 && v.empty())
 			throw std::runtime_error{"invalid flag: " + (std::isalpha(n)
@@ -198,6 +1200,57 @@ gpt::init(ryml::Tree ctx_, std::span<arg const> args, std::string auth) {
 			}
 		} else if (n == 'U') {
 			root["user"] << v;
+		} else if (n == 'R') {
+			try {
+				st->opts.stop.regex.emplace_back(v);
+			} catch (std::regex_error const& e) {
+				throw std::runtime_error{"invalid stop-regex \"" + v + "\": " + e.what()};
+			}
+		} else if (n == 'E') {
+			if (v == "fence")
+				st->opts.stop.on = impl::stop_on::fence;
+			else if (v == "json")
+				st->opts.stop.on = impl::stop_on::json;
+			else
+				throw std::runtime_error{"stop-on must be one of: fence, json"};
+		} else if (n == 'B') {
+			st->opts.stop.max_bytes = impl::parse_count("max-bytes", v);
+		} else if (n == 'N') {
+			st->opts.stop.max_lines = impl::parse_count("max-lines", v);
+		} else if (n == 'j') {
+			if (v != "true" && v != "false")
+				throw std::runtime_error{"json must be one of: true, false"};
+			st->opts.validate_json = v == "true";
+		} else if (n == 'Y') {
+			std::ifstream f{v};
+			if (!f)
+				throw std::runtime_error{"could not open json-schema \"" + v + "\""};
+			std::string data{std::istreambuf_iterator<char>{f}, {}};
+			auto        tree = ryml::parse_in_arena(ryml::csubstr{data.data(), data.size()});
+			st->opts.schema = impl::json_schema{tree.crootref()};
+			st->opts.validate_json = true;
+		} else if (n == 'r') {
+			st->opts.retries = impl::parse_count("retries", v);
+		} else if (n == 'O') {
+			if (v != "true" && v != "false")
+				throw std::runtime_error{"emit-tools must be one of: true, false"};
+			st->opts.emit_tools = v == "true";
+		} else if (n == 'x') {
+			st->rag.index = v;
+			// the path of any file of the index (or its context) names it
+			for (auto suffix : {".yml", ".vec", ".txt", ".ivf"})
+				if (st->rag.index.extension() == suffix)
+					st->rag.index.replace_extension();
+		} else if (n == 'k') {
+			st->rag.top = impl::parse_count("index-top", v);
+		} else if (n == 'K') {
+			st->rag.tokens = impl::parse_count("index-tokens", v);
+		} else if (n == 'C') {
+			float t = 0;
+			auto [ptr, ec] = std::from_chars(v.data(), v.data() + v.size(), t);
+			if (ec != std::errc{} || ptr != v.data() + v.size() || !(t > 0 && t <= 1))
+				throw std::runtime_error{"semantic-cache must be a number in (0, 1]"};
+			st->cache.threshold = t;
 		} else if (n == 's') {
 			add_message("system", v);
 		} else if (n == 'g') {
@@ -212,28 +1265,78 @@ gpt::init(ryml::Tree ctx_, std::span<arg const> args, std::string auth) {
 	}
 }
 
+gpt::session::~session() = default;
+
 [[nodiscard]] ryml::Tree const&
-gpt::context() const noexcept {
+gpt::session::context() const noexcept {
 	return ctx;
 }
 
 [[nodiscard]] std::string_view
-gpt::url() const noexcept {
+gpt::session::url() const noexcept {
 	return "https://api.openai.com/v1/chat/completions";
 }
 
 void
-gpt::append_headers(std::function<void(std::string_view)> append) const noexcept {
+gpt::session::append_headers(std::function<void(std::string_view)> append) const noexcept {
 	append("Content-Type: application/json");
-	append("Authorization: Bearer " + impl::key);
-	if (!impl::org.empty())
-		append("OpenAI-Organization: " + impl::org);
+	append("Authorization: Bearer " + st->key);
+	if (!st->org.empty())
+		append("OpenAI-Organization: " + st->org);
 }
 
 [[nodiscard]] std::optional<std::string_view>
-gpt::post() const {
-	impl::post_buf = ryml::emitrs_json<std::string>(ctx);
-	return {impl::post_buf};
+gpt::session::post() const {
+	auto root = ctx.crootref();
+
+	bool partial = false;
+	if (root.has_child("messages") && root["messages"].is_seq())
+		for (auto&& m : root["messages"])
+			partial |= m.is_map() && m.has_child(impl::partial);
+
+	// request usage in the final chunk of streamed replies (for the ledger)
+	bool usage = root.has_child("stream") && root["stream"].val() == "true" &&
+	             !root.has_child("stream_options");
+
+	if (partial || st->resumed || !st->rag.message.empty() || usage) {
+		// the postdata differs from the context, so it is emitted from a copy
+		ryml::Tree post = ctx;
+		auto       msgs = post.rootref()["messages"];
+		if (usage) {
+			auto opts = post.rootref()["stream_options"];
+			opts |= ryml::MAP;
+			opts["include_usage"] << "true";
+		}
+		// strip the finish markers and ask to continue the unfinished reply
+		if (partial)
+			for (auto&& m : msgs.children())
+				impl::mark_finished(m);
+		// send the excerpts retrieved for the last user message before it
+		if (!st->rag.message.empty()) {
+			std::size_t pos = 0;
+			for (std::size_t i = 0; i < msgs.num_children(); ++i)
+				if (auto c = msgs[i]; c.is_map() && c.has_child("role") && c["role"].val() == "user")
+					pos = i;
+			auto m = pos ? msgs.insert_child(msgs[pos - 1]) : msgs.prepend_child();
+			m |= ryml::MAP;
+			m["role"] << "system";
+			m["content"] |= ryml::VALQUO;
+			m["content"] << ryml::csubstr{st->rag.message.data(), st->rag.message.size()};
+		}
+		if (st->resumed) {
+			auto m = msgs.append_child();
+			m |= ryml::MAP;
+			m["role"] << "user";
+			m["content"] |= ryml::VALQUO;
+			m["content"] << ryml::csubstr{impl::resume_prompt.data(),
+			                              impl::resume_prompt.size()};
+		}
+		st->post_buf = ryml::emitrs_json<std::string>(post);
+	} else {
+		st->post_buf = ryml::emitrs_json<std::string>(ctx);
+	}
+
+	return {st->post_buf};
 }
 
 [[nodiscard]] inline static constexpr std::string_view
@@ -274,43 +1377,367 @@ static_assert(find_json(" foo: {\"a\": \"b: {\"}  bar ") == "{\"a\": \"b: {\"}")
 static_assert(find_json(" foo: {\"a\": \"b: }\"}  bar ") == "{\"a\": \"b: }\"}");
 
 void
-gpt::onreply(std::string_view reply, bool print) {
-	impl::reply_buf += reply;
+gpt::session::consume(std::span<char const> chunk, std::vector<event>& events) {
+	st->reply_buf.append(chunk.data(), chunk.size());
+	if (!st->cache.vector.empty() && !st->cache.replayed)
+		st->cache.response.append(chunk.data(), chunk.size());
+
+	for (;;) {
+		std::string json;
 
-	std::string json;
+		{
+			auto jview = find_json(st->reply_buf);
+			if (jview.empty())
+				return; // wait for more chunks
+			json = jview;
+			// erase this json (jview invalidated!)
+			st->reply_buf.erase(0, jview.data() + jview.size() - st->reply_buf.data());
+		}
 
-	{
-		auto jview = find_json(impl::reply_buf);
-		if (jview.empty())
-			return; // wait for more chunks
-		json = jview;
-		// erase this json (jview invalidated!)
-		impl::reply_buf.erase(0, jview.data() + jview.size() - impl::reply_buf.data());
+		integrate(std::move(json), events);
+	}
+}
+
+[[nodiscard]] bool
+gpt::session::done() const noexcept {
+	if (std::ranges::any_of(st->replies, [](auto const& r) {
+		    return !r.failed.empty();
+	    }))
+		return true;
+	if (st->replies.size() < impl::num_choices(ctx.rootref()))
+		return false;
+	return std::ranges::all_of(st->replies, [](auto const& r) {
+		return r.stop.stopped;
+	});
+}
+
+[[nodiscard]] std::optional<plugin::tokens>
+gpt::session::spent() const {
+	std::optional<tokens> res = st->usage_reported;
+
+	// estimate if the transfer was aborted or usage was not requested
+	if (!res) {
+		if (st->replies.empty())
+			return std::nullopt;
+		res.emplace();
+		res->estimated = true;
+		res->prompt    = st->post_buf.size() / 4;
+		for (auto&& r : st->replies) {
+			res->completion += r.content.size() / 4;
+			if (&r == &st->replies.front() && st->resumed)
+				res->completion -= st->resumed->size() / 4;
+			for (auto&& c : r.calls)
+				res->completion += (c.name.size() + c.arguments.size()) / 4;
+		}
+	}
+
+	if (!st->model_reported.empty())
+		res->model = st->model_reported;
+	else if (ctx.crootref().has_child("model"))
+		ctx.crootref()["model"] >> res->model;
+	return res;
+}
+
+bool
+gpt::session::resume() {
+	auto root = ctx.rootref();
+	if (!root.has_child("messages") || !root["messages"].is_seq() ||
+	    root["messages"].empty())
+		return false;
+
+	auto last = root["messages"].last_child();
+	if (!last.is_map() || !last.has_child(impl::partial) || !last.has_child("role") ||
+	    last["role"].val() != "assistant")
+		return false;
+	if (impl::num_choices(root) != 1)
+		throw std::runtime_error{"cannot resume a reply with n > 1"};
+	if (last.has_child("tool_calls"))
+		throw std::runtime_error{"cannot resume a reply with tool calls"};
+
+	impl::continue_reply(*st, last);
+	return true;
+}
+
+// embeds the last user message to retrieve excerpts for it (if an index is given) and
+// to look it up in the semantic cache (if enabled, and not resuming)
+std::vector<std::unique_ptr<plugin::session>>
+gpt::session::prepare() {
+	st->rag.message.clear();
+	st->cache = {.threshold = st->cache.threshold};
+	auto query = impl::last_user_message(ctx.crootref());
+	if (!query || query->empty())
+		return {};
+	std::vector<std::unique_ptr<plugin::session>> deps;
+	if (!st->rag.index.empty()) {
+		std::string model{"text-embedding-3-small"}, dims;
+		impl::read_index_model(st->rag.index, model, dims);
+		deps.push_back(std::make_unique<impl::embedding>(
+		    *st, *query, std::move(model), std::move(dims),
+		    [rag = &st->rag](std::span<float const> v) {
+			    impl::retrieve(*rag, v);
+		    }));
+	}
+	if (st->cache.threshold > 0 && !st->resumed &&
+	    impl::scope_cache(st->cache, ctx, st->rag)) {
+		deps.push_back(std::make_unique<impl::embedding>(
+		    *st, st->cache.query, "text-embedding-3-small", "",
+		    [cache = &st->cache](std::span<float const> v) {
+			    impl::look_up(*cache, v);
+		    }));
+	}
+	return deps;
+}
+
+// replays the response cached for a similar request once, before the first transfer
+std::optional<bool>
+gpt::session::cached(std::string& response) {
+	auto& c = st->cache;
+	c.response.clear();
+	if (c.vector.empty() || std::exchange(c.looked_up, true))
+		return std::nullopt;
+	if (!c.hit)
+		return false;
+	response   = std::move(*c.hit);
+	c.replayed = true;
+	c.hit.reset();
+	return true;
+}
+
+bool
+gpt::session::awaiting() const {
+	auto root = ctx.crootref();
+	if (!root.has_child("messages") || !root["messages"].is_seq() ||
+	    root["messages"].empty())
+		return false;
+
+	// unfinished replies are continued by resume, not answered
+	auto last = root["messages"].last_child();
+	if (!last.is_map() || !last.has_child("role") || last.has_child(impl::partial))
+		return false;
+	auto role = last["role"].val();
+	return role == "user" || role == "tool";
+}
+
+std::vector<ryml::Tree>
+gpt::session::choices() const {
+	if (st->replies.size() < 2)
+		return {ctx};
+
+	// each choice keeps its own reply, and n no longer applies
+	auto                     msgs = ctx.crootref()["messages"];
+	std::vector<std::size_t> pos;
+	for (auto&& r : st->replies)
+		pos.push_back(msgs.child_pos(r.node));
+	std::ranges::sort(pos, std::greater{});
+
+	std::vector<ryml::Tree> res;
+	for (auto&& r : st->replies) {
+		ryml::Tree    tree = ctx;
+		ryml::NodeRef root = tree.rootref();
+		ryml::NodeRef m    = root["messages"];
+		for (auto p : pos)
+			if (p != msgs.child_pos(r.node))
+				m.remove_child(p);
+		if (root.has_child("n"))
+			root.remove_child("n");
+		res.push_back(std::move(tree));
+	}
+	return res;
+}
+
+void
+gpt::session::interrupt() {
+	// the remaining deltas will never arrive
+	st->reply_buf.clear();
+	for (auto&& r : st->replies)
+		if (r.node.has_child(impl::partial))
+			r.node[impl::partial] << "interrupted";
+}
+
+std::optional<plugin::tokens>
+gpt::session::estimate() const {
+	auto   root = ctx.crootref();
+	tokens res{};
+	res.estimated = true;
+	if (root.has_child("model"))
+		root["model"] >> res.model;
+
+	// the postdata is a close upper bound of the prompt
+	res.prompt = (ryml::emitrs_json<std::string>(ctx).size() + st->rag.message.size()) / 4;
+
+	// replies are capped by max_tokens; otherwise assume a long reply
+	std::uint64_t max = 1024;
+	if (root.has_child("max_tokens") && root["max_tokens"].has_val())
+		root["max_tokens"] >> max;
+	res.completion = max * impl::num_choices(root);
+	return res;
+}
+
+void
+gpt::session::onend() {
+	for (auto&& r : st->replies) {
+		complete_tool_calls(r, r.calls.size(), nullptr);
+
+		// the last line of each reply has not been checked for stop conditions
+		if (!r.stop.stopped) {
+			if (auto cut = r.stop.flush(r.content)) {
+				r.content.resize(std::max(*cut, r.settled));
+				r.stop.stopped = true;
+				r.node["content"] << r.content;
+				impl::mark_finished(r.node);
+			}
+		}
+		r.settle(r.content.size());
+		if (st->opts.validate_json && r.failed.empty()) {
+			try {
+				r.json.finish();
+			} catch (std::runtime_error const& e) {
+				r.failed = e.what();
+			}
+		}
+	}
+}
+
+[[nodiscard]] bool
+gpt::session::retry() {
+	auto failed = std::ranges::find_if(st->replies, [](auto const& r) {
+		return !r.failed.empty();
+	});
+	if (failed == st->replies.end())
+		return false;
+
+	// discard the invalid replies so that the context is as it was before the request
+	// (the resumed reply is restored to its unfinished state instead)
+	st->error           = failed->failed;
+	ryml::NodeRef resumed = st->replies.front().node;
+	for (std::size_t i = st->resumed.has_value(); i < st->replies.size(); ++i)
+		ctx.remove(st->replies[i].node.id());
+	st->replies.clear();
+	st->reply_buf.clear();
+	st->usage_reported.reset();
+	if (st->resumed) {
+		resumed["content"] << *st->resumed;
+		resumed[impl::partial] << "true";
+		impl::continue_reply(*st, resumed);
+	}
+
+	if (st->attempts++ < st->opts.retries) {
+		st->error.clear();
+		return true;
+	}
+	return false;
+}
+
+void
+gpt::session::onfinish(std::vector<event>& events) {
+	if (!st->error.empty())
+		throw std::runtime_error{st->error};
+
+	// only replies that finished by themselves are cached
+	if (!st->cache.vector.empty() && !st->cache.replayed && !st->cache.response.empty() &&
+	    !st->replies.empty() && std::ranges::none_of(st->replies, [](auto const& r) {
+		    return r.stop.stopped || r.node.has_child(impl::partial);
+	    }))
+		impl::store(st->cache);
+
+	// output anything held back by -R or -r
+	if (impl::num_choices(ctx.rootref()) == 1) {
+		for (std::size_t idx = 0; idx < st->replies.size(); ++idx) {
+			auto& r = st->replies[idx];
+			if (r.printed < r.content.size())
+				events.push_back(impl::content_delta(idx, r, r.content.size()));
+			if (st->opts.emit_tools)
+				for (std::size_t i = 0; i < r.calls.size(); ++i)
+					if (!r.calls[i].emitted)
+						events.push_back(
+						    {event::kind::delta, idx, impl::emit_tool_call(i, r.calls[i])});
+		}
+	}
+
+	unsigned n;
+	auto     root = ctx.rootref();
+
+	if (!root["n"].has_val()) {
+		events.push_back({event::kind::delta, 0, "\n"});
+		return;
+	}
+
+	root["n"] >> n;
+
+	if (n == 1) {
+		events.push_back({event::kind::delta, 0, "\n"});
+		return;
+	}
+
+	ryml::Tree    msgs_data;
+	ryml::NodeRef msgs = msgs_data.rootref();
+	msgs |= ryml::SEQ;
+	auto len = root["messages"].num_children();
+	if (root["messages"].is_seed() || len < n)
+		throw std::runtime_error{"invalid response: expected at least " +
+		                         std::to_string(n) + " messages"};
+	for (std::size_t i = 0; i < n; ++i) {
+		auto node = msgs.append_child();
+		auto m    = root["messages"][(len - n) + i];
+		if (m.is_seed() || m["role"].is_seed() || m["content"].is_seed())
+			throw std::runtime_error{"invalid response: expected messages to have "
+			                         "\"role\" and \"content\" "};
+		std::string role;
+		m["role"] >> role;
+		if (role != "assistant")
+			throw std::runtime_error{
+			    "invalid role: expected \"assistant\", received \"" + role + "\""};
+		std::string content;
+		m["content"] >> content;
+		node << content;
 	}
 
+	events.push_back({event::kind::delta, 0, ryml::emitrs_json<std::string>(msgs_data) + '\n'});
+}
+
+void
+gpt::session::integrate(std::string json, std::vector<event>& events) {
 	ryml::Tree    reply_tree = ryml::parse_in_place(ryml::substr{json.data(), json.size()});
 	ryml::NodeRef root       = reply_tree.rootref();
 
-	bool actually_print;
-	if (print) {
-		if (ctx.rootref()["n"].has_val()) {
-			unsigned n;
-			ctx.rootref()["n"] >> n;
-			actually_print = n == 1;
-		} else
-			actually_print = true;
-	} else
-		actually_print = false;
+	// output is held back until onfinish if it cannot be streamed
+	std::vector<event>* live = impl::num_choices(ctx.rootref()) == 1 &&
+	                                   !(st->opts.validate_json && st->opts.retries)
+	                               ? &events
+	                               : nullptr;
+
+	if (!root["model"].is_seed() && root["model"].has_val())
+		root["model"] >> st->model_reported;
+
+	if (auto u = root["usage"]; !u.is_seed() && u.is_map()) {
+		plugin::tokens t;
+		if (!ryml::read(u["prompt_tokens"], &t.prompt) ||
+		    !ryml::read(u["completion_tokens"], &t.completion))
+			throw std::runtime_error("invalid response: " + std::string{json});
+		if (auto d = u["prompt_tokens_details"]; !d.is_seed() && d.is_map() &&
+		                                         !d["cached_tokens"].is_seed() &&
+		                                         !ryml::read(d["cached_tokens"], &t.cached))
+			throw std::runtime_error("invalid response: " + std::string{json});
+		st->usage_reported = t;
+		events.push_back({event::kind::usage, 0, {}, t});
+	}
 
 	auto choices = root["choices"];
-	if (!choices.is_seed() && choices.is_seq() && !choices.empty()) {
+	if (!choices.is_seed() && choices.is_seq() && choices.empty() &&
+	    st->usage_reported) {
+		// the final usage chunk of a stream
+	} else if (!choices.is_seed() && choices.is_seq() && !choices.empty()) {
 		for (std::size_t i = 0; i < choices.num_children(); ++i) {
 			std::size_t idx;
 			if (choices[i]["index"].is_seed() || !ryml::read(choices[i]["index"], &idx))
 				throw std::runtime_error("invalid response: " + std::string{json});
 
-			while (idx >= impl::replies.size())
-				impl::replies.push_back(add_message("", ""));
+			while (idx >= st->replies.size()) {
+				st->replies.emplace_back(add_message("", ""), st->opts);
+				st->replies.back().node[impl::partial] << "true";
+			}
+
+			auto& r = st->replies[idx];
 
 			std::string role;
 			std::string content;
@@ -323,96 +1750,157 @@ gpt::onreply(std::string_view reply, bool print) {
 					throw std::runtime_error("invalid response: " +
 					                         std::string{json});
 
-				if (!delta["content"].is_seed() &&
-				    !ryml::read(delta["content"], &content))
+				if (!impl::read_opt(delta, "content", &content))
+					throw std::runtime_error("invalid response: " +
+					                         std::string{json});
+
+				if (!delta["tool_calls"].is_seed() &&
+				    !integrate_tool_calls(r, delta["tool_calls"], live))
 					throw std::runtime_error("invalid response: " +
 					                         std::string{json});
 
 				if (delta["role"].is_seed()) {
-					if (impl::replies[idx]["role"].empty())
+					if (r.node["role"].empty())
 						throw std::runtime_error(
 						    "never received role; last "
 						    "received: " +
 						    std::string{json});
 					else
-						impl::replies[idx]["role"] >> role;
+						r.node["role"] >> role;
 				}
 			} else {
 				auto msg = choices[i]["message"];
 				if (msg.is_seed() || !msg.is_map() ||
 				    !ryml::read(msg["role"], &role) ||
-				    !ryml::read(msg["content"], &content))
+				    !impl::read_opt(msg, "content", &content) ||
+				    (!msg["tool_calls"].is_seed() &&
+				     !integrate_tool_calls(r, msg["tool_calls"], live)))
 					throw std::runtime_error("invalid response: " +
 					                         std::string{json});
 			}
 
-			if (actually_print)
-				std::cout << content << std::flush;
-
-			if (impl::replies[idx]["role"] != "" &&
-			    impl::replies[idx]["role"] != ryml::csubstr{role.data(), role.size()}) {
+			if (r.node["role"] != "" &&
+			    r.node["role"] != ryml::csubstr{role.data(), role.size()}) {
 				throw std::runtime_error("invalid response: " + std::string{json});
 			}
-			impl::replies[idx]["role"] << role;
-			std::string tmp;
-			impl::replies[idx]["content"] >> tmp;
-			tmp += content;
-			impl::replies[idx]["content"] |= ryml::VALQUO;
-			impl::replies[idx]["content"] << tmp;
+			r.node["role"] << role;
+
+			// the transfer may deliver a few more deltas before it is aborted
+			if (r.stop.stopped)
+				continue;
+
+			r.content += content;
+			if (auto cut = r.stop.scan(r.content)) {
+				r.content.resize(std::max(*cut, r.settled));
+				r.stop.stopped = true;
+				events.push_back({event::kind::finish, idx, "stop condition"});
+			}
+
+			// regex matches are only known once the line is complete
+			r.settle(r.stop.stopped || st->opts.stop.regex.empty()
+			             ? r.content.size()
+			             : std::max(r.stop.line, r.settled));
+
+			if (live && r.failed.empty() && r.printed < r.settled)
+				live->push_back(impl::content_delta(idx, r, r.settled));
+
+			if (r.content.empty() && !r.calls.empty()) {
+				// assistant messages with tool calls have null content if nothing was said
+				r.node["content"].set_type(ryml::KEYVAL);
+				r.node["content"] << "null";
+			} else {
+				r.node["content"] |= ryml::VALQUO;
+				r.node["content"] << r.content;
+			}
+
+			if (r.stop.stopped)
+				impl::mark_finished(r.node);
+
+			// a finish reason means that no more tool call deltas will follow
+			if (auto f = choices[i]["finish_reason"];
+			    !f.is_seed() && f.has_val() && !f.val_is_null()) {
+				complete_tool_calls(r, r.calls.size(), live);
+				events.push_back(
+				    {event::kind::finish, idx, std::string{f.val().str, f.val().len}});
+
+				// replies cut off by max_tokens may be resumed
+				if (f.val() != "length")
+					impl::mark_finished(r.node);
+			}
 		}
 	} else {
 		throw std::runtime_error("invalid response: " + std::string{json});
 	}
 }
 
-void
-gpt::onfinish(bool print) {
-	if (!print)
-		return;
+// appends each tool call fragment to the call at its index. returns false if invalid.
+bool
+gpt::session::integrate_tool_calls(impl::reply& r, ryml::ConstNodeRef calls,
+                                   std::vector<event>* live) {
+	if (!calls.is_seq())
+		return false;
+	for (auto&& c : calls) {
+		std::size_t idx = r.calls.size();
+		if (c.has_child("index") && !ryml::read(c["index"], &idx))
+			return false;
 
-	unsigned n;
-	auto     root = ctx.rootref();
+		// a new index means that the previous calls are complete
+		complete_tool_calls(r, idx, live);
+		if (idx >= r.calls.size())
+			r.calls.resize(idx + 1);
 
-	if (!root["n"].has_val()) {
-		std::cout << '\n';
-		return;
+		auto& call = r.calls[idx];
+		if (call.complete)
+			return false;
+
+		std::string id, type, name, arguments;
+		if (!impl::read_opt(c, "id", &id) || !impl::read_opt(c, "type", &type))
+			return false;
+		if (c.has_child("function")) {
+			auto f = c["function"];
+			if (!f.is_map() || !impl::read_opt(f, "name", &name) ||
+			    !impl::read_opt(f, "arguments", &arguments))
+				return false;
+		}
+		call.id += id;
+		call.type += type;
+		call.name += name;
+		call.arguments += arguments;
 	}
+	return true;
+}
 
-	root["n"] >> n;
+// persists (and optionally outputs) every incomplete tool call before index end
+void
+gpt::session::complete_tool_calls(impl::reply& r, std::size_t end, std::vector<event>* live) {
+	end = std::min(end, r.calls.size());
+	for (std::size_t i = 0; i < end; ++i) {
+		auto& call = r.calls[i];
+		if (call.complete)
+			continue;
+		call.complete = true;
 
-	if (n == 1) {
-		std::cout << '\n';
-		return;
-	}
+		auto calls = r.node["tool_calls"];
+		if (calls.is_seed())
+			calls |= ryml::SEQ;
+		auto c = calls.append_child();
+		c |= ryml::MAP;
+		c["id"] |= ryml::VALQUO;
+		c["id"] << call.id;
+		c["type"] << (call.type.empty() ? "function" : call.type);
+		auto f = c["function"];
+		f |= ryml::MAP;
+		f["name"] << call.name;
+		f["arguments"] |= ryml::VALQUO;
+		f["arguments"] << call.arguments;
 
-	ryml::Tree    msgs_data;
-	ryml::NodeRef msgs = msgs_data.rootref();
-	msgs |= ryml::SEQ;
-	auto len = root["messages"].num_children();
-	if (root["messages"].is_seed() || len < n)
-		throw std::runtime_error{"invalid response: expected at least " +
-		                         std::to_string(n) + " messages"};
-	for (std::size_t i = 0; i < n; ++i) {
-		auto node = msgs.append_child();
-		auto m    = root["messages"][(len - n) + i];
-		if (m.is_seed() || m["role"].is_seed() || m["content"].is_seed())
-			throw std::runtime_error{"invalid response: expected messages to have "
-			                         "\"role\" and \"content\" "};
-		std::string role;
-		m["role"] >> role;
-		if (role != "assistant")
-			throw std::runtime_error{
-			    "invalid role: expected \"assistant\", received \"" + role + "\""};
-		std::string content;
-		m["content"] >> content;
-		node << content;
+		if (live && st->opts.emit_tools)
+			live->push_back({event::kind::delta, 0, impl::emit_tool_call(i, call)});
 	}
-
-	std::cout << ryml::emitrs_json<std::string>(msgs_data) << '\n';
 }
 
 ryml::NodeRef
-gpt::add_message(std::string_view role, std::string_view content) {
+gpt::session::add_message(std::string_view role, std::string_view content) {
 	auto m = ctx.rootref()["messages"];
 	if (m.is_seed())
 		m |= ryml::SEQ;
@@ -425,3 +1913,5 @@ gpt::add_message(std::string_view role, std::string_view content) {
 }
 
 } // namespace llmq
+
+LLMQ_PLUGIN_EXPORT(::llmq::gpt)
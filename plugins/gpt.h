@@ -32,6 +32,11 @@
 
 namespace llmq {
 
+namespace impl {
+struct reply;
+struct state;
+} // namespace impl
+
 // usage: llmq ARGS... gpt[://CONTEXT] [OPTIONS]... [-sgu TAGMSG]... [USRMSG]...
 // a llmq plugin for the OpenAI Chat Completions endpoint.
 inline struct gpt : plugin {
@@ -41,17 +46,40 @@ inline struct gpt : plugin {
 	[[nodiscard]] std::string_view help() const noexcept override;
 	[[nodiscard]] std::string_view usage() const noexcept override;
 	[[nodiscard]] std::string_view descr() const noexcept override;
-	void init(ryml::Tree context, std::span<arg const> args, std::string auth) override;
-	[[nodiscard]] ryml::Tree const& context() const noexcept override;
-	[[nodiscard]] std::string_view  url() const noexcept override;
-	void append_headers(std::function<void(std::string_view)> append) const noexcept override;
-	[[nodiscard]] std::optional<std::string_view> post() const override;
-	void onreply(std::string_view reply, bool print) override;
-	void onfinish(bool print) override;
-
-   protected:
-	ryml::Tree    ctx;
-	ryml::NodeRef add_message(std::string_view role, std::string_view content);
+	[[nodiscard]] std::unique_ptr<plugin::session>
+	init(ryml::Tree context, std::span<arg const> args, std::string auth) const override;
+
+	struct session : plugin::session {
+		session(ryml::Tree context, std::span<arg const> args, std::string auth);
+		~session() override;
+
+		[[nodiscard]] ryml::Tree const& context() const noexcept override;
+		[[nodiscard]] std::string_view  url() const noexcept override;
+		void append_headers(std::function<void(std::string_view)> append) const noexcept override;
+		[[nodiscard]] std::optional<std::string_view> post() const override;
+		void consume(std::span<char const> chunk, std::vector<event>& events) override;
+		[[nodiscard]] bool done() const noexcept override;
+		void               onend() override;
+		[[nodiscard]] bool retry() override;
+		[[nodiscard]] std::optional<tokens> spent() const override;
+		[[nodiscard]] std::optional<tokens> estimate() const override;
+		[[nodiscard]] bool                  resume() override;
+		[[nodiscard]] bool                  awaiting() const override;
+		[[nodiscard]] std::vector<std::unique_ptr<plugin::session>> prepare() override;
+		[[nodiscard]] std::optional<bool> cached(std::string& response) override;
+		[[nodiscard]] std::vector<ryml::Tree> choices() const override;
+		void                                interrupt() override;
+		void               onfinish(std::vector<event>& events) override;
+
+	   protected:
+		ryml::Tree                   ctx;
+		std::unique_ptr<impl::state> st;
+		ryml::NodeRef add_message(std::string_view role, std::string_view content);
+		void          integrate(std::string json, std::vector<event>& events);
+		bool integrate_tool_calls(impl::reply& r, ryml::ConstNodeRef calls,
+		                          std::vector<event>* live);
+		void complete_tool_calls(impl::reply& r, std::size_t end, std::vector<event>* live);
+	};
 } gpt;
 
 } // namespace llmq
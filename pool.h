@@ -0,0 +1,225 @@
+#ifndef LLMQ_POOL_H_INCLUDED
+#define LLMQ_POOL_H_INCLUDED
+//  oooo  oooo
+//  `888  `888
+//   888   888  ooo. .oo.  .oo.    .ooooo oo
+//   888   888  `888P"Y88bP"Y88b  d88' `888
+//   888   888   888   888   888  888   888
+//  o888o o888o o888o o888o o888o `V8bod888
+//  ┌─────────────────────────────────┐ 888
+//  │ a query CLI and context manager │ 888.
+//  │ for LLM-powered shell pipelines │ 8P'
+//  └─────────────────────────────────┘ "
+//  Copyright (C) 2023 Justin Collier <m@jpcx.dev>
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//  You should have received a copy of the GNU Affero General Public License
+//  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <signal.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace llmq {
+
+// a work-stealing thread pool for the CPU-side processing of streams. each worker runs
+// its own jobs newest first and steals the oldest jobs of the others when it runs out.
+// idle workers park on an atomic epoch, so submitting only touches the lock of one deque.
+// strands keep the jobs of a session in order, so the network thread only moves bytes.
+struct pool {
+	using job = std::function<void()>;
+
+	// runs its jobs one at a time, in the order they were posted, on any worker.
+	// a strand must outlive its jobs; destroy the pool first if any may still be queued.
+	struct strand {
+		explicit strand(pool& p) noexcept : _pool{p} {}
+		strand(strand const&)            = delete;
+		strand& operator=(strand const&) = delete;
+
+		// queues j after every job posted before it. safe to call from any thread.
+		void
+		post(job j) {
+			{
+				std::lock_guard lock{_mutex};
+				_jobs.push_back(std::move(j));
+				if (_running)
+					return;
+				_running = true;
+			}
+			_pool.submit([this] {
+				drain();
+			});
+		}
+
+	   private:
+		// jobs run per turn before the strand yields its worker
+		static constexpr std::size_t turn = 64;
+
+		pool&           _pool;
+		std::mutex      _mutex{};
+		std::deque<job> _jobs{};
+		bool            _running{false};
+
+		void
+		drain() {
+			for (std::size_t n = 0; n < turn; ++n) {
+				job j;
+				{
+					std::lock_guard lock{_mutex};
+					if (_jobs.empty()) {
+						_running = false;
+						return;
+					}
+					j = std::move(_jobs.front());
+					_jobs.pop_front();
+				}
+				j();
+			}
+			// let the jobs of other strands run, then continue
+			_pool.submit([this] {
+				drain();
+			});
+		}
+	};
+
+	// workers block every signal, so signals reach the threads that drive the streams
+	explicit pool(unsigned threads = std::max(1u, std::thread::hardware_concurrency())) {
+		_workers.reserve(threads);
+		for (unsigned i = 0; i < threads; ++i)
+			_workers.push_back(std::make_unique<worker>());
+
+		::sigset_t all, old;
+		::sigfillset(&all);
+		::pthread_sigmask(SIG_BLOCK, &all, &old);
+		for (unsigned i = 0; i < threads; ++i)
+			_workers[i]->thread = std::thread{[this, i] {
+				work(i);
+			}};
+		::pthread_sigmask(SIG_SETMASK, &old, nullptr);
+	}
+	pool(pool const&)            = delete;
+	pool& operator=(pool const&) = delete;
+
+	// finishes every submitted job, then joins the workers
+	~pool() {
+		_stopping.store(true);
+		_epoch.fetch_add(1);
+		_epoch.notify_all();
+		for (auto&& w : _workers)
+			w->thread.join();
+	}
+
+	// queues a job. workers queue on their own deque; other threads spread jobs evenly.
+	void
+	submit(job j) {
+		std::size_t i = self < _workers.size() && current == this
+		                    ? self
+		                    : _next.fetch_add(1, std::memory_order_relaxed) % _workers.size();
+		{
+			std::lock_guard lock{_workers[i]->mutex};
+			_workers[i]->jobs.push_back(std::move(j));
+		}
+		// a worker about to park either sees the new epoch or is counted here
+		_epoch.fetch_add(1);
+		if (_parked.load())
+			_epoch.notify_one();
+	}
+
+	[[nodiscard]] std::size_t
+	size() const noexcept {
+		return _workers.size();
+	}
+
+   private:
+	struct worker {
+		std::mutex      mutex{};
+		std::deque<job> jobs{};
+		std::thread     thread{};
+	};
+
+	// the worker running on this thread, if any
+	inline static thread_local pool*       current = nullptr;
+	inline static thread_local std::size_t self    = 0;
+
+	std::vector<std::unique_ptr<worker>> _workers{};
+	std::atomic<std::size_t>             _next{0};
+	std::atomic<std::uint32_t>           _epoch{0}; // bumped by every submit
+	std::atomic<unsigned>                _parked{0};
+	std::atomic<bool>                    _stopping{false};
+
+	[[nodiscard]] bool
+	take(std::size_t i, job& j) {
+		// newest first from its own deque, for locality
+		{
+			auto&           w = *_workers[i];
+			std::lock_guard lock{w.mutex};
+			if (!w.jobs.empty()) {
+				j = std::move(w.jobs.back());
+				w.jobs.pop_back();
+				return true;
+			}
+		}
+		// oldest first from the others
+		for (std::size_t k = 1; k < _workers.size(); ++k) {
+			auto&           w = *_workers[(i + k) % _workers.size()];
+			std::lock_guard lock{w.mutex};
+			if (!w.jobs.empty()) {
+				j = std::move(w.jobs.front());
+				w.jobs.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void
+	work(std::size_t i) {
+		current = this;
+		self    = i;
+		for (job j;;) {
+			if (take(i, j)) {
+				j();
+				j = nullptr;
+				continue;
+			}
+			// announce the park, then look again: a job submitted after the epoch was
+			// read either is found here or changes the epoch before the wait
+			auto epoch = _epoch.load();
+			_parked.fetch_add(1);
+			if (take(i, j)) {
+				_parked.fetch_sub(1);
+				j();
+				j = nullptr;
+				continue;
+			}
+			if (_stopping.load()) {
+				_parked.fetch_sub(1);
+				return;
+			}
+			_epoch.wait(epoch);
+			_parked.fetch_sub(1);
+		}
+	}
+};
+
+} // namespace llmq
+
+#endif